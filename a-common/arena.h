@@ -0,0 +1,93 @@
+/* One aligned block per instance for the state and every buffer
+ * Copyright (C) 2016 Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef A_COMMON_ARENA_H
+#define A_COMMON_ARENA_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Memory is only allocated in instantiate(), all of it in one block, and
+ * freed in cleanup().  Each piece starts on a cache line, so vector loads
+ * of buffers and filter state never straddle one and two pieces never
+ * share a line.  The block is zeroed, which also faults in its pages
+ * before the first run().
+ *
+ * A plugin describes its layout once, in a function that takes every
+ * piece in the same order and stores the pointers when there is a block:
+ *
+ *	static Plugin*
+ *	plugin_layout(AArena* arena, uint32_t size)
+ *	{
+ *		Plugin* self = (Plugin*)aarena_take(arena, sizeof(Plugin));
+ *		float* z = (float*)aarena_take(arena, size * sizeof(float));
+ *		if (self) {
+ *			self->z = z;
+ *		}
+ *		return self;
+ *	}
+ *
+ * instantiate() runs it to size the block, then again to hand it out.
+ * The instance is the first piece, cleanup() frees the block through it.
+ */
+
+#define AARENA_ALIGN 64
+
+typedef struct {
+	uint8_t* base;
+	size_t size;
+	size_t used;
+} AArena;
+
+// Pointer to size bytes, NULL while sizing
+static inline void*
+aarena_take(AArena* arena, size_t size)
+{
+	void* ptr = NULL;
+
+	if (arena->base) {
+		if (arena->used + size > arena->size) {
+			return NULL;
+		}
+		ptr = arena->base + arena->used;
+	}
+	arena->used += (size + AARENA_ALIGN - 1) & ~(size_t)(AARENA_ALIGN - 1);
+	return ptr;
+}
+
+// After the sizing pass: the block, zeroed; returns non-zero on failure
+static inline int
+aarena_alloc(AArena* arena)
+{
+	void* base;
+
+	if (posix_memalign(&base, AARENA_ALIGN, arena->used)) {
+		return -1;
+	}
+	memset(base, 0, arena->used);
+	arena->base = (uint8_t*)base;
+	arena->size = arena->used;
+	arena->used = 0;
+	return 0;
+}
+
+static inline void
+aarena_free(void* first)
+{
+	free(first);
+}
+
+#endif
@@ -0,0 +1,98 @@
+/* Flush-to-zero and denormals-are-zero for the duration of run()
+ * Copyright (C) 2016 Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef A_COMMON_DENORMAL_H
+#define A_COMMON_DENORMAL_H
+
+/*
+ * Recursive filters decaying into silence pass through the denormal
+ * range, where every operation can take a hundred cycles.  Rather than
+ * checking values in the loops, run() sets the FPU to flush denormal
+ * results and inputs to zero and gives the host its mode back on return:
+ *
+ *	const afpu_state fpu = afpu_flush_denormals();
+ *	...
+ *	afpu_restore(fpu);
+ *
+ * Only the control register of the calling thread changes, and only
+ * when the host did not set the flags already.
+ */
+
+#if defined(__SSE__) || defined(__x86_64__)
+# include <xmmintrin.h>
+// MXCSR flush-to-zero and denormals-are-zero
+# define AFPU_FLAGS 0x8040u
+#elif defined(__aarch64__) || (defined(__arm__) && defined(__ARM_FP))
+// FPCR or FPSCR flush-to-zero, which covers inputs too
+# define AFPU_FLAGS (1u << 24)
+#endif
+
+typedef unsigned long afpu_state;
+
+static inline afpu_state
+afpu_get(void)
+{
+#if defined(__SSE__) || defined(__x86_64__)
+	return _mm_getcsr();
+#elif defined(__aarch64__)
+	unsigned long fpcr;
+	__asm__ __volatile__("mrs %0, fpcr" : "=r"(fpcr));
+	return fpcr;
+#elif defined(__arm__) && defined(__ARM_FP)
+	unsigned int fpscr;
+	__asm__ __volatile__("vmrs %0, fpscr" : "=r"(fpscr));
+	return fpscr;
+#else
+	return 0;
+#endif
+}
+
+static inline void
+afpu_set(afpu_state state)
+{
+#if defined(__SSE__) || defined(__x86_64__)
+	_mm_setcsr((unsigned int)state);
+#elif defined(__aarch64__)
+	__asm__ __volatile__("msr fpcr, %0" : : "r"(state));
+#elif defined(__arm__) && defined(__ARM_FP)
+	__asm__ __volatile__("vmsr fpscr, %0" : : "r"((unsigned int)state));
+#else
+	(void)state;
+#endif
+}
+
+// Returns the mode to hand to afpu_restore()
+static inline afpu_state
+afpu_flush_denormals(void)
+{
+	const afpu_state state = afpu_get();
+#ifdef AFPU_FLAGS
+	if ((state & AFPU_FLAGS) != AFPU_FLAGS) {
+		afpu_set(state | AFPU_FLAGS);
+	}
+#endif
+	return state;
+}
+
+static inline void
+afpu_restore(afpu_state state)
+{
+#ifdef AFPU_FLAGS
+	if ((state & AFPU_FLAGS) != AFPU_FLAGS) {
+		afpu_set(state);
+	}
+#endif
+}
+
+#endif
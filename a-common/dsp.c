@@ -0,0 +1,117 @@
+/* Runtime selection of the block DSP kernels
+ * Copyright (C) 2016 Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(ADSP_HAVE_NEON) && defined(__arm__)
+# include <sys/auxv.h>
+# include <asm/hwcap.h>
+#endif
+
+#include "dsp.h"
+
+// ADSP_HAVE_<ISA> is set by the Makefile for each table built for the target
+extern const struct adsp adsp_scalar;
+#ifdef ADSP_HAVE_SSE2
+extern const struct adsp adsp_sse2;
+#endif
+#ifdef ADSP_HAVE_AVX2
+extern const struct adsp adsp_avx2;
+#endif
+#ifdef ADSP_HAVE_AVX512
+extern const struct adsp adsp_avx512;
+#endif
+#ifdef ADSP_HAVE_NEON
+extern const struct adsp adsp_neon;
+#endif
+
+// Best first, scalar always runs
+static const struct adsp* const tables[] = {
+#ifdef ADSP_HAVE_AVX512
+	&adsp_avx512,
+#endif
+#ifdef ADSP_HAVE_AVX2
+	&adsp_avx2,
+#endif
+#ifdef ADSP_HAVE_SSE2
+	&adsp_sse2,
+#endif
+#ifdef ADSP_HAVE_NEON
+	&adsp_neon,
+#endif
+	&adsp_scalar
+};
+
+static const struct adsp* selected;
+
+static int
+cpu_runs(const struct adsp* dsp)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_cpu_init();
+#endif
+#ifdef ADSP_HAVE_AVX512
+	if (dsp == &adsp_avx512) {
+		return __builtin_cpu_supports("avx512f");
+	}
+#endif
+#ifdef ADSP_HAVE_AVX2
+	if (dsp == &adsp_avx2) {
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	}
+#endif
+#ifdef ADSP_HAVE_SSE2
+	if (dsp == &adsp_sse2) {
+		return __builtin_cpu_supports("sse2");
+	}
+#endif
+#if defined(ADSP_HAVE_NEON) && defined(__arm__)
+	if (dsp == &adsp_neon) {
+		return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+	}
+#endif
+	return 1;
+}
+
+/* Plugins call this from instantiate(), several instances may race on the
+ * first call but all of them pick the same table */
+const struct adsp*
+adsp_get(void)
+{
+	const struct adsp* dsp = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+	const char* isa;
+	uint32_t t;
+
+	if (dsp) {
+		return dsp;
+	}
+
+	isa = getenv("ADSP_ISA");
+	for (t = 0; t < sizeof(tables) / sizeof(tables[0]); t++) {
+		if (!cpu_runs(tables[t])) {
+			continue;
+		}
+		if (!dsp) {
+			dsp = tables[t];
+		}
+		if (isa && !strcmp(isa, tables[t]->isa)) {
+			dsp = tables[t];
+			break;
+		}
+	}
+
+	__atomic_store_n(&selected, dsp, __ATOMIC_RELEASE);
+	return dsp;
+}
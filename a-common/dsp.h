@@ -0,0 +1,109 @@
+/* Block DSP primitives shared by the plugins, with runtime CPU dispatch
+ * Copyright (C) 2016 Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef A_COMMON_DSP_H
+#define A_COMMON_DSP_H
+
+#include <math.h>
+#include <stdint.h>
+
+static inline float
+from_dB(float gdb) {
+	return (exp(gdb/20.f*log(10.f)));
+}
+
+static inline float
+to_dB(float g) {
+	return (20.f*log10(g));
+}
+
+/*
+ * Fast log2/exp2 for per-sample gain paths.
+ *
+ * Both split off the float exponent and approximate the mantissa part with
+ * a polynomial fitted on [0,1).  Including float rounding, levels derived
+ * from fast_log2 stay within 2e-4 dB of to_dB for all normal inputs and
+ * fast_from_dB within 5e-5 dB of from_dB over -160..+40 dB.
+ * Written without branches or libm calls so the block loops vectorize.
+ */
+static inline float
+fast_log2(float x)
+{
+	union { float f; int32_t i; } v = { x };
+	const float e = (float)((v.i >> 23) & 0xff) - 127.f;
+	float t;
+
+	v.i = (v.i & 0x007fffff) | 0x3f800000;
+	t = v.f - 1.f;
+	return e + t * (1.44196547f + t * (-0.709661431f + t * (0.417591588f
+		+ t * (-0.196264634f + t * 0.0463833023f))));
+}
+
+static inline float
+fast_exp2(float x)
+{
+	union { int32_t i; float f; } v;
+	int32_t i;
+	float t;
+
+	x = (x > -126.f) ? x : -126.f;
+	i = (int32_t)x;
+	i -= (x < (float)i);
+	t = x - (float)i;
+	v.i = (i + 127) << 23;
+	return v.f * (1.f + t * (0.693018524f + t * (0.241445527f
+		+ t * (0.0519505174f + t * 0.013581262f))));
+}
+
+static inline float
+fast_from_dB(float gdb) {
+	return fast_exp2(0.166096405f * gdb);
+}
+
+/*
+ * Block primitives of libacommon.a, one table per instruction set built
+ * from the same source.  Buffers need no alignment and y may be x.
+ */
+struct adsp {
+	// Instruction set of the table: scalar, sse2, avx2, avx512 or neon
+	const char* isa;
+
+	// y = x * g, per sample gain
+	void (*mul)(float* y, const float* x, const float* g, uint32_t n);
+	// y = x * g, one gain for the block
+	void (*scale)(float* y, const float* x, float g, uint32_t n);
+	// y = |x|
+	void (*abs)(float* y, const float* x, uint32_t n);
+	// y = max(y, |x|)
+	void (*abs_max)(float* y, const float* x, uint32_t n);
+	// y = x * x
+	void (*sqr)(float* y, const float* x, uint32_t n);
+	// y += x * x
+	void (*sqr_add)(float* y, const float* x, uint32_t n);
+	// max |x| over the block, 0 for n = 0
+	float (*peak)(const float* x, uint32_t n);
+	// *lo = min(*lo, x), *hi = max(*hi, x) over the block
+	void (*min_max)(const float* x, uint32_t n, float* lo, float* hi);
+	// y = max(k * fast_log2(x) + offset, lowest)
+	void (*level_dB)(float* y, const float* x, float k, float offset, float lowest, uint32_t n);
+	// y = gain * fast_from_dB(k * x)
+	void (*gain_dB)(float* y, const float* x, float k, float gain, uint32_t n);
+};
+
+/* The best table the CPU runs, chosen on the first call.  The environment
+ * variable ADSP_ISA names another one to compare against, it is ignored
+ * when not built in or not supported. */
+const struct adsp* adsp_get(void);
+
+#endif
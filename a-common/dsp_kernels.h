@@ -0,0 +1,172 @@
+/* Block DSP kernels, compiled once per instruction set
+ * Copyright (C) 2016 Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/* Included by dsp_<isa>.c with ADSP_ISA set to <isa>, which defines the
+ * table adsp_<isa>.  The loops are plain C without branches, the vector
+ * width comes from the flags the file is compiled with. */
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "dsp.h"
+
+#ifndef ADSP_ISA
+# error "ADSP_ISA must name the instruction set"
+#endif
+
+#define ADSP_CAT(a, b) a ## b
+#define ADSP_TABLE(isa) ADSP_CAT(adsp_, isa)
+#define ADSP_STR(isa) ADSP_STR2(isa)
+#define ADSP_STR2(isa) #isa
+
+static void
+mul(float* y, const float* x, const float* g, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		y[i] = x[i] * g[i];
+	}
+}
+
+static void
+scale(float* y, const float* x, float g, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		y[i] = x[i] * g;
+	}
+}
+
+static void
+block_abs(float* y, const float* x, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		y[i] = fabsf(x[i]);
+	}
+}
+
+static void
+abs_max(float* y, const float* x, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		y[i] = (fabsf(x[i]) > y[i]) ? fabsf(x[i]) : y[i];
+	}
+}
+
+static void
+sqr(float* y, const float* x, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		y[i] = x[i] * x[i];
+	}
+}
+
+static void
+sqr_add(float* y, const float* x, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		y[i] += x[i] * x[i];
+	}
+}
+
+// compared as integers so the reduction vectorizes
+static float
+peak(const float* x, uint32_t n)
+{
+	int32_t p = 0;
+	float max;
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		union { float f; int32_t i; } v = { x[i] };
+		v.i &= 0x7fffffff;
+		p = (v.i > p) ? v.i : p;
+	}
+	memcpy(&max, &p, sizeof(max));
+	return max;
+}
+
+/* Floats mapped to integers of the same order, negative ones with the
+ * magnitude bits flipped, so both reductions vectorize.  The mapping is
+ * its own inverse. */
+static inline int32_t
+ordered(int32_t i)
+{
+	return i ^ ((i >> 31) & 0x7fffffff);
+}
+
+static void
+min_max(const float* x, uint32_t n, float* lo, float* hi)
+{
+	union { float f; int32_t i; } l = { *lo }, h = { *hi };
+	int32_t a = ordered(l.i), b = ordered(h.i);
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		union { float f; int32_t i; } v = { x[i] };
+		const int32_t k = ordered(v.i);
+		a = (k < a) ? k : a;
+		b = (k > b) ? k : b;
+	}
+	l.i = ordered(a);
+	h.i = ordered(b);
+	*lo = l.f;
+	*hi = h.f;
+}
+
+static void
+level_dB(float* y, const float* x, float k, float offset, float lowest, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		const float l = k * fast_log2(x[i]) + offset;
+		y[i] = (l > lowest) ? l : lowest;
+	}
+}
+
+static void
+gain_dB(float* y, const float* x, float k, float gain, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		y[i] = fast_from_dB(k * x[i]) * gain;
+	}
+}
+
+const struct adsp ADSP_TABLE(ADSP_ISA) = {
+	ADSP_STR(ADSP_ISA),
+	mul,
+	scale,
+	block_abs,
+	abs_max,
+	sqr,
+	sqr_add,
+	peak,
+	min_max,
+	level_dB,
+	gain_dB
+};
@@ -0,0 +1,301 @@
+/* Radix-2 FFT of real signals in split format, for partitioned convolution
+ * Copyright (C) 2016 Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef A_COMMON_FFT_H
+#define A_COMMON_FFT_H
+
+#include <math.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#ifndef M_PI
+# define M_PI 3.14159265358979323846
+#endif
+
+/* A real signal of 2 * n samples has the spectrum X[0] .. X[n].  It is
+ * kept as n complex values in two arrays re[] and im[], with the real
+ * Nyquist bin X[n] stored in im[0] next to the real DC bin in re[0].
+ *
+ * afft_inverse() is unnormalized: forward then inverse scales by n. */
+struct afft {
+	uint32_t n;
+	uint32_t* rev;
+	// Twiddles of the butterfly stage of half size h at [h, 2h)
+	float* wr;
+	float* wi;
+	// exp(-j pi k / n) to split and merge the real spectrum
+	float* rr;
+	float* ri;
+};
+
+/* Tables for the complex size n, a power of two >= 8, from the arena of
+ * the instance self is part of; self is NULL while sizing */
+static inline void afft_take(struct afft *self, AArena *arena, uint32_t n)
+{
+	uint32_t* rev = (uint32_t*)aarena_take(arena, n * sizeof(uint32_t));
+	float* wr = (float*)aarena_take(arena, n * sizeof(float));
+	float* wi = (float*)aarena_take(arena, n * sizeof(float));
+	float* rr = (float*)aarena_take(arena, n * sizeof(float));
+	float* ri = (float*)aarena_take(arena, n * sizeof(float));
+
+	if (self) {
+		self->n = n;
+		self->rev = rev;
+		self->wr = wr;
+		self->wi = wi;
+		self->rr = rr;
+		self->ri = ri;
+	}
+}
+
+// Fills in the tables afft_take() handed out
+static inline void afft_init(struct afft *self)
+{
+	const uint32_t n = self->n;
+	uint32_t i, h, bits = 0;
+
+	while ((1u << bits) < n) {
+		bits++;
+	}
+	for (i = 0; i < n; i++) {
+		uint32_t r = 0, b;
+		for (b = 0; b < bits; b++) {
+			r |= ((i >> b) & 1) << (bits - 1 - b);
+		}
+		self->rev[i] = r;
+	}
+
+	self->wr[0] = 1.f;
+	self->wi[0] = 0.f;
+	for (h = 1; h < n; h <<= 1) {
+		for (i = 0; i < h; i++) {
+			self->wr[h + i] = cos(M_PI * i / h);
+			self->wi[h + i] = -sin(M_PI * i / h);
+		}
+	}
+	for (i = 0; i < n; i++) {
+		self->rr[i] = cos(M_PI * i / n);
+		self->ri[i] = -sin(M_PI * i / n);
+	}
+}
+
+typedef float afft_vec __attribute__((vector_size(16), aligned(4)));
+typedef int32_t afft_mask __attribute__((vector_size(16)));
+
+/* Complex FFT of the n >= 8 points interleaved in x, into re and im in
+ * natural order: decimation in time, the bit reversal folded into the
+ * first two stages. */
+static inline void afft_dit(const struct afft *self, const float *x, float *re, float *im)
+{
+	const uint32_t n = self->n;
+	const uint32_t* const rev = self->rev;
+	uint32_t i, j, h;
+
+	// First two stages as radix 4, the twiddle of the second is -j
+	for (i = 0; i < n; i += 4) {
+		const float* const a = x + 2 * rev[i];
+		const float* const b = x + 2 * rev[i + 1];
+		const float* const c = x + 2 * rev[i + 2];
+		const float* const d = x + 2 * rev[i + 3];
+		const float sr = a[0] + b[0], si = a[1] + b[1];
+		const float dr = a[0] - b[0], di = a[1] - b[1];
+		const float tr = c[0] + d[0], ti = c[1] + d[1];
+		const float ur = c[0] - d[0], ui = c[1] - d[1];
+		re[i] = sr + tr;
+		im[i] = si + ti;
+		re[i + 1] = dr + ui;
+		im[i + 1] = di - ur;
+		re[i + 2] = sr - tr;
+		im[i + 2] = si - ti;
+		re[i + 3] = dr - ui;
+		im[i + 3] = di + ur;
+	}
+
+	for (h = 4; h < n; h <<= 1) {
+		for (i = 0; i < n; i += 2 * h) {
+			for (j = 0; j < h; j += 4) {
+				afft_vec* const ar = (afft_vec*)(re + i + j);
+				afft_vec* const ai = (afft_vec*)(im + i + j);
+				afft_vec* const br = (afft_vec*)(re + i + j + h);
+				afft_vec* const bi = (afft_vec*)(im + i + j + h);
+				const afft_vec wr = *(const afft_vec*)(self->wr + h + j);
+				const afft_vec wi = *(const afft_vec*)(self->wi + h + j);
+				const afft_vec xr = *ar, xi = *ai;
+				const afft_vec yr = *br, yi = *bi;
+				const afft_vec tr = yr * wr - yi * wi;
+				const afft_vec ti = yr * wi + yi * wr;
+				*ar = xr + tr;
+				*ai = xi + ti;
+				*br = xr - tr;
+				*bi = xi - ti;
+			}
+		}
+	}
+}
+
+/* Unnormalized inverse of afft_dit(): decimation in frequency from re and
+ * im, which it overwrites, the last two stages write x in natural order */
+static inline void afft_dif(const struct afft *self, float *re, float *im, float *x)
+{
+	const uint32_t n = self->n;
+	const uint32_t* const rev = self->rev;
+	uint32_t i, j, h;
+
+	for (h = n / 2; h >= 4; h >>= 1) {
+		for (i = 0; i < n; i += 2 * h) {
+			for (j = 0; j < h; j += 4) {
+				afft_vec* const ar = (afft_vec*)(re + i + j);
+				afft_vec* const ai = (afft_vec*)(im + i + j);
+				afft_vec* const br = (afft_vec*)(re + i + j + h);
+				afft_vec* const bi = (afft_vec*)(im + i + j + h);
+				const afft_vec wr = *(const afft_vec*)(self->wr + h + j);
+				const afft_vec wi = *(const afft_vec*)(self->wi + h + j);
+				const afft_vec xr = *ar, xi = *ai;
+				const afft_vec yr = *br, yi = *bi;
+				const afft_vec dr = xr - yr;
+				const afft_vec di = xi - yi;
+				*ar = xr + yr;
+				*ai = xi + yi;
+				*br = dr * wr + di * wi;
+				*bi = di * wr - dr * wi;
+			}
+		}
+	}
+
+	// Last two stages as radix 4, the twiddle of the first is j
+	for (i = 0; i < n; i += 4) {
+		float* const a = x + 2 * rev[i];
+		float* const b = x + 2 * rev[i + 1];
+		float* const c = x + 2 * rev[i + 2];
+		float* const d = x + 2 * rev[i + 3];
+		const float sr = re[i] + re[i + 2], si = im[i] + im[i + 2];
+		const float dr = re[i] - re[i + 2], di = im[i] - im[i + 2];
+		const float tr = re[i + 1] + re[i + 3], ti = im[i + 1] + im[i + 3];
+		const float ur = im[i + 3] - im[i + 1], ui = re[i + 1] - re[i + 3];
+		a[0] = sr + tr;
+		a[1] = si + ti;
+		b[0] = sr - tr;
+		b[1] = si - ti;
+		c[0] = dr + ur;
+		c[1] = di + ui;
+		d[0] = dr - ur;
+		d[1] = di - ui;
+	}
+}
+
+/* The spectrum of a real signal from that of its even and odd samples as
+ * one complex signal, Z[k] and Z[n - k] give X[k] and X[n - k].  Lanes
+ * run up from k = 4 * b + 1 and down from n - k, up to k = n / 2 which
+ * both sides compute alike. */
+
+static inline afft_vec afft_reverse(afft_vec v)
+{
+	static const afft_mask reverse = { 3, 2, 1, 0 };
+	return __builtin_shuffle(v, reverse);
+}
+
+// Spectrum of the 2n samples in x
+static inline void afft_forward(const struct afft *self, const float *x, float *re, float *im)
+{
+	const uint32_t n = self->n;
+	const afft_vec half = { 0.5f, 0.5f, 0.5f, 0.5f };
+	uint32_t k;
+	float dc;
+
+	// Even samples as real, odd as imaginary part of an n point signal
+	afft_dit(self, x, re, im);
+
+	dc = re[0];
+	re[0] = dc + im[0];
+	im[0] = dc - im[0];
+	for (k = 1; k < n / 2; k += 4) {
+		afft_vec* const kr = (afft_vec*)(re + k);
+		afft_vec* const ki = (afft_vec*)(im + k);
+		afft_vec* const mr = (afft_vec*)(re + n - k - 3);
+		afft_vec* const mi = (afft_vec*)(im + n - k - 3);
+		const afft_vec rr = *(const afft_vec*)(self->rr + k);
+		const afft_vec ri = *(const afft_vec*)(self->ri + k);
+		const afft_vec zr = *kr, zi = *ki;
+		const afft_vec yr = afft_reverse(*mr), yi = afft_reverse(*mi);
+		const afft_vec er = half * (zr + yr);
+		const afft_vec ei = half * (zi - yi);
+		const afft_vec or = half * (zi + yi);
+		const afft_vec oi = half * (yr - zr);
+		const afft_vec tr = rr * or - ri * oi;
+		const afft_vec ti = rr * oi + ri * or;
+
+		*kr = er + tr;
+		*ki = ei + ti;
+		*mr = afft_reverse(er - tr);
+		*mi = afft_reverse(ti - ei);
+	}
+}
+
+// 2n samples of the spectrum in re and im times n, overwrites re and im
+static inline void afft_inverse(const struct afft *self, float *re, float *im, float *x)
+{
+	const uint32_t n = self->n;
+	const afft_vec half = { 0.5f, 0.5f, 0.5f, 0.5f };
+	uint32_t k;
+	float dc;
+
+	dc = re[0];
+	re[0] = 0.5f * (dc + im[0]);
+	im[0] = 0.5f * (dc - im[0]);
+	for (k = 1; k < n / 2; k += 4) {
+		afft_vec* const kr = (afft_vec*)(re + k);
+		afft_vec* const ki = (afft_vec*)(im + k);
+		afft_vec* const mr = (afft_vec*)(re + n - k - 3);
+		afft_vec* const mi = (afft_vec*)(im + n - k - 3);
+		const afft_vec rr = *(const afft_vec*)(self->rr + k);
+		const afft_vec ri = *(const afft_vec*)(self->ri + k);
+		const afft_vec zr = *kr, zi = *ki;
+		const afft_vec yr = afft_reverse(*mr), yi = afft_reverse(*mi);
+		const afft_vec er = half * (zr + yr);
+		const afft_vec ei = half * (zi - yi);
+		const afft_vec dr = half * (zr - yr);
+		const afft_vec di = half * (zi + yi);
+		const afft_vec or = dr * rr + di * ri;
+		const afft_vec oi = di * rr - dr * ri;
+
+		*kr = er - oi;
+		*ki = ei + or;
+		*mr = afft_reverse(er + oi);
+		*mi = afft_reverse(or - ei);
+	}
+
+	// Even and odd output samples are the real and imaginary parts
+	afft_dif(self, re, im, x);
+}
+
+// y += x * h over the n values of a split spectrum
+static inline void afft_mac(uint32_t n, const float *xr, const float *xi,
+                            const float *hr, const float *hi, float *yr, float *yi)
+{
+	const float dc = yr[0] + xr[0] * hr[0];
+	const float nyquist = yi[0] + xi[0] * hi[0];
+	uint32_t k;
+
+	for (k = 0; k < n; k++) {
+		const float r = xr[k] * hr[k] - xi[k] * hi[k];
+		const float i = xr[k] * hi[k] + xi[k] * hr[k];
+		yr[k] += r;
+		yi[k] += i;
+	}
+	yr[0] = dc;
+	yi[0] = nyquist;
+}
+
+#endif
@@ -0,0 +1,155 @@
+/* Per block meter statistics for hosts and UIs
+ * Copyright (C) 2016 Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef A_COMMON_METER_H
+#define A_COMMON_METER_H
+
+#include <stdint.h>
+
+#include "lv2/lv2plug.in/ns/lv2core/lv2.h"
+#include "lv2/lv2plug.in/ns/ext/atom/forge.h"
+#include "lv2/lv2plug.in/ns/ext/urid/urid.h"
+
+/*
+ * A control port only shows the value at the end of each run(), which
+ * aliases a gain reduction meter and leaves nothing to draw history from.
+ * run() sums up each block once into an AMeterBlock instead and hands it
+ * out twice: as an object on the plugin's notify port, and into a ring a
+ * UI or host thread reads through AMETER__interface.  The ring has one
+ * writer, run(), and one reader, and needs no locks: each side only
+ * stores its own index, with release order after the entries it covers.
+ */
+
+// Level reported for a silent block, dBFS
+#define AMETER_FLOOR -160.f
+
+// Blocks held by the ring, a power of two
+#define AMETER_RING 256
+
+typedef struct {
+	// First sample of the block, counted from activate()
+	uint64_t frame;
+	uint32_t length;
+	// Gain reduction over the block in dB, 0 for plugins without
+	float gr_min;
+	float gr_max;
+	// Peak of the outputs in dBFS
+	float peak;
+} AMeterBlock;
+
+/* The indices are a cache line apart, so the two threads do not
+ * invalidate each other's line with every block */
+typedef struct {
+	AMeterBlock block[AMETER_RING];
+	uint32_t head;
+	// Blocks lost to a full ring, counted by the writer
+	uint32_t dropped;
+	uint8_t pad[64 - 2 * sizeof(uint32_t)];
+	uint32_t tail;
+} AMeterRing;
+
+// Writer side, from run().  Drops the block when the reader falls behind.
+static inline void
+ameter_push(AMeterRing* ring, const AMeterBlock* block)
+{
+	const uint32_t head = ring->head;
+
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= AMETER_RING) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	ring->block[head & (AMETER_RING - 1)] = *block;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Reader side: copies up to n blocks, oldest first, returns how many
+static inline uint32_t
+ameter_pop(AMeterRing* ring, AMeterBlock* blocks, uint32_t n)
+{
+	const uint32_t tail = ring->tail;
+	const uint32_t avail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+	uint32_t i;
+
+	if (n > avail) {
+		n = avail;
+	}
+	for (i = 0; i < n; i++) {
+		blocks[i] = ring->block[(tail + i) & (AMETER_RING - 1)];
+	}
+	__atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+/* Returned by extension_data() of plugins that meter.  read() may run on
+ * one thread at a time, concurrently with run(). */
+#define AMETER__interface "urn:ardour:a-plugins#meter"
+
+typedef struct {
+	uint32_t (*read)(LV2_Handle instance, AMeterBlock* blocks, uint32_t n);
+	// Blocks dropped so far because nobody read them in time
+	uint32_t (*dropped)(LV2_Handle instance);
+} AMeterInterface;
+
+/* The notify port carries one atom:Object of type AMETER__Block per
+ * run(), with the fields of AMeterBlock as properties */
+#define AMETER_PREFIX "urn:ardour:a-plugins#"
+#define AMETER__Block  AMETER_PREFIX "MeterBlock"
+#define AMETER__frame  AMETER_PREFIX "frame"
+#define AMETER__length AMETER_PREFIX "length"
+#define AMETER__grMin  AMETER_PREFIX "grMin"
+#define AMETER__grMax  AMETER_PREFIX "grMax"
+#define AMETER__peak   AMETER_PREFIX "peak"
+
+typedef struct {
+	LV2_URID Block;
+	LV2_URID frame;
+	LV2_URID length;
+	LV2_URID gr_min;
+	LV2_URID gr_max;
+	LV2_URID peak;
+} AMeterURIs;
+
+static inline void
+ameter_map_uris(LV2_URID_Map* map, AMeterURIs* uris)
+{
+	uris->Block  = map->map(map->handle, AMETER__Block);
+	uris->frame  = map->map(map->handle, AMETER__frame);
+	uris->length = map->map(map->handle, AMETER__length);
+	uris->gr_min = map->map(map->handle, AMETER__grMin);
+	uris->gr_max = map->map(map->handle, AMETER__grMax);
+	uris->peak   = map->map(map->handle, AMETER__peak);
+}
+
+// One event at time 0 into a sequence the caller has started
+static inline void
+ameter_forge(LV2_Atom_Forge* forge, const AMeterURIs* uris, const AMeterBlock* block)
+{
+	LV2_Atom_Forge_Frame frame;
+
+	lv2_atom_forge_frame_time(forge, 0);
+	lv2_atom_forge_object(forge, &frame, 0, uris->Block);
+	lv2_atom_forge_key(forge, uris->frame);
+	lv2_atom_forge_long(forge, (int64_t)block->frame);
+	lv2_atom_forge_key(forge, uris->length);
+	lv2_atom_forge_int(forge, (int32_t)block->length);
+	lv2_atom_forge_key(forge, uris->gr_min);
+	lv2_atom_forge_float(forge, block->gr_min);
+	lv2_atom_forge_key(forge, uris->gr_max);
+	lv2_atom_forge_float(forge, block->gr_max);
+	lv2_atom_forge_key(forge, uris->peak);
+	lv2_atom_forge_float(forge, block->peak);
+	lv2_atom_forge_pop(forge, &frame);
+}
+
+#endif
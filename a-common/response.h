@@ -0,0 +1,100 @@
+/* Frequency response of the current settings for hosts and UIs
+ * Copyright (C) 2016 Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef A_COMMON_RESPONSE_H
+#define A_COMMON_RESPONSE_H
+
+#include <stdint.h>
+
+#include "lv2/lv2plug.in/ns/lv2core/lv2.h"
+#include "lv2/lv2plug.in/ns/ext/atom/forge.h"
+#include "lv2/lv2plug.in/ns/ext/urid/urid.h"
+
+/*
+ * Drawing an EQ curve by running impulses through a second instance
+ * costs a plugin per UI and still only shows a windowed estimate.  The
+ * filters are known in closed form, so the plugin evaluates them itself:
+ * at any frequencies through ARESPONSE__interface, and on a fixed grid
+ * as an object on its notify port.  Both show the settings the filters
+ * are heading to, not where the smoothing is at.
+ */
+
+// Level reported where the response is zero, dB
+#define ARESPONSE_FLOOR -160.f
+
+/* Returned by extension_data() of plugins with a known response.
+ * response() may run on any thread, concurrently with run(). */
+#define ARESPONSE__interface "urn:ardour:a-plugins#response"
+
+typedef struct {
+	/* Magnitude in dB and phase in radians at n frequencies in Hz,
+	 * phase may be NULL.  Returns the generation of the settings
+	 * evaluated, which changes with them and is 0 before the first
+	 * run(). */
+	uint32_t (*response)(LV2_Handle instance, const float* freq,
+	                     float* magnitude, float* phase, uint32_t n);
+} AResponseInterface;
+
+/* The notify port carries an atom:Object of type ARESPONSE__Curve after
+ * the settings change, and again now and then for UIs that open later,
+ * each property an atom:Vector of floats */
+#define ARESPONSE_PREFIX "urn:ardour:a-plugins#"
+#define ARESPONSE__Curve     ARESPONSE_PREFIX "Curve"
+#define ARESPONSE__frequency ARESPONSE_PREFIX "frequency"
+#define ARESPONSE__magnitude ARESPONSE_PREFIX "magnitude"
+#define ARESPONSE__phase     ARESPONSE_PREFIX "phase"
+
+typedef struct {
+	LV2_URID Curve;
+	LV2_URID frequency;
+	LV2_URID magnitude;
+	LV2_URID phase;
+} AResponseURIs;
+
+static inline void
+aresponse_map_uris(LV2_URID_Map* map, AResponseURIs* uris)
+{
+	uris->Curve     = map->map(map->handle, ARESPONSE__Curve);
+	uris->frequency = map->map(map->handle, ARESPONSE__frequency);
+	uris->magnitude = map->map(map->handle, ARESPONSE__magnitude);
+	uris->phase     = map->map(map->handle, ARESPONSE__phase);
+}
+
+// Bytes of the event for n points, from the event header on
+static inline uint32_t
+aresponse_forge_size(uint32_t n)
+{
+	return 32 + 3 * (24 + ((4 * n + 7) & ~7u));
+}
+
+// One event at time 0 into a sequence the caller has started
+static inline void
+aresponse_forge(LV2_Atom_Forge* forge, const AResponseURIs* uris,
+                const float* freq, const float* magnitude, const float* phase,
+                uint32_t n)
+{
+	LV2_Atom_Forge_Frame frame;
+
+	lv2_atom_forge_frame_time(forge, 0);
+	lv2_atom_forge_object(forge, &frame, 0, uris->Curve);
+	lv2_atom_forge_key(forge, uris->frequency);
+	lv2_atom_forge_vector(forge, sizeof(float), forge->Float, n, freq);
+	lv2_atom_forge_key(forge, uris->magnitude);
+	lv2_atom_forge_vector(forge, sizeof(float), forge->Float, n, magnitude);
+	lv2_atom_forge_key(forge, uris->phase);
+	lv2_atom_forge_vector(forge, sizeof(float), forge->Float, n, phase);
+	lv2_atom_forge_pop(forge, &frame);
+}
+
+#endif
@@ -0,0 +1,262 @@
+/* Linear trapezoidal state variable filter, shared by a-eq and a-filter
+ * Copyright (C) 2016 Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef A_COMMON_SVF_H
+#define A_COMMON_SVF_H
+
+#include <math.h>
+#include <stdint.h>
+
+#ifndef M_PI
+# define M_PI 3.14159265358979323846
+#endif
+
+// SVF filters
+// http://www.cytomic.com/files/dsp/SvfLinearTrapOptimised2.pdf
+
+/* Coefficients and the state of one filter: the output is
+ * m[0] * in + m[1] * v1 + m[2] * v2 (band and low) */
+struct linear_svf {
+	double g, k;
+	double a[3];
+	double m[3];
+	double s[2];
+};
+
+static inline void linear_svf_reset(struct linear_svf *self)
+{
+	self->s[0] = self->s[1] = 0.0;
+}
+
+// a[] from g and k
+static inline void linear_svf_set_gk(struct linear_svf *self, double g, double k)
+{
+	self->g = g;
+	self->k = k;
+
+	self->a[0] = 1.0 / (1.0 + self->g * (self->g + self->k));
+	self->a[1] = self->g * self->a[0];
+	self->a[2] = self->g * self->a[1];
+}
+
+static inline void linear_svf_set_m(struct linear_svf *self, double m0, double m1, double m2)
+{
+	self->m[0] = m0;
+	self->m[1] = m1;
+	self->m[2] = m2;
+}
+
+static inline void linear_svf_set_hp(struct linear_svf *self, float sample_rate, float cutoff, float resonance)
+{
+	double f0 = (double)cutoff;
+	double q = (double)resonance;
+	double sr = (double)sample_rate;
+
+	linear_svf_set_gk(self, tan(M_PI * (f0 / sr)), 1.0 / q);
+	linear_svf_set_m(self, 1.0, -self->k, -1.0);
+}
+
+static inline void linear_svf_set_lp(struct linear_svf *self, float sample_rate, float cutoff, float resonance)
+{
+	double f0 = (double)cutoff;
+	double q = (double)resonance;
+	double sr = (double)sample_rate;
+
+	linear_svf_set_gk(self, tan(M_PI * (f0 / sr)), 1.0 / q);
+	linear_svf_set_m(self, 0.0, 0.0, 1.0);
+}
+
+// Bandpass normalized to 0 dB at the centre frequency
+static inline void linear_svf_set_bp(struct linear_svf *self, float sample_rate, float cutoff, float resonance)
+{
+	double f0 = (double)cutoff;
+	double q = (double)resonance;
+	double sr = (double)sample_rate;
+
+	linear_svf_set_gk(self, tan(M_PI * (f0 / sr)), 1.0 / q);
+	linear_svf_set_m(self, 0.0, self->k, 0.0);
+}
+
+static inline void linear_svf_set_notch(struct linear_svf *self, float sample_rate, float cutoff, float resonance)
+{
+	double f0 = (double)cutoff;
+	double q = (double)resonance;
+	double sr = (double)sample_rate;
+
+	linear_svf_set_gk(self, tan(M_PI * (f0 / sr)), 1.0 / q);
+	linear_svf_set_m(self, 1.0, -self->k, 0.0);
+}
+
+static inline void linear_svf_set_allpass(struct linear_svf *self, float sample_rate, float cutoff, float resonance)
+{
+	double f0 = (double)cutoff;
+	double q = (double)resonance;
+	double sr = (double)sample_rate;
+
+	linear_svf_set_gk(self, tan(M_PI * (f0 / sr)), 1.0 / q);
+	linear_svf_set_m(self, 1.0, -2.0 * self->k, 0.0);
+}
+
+static inline void linear_svf_set_peq(struct linear_svf *self, float gdb, float sample_rate, float cutoff, float bandwidth)
+{
+	double f0 = (double)cutoff;
+	double q = (double)pow(2.0, 1.0 / bandwidth) / (pow(2.0, bandwidth) - 1.0);
+	double sr = (double)sample_rate;
+	double A = pow(10.0, gdb/40.0);
+
+	linear_svf_set_gk(self, tan(M_PI * (f0 / sr)), 1.0 / (q * A));
+	linear_svf_set_m(self, 1.0, self->k * (A * A - 1.0), 0.0);
+}
+
+static inline void linear_svf_set_highshelf(struct linear_svf *self, float gdb, float sample_rate, float cutoff, float resonance)
+{
+	double f0 = (double)cutoff;
+	double q = (double)resonance;
+	double sr = (double)sample_rate;
+	double A = pow(10.0, gdb/40.0);
+
+	linear_svf_set_gk(self, tan(M_PI * (f0 / sr)), 1.0 / q);
+	linear_svf_set_m(self, A * A, self->k * (1.0 - A) * A, 1.0 - A * A);
+}
+
+static inline void linear_svf_set_lowshelf(struct linear_svf *self, float gdb, float sample_rate, float cutoff, float resonance)
+{
+	double f0 = (double)cutoff;
+	double q = (double)resonance;
+	double sr = (double)sample_rate;
+	double A = pow(10.0, gdb/40.0);
+
+	linear_svf_set_gk(self, tan(M_PI * (f0 / sr)), 1.0 / q);
+	linear_svf_set_m(self, 1.0, self->k * (A - 1.0), A * A - 1.0);
+}
+
+// A filter with m = { 1, 0, 0 } passes its input through unchanged
+static inline int
+linear_svf_is_unity(const struct linear_svf *self)
+{
+	return self->m[0] == 1.0 && self->m[1] == 0.0 && self->m[2] == 0.0;
+}
+
+// Take over coefficients, keep the state
+static inline void
+linear_svf_set_coeffs(struct linear_svf *self, const struct linear_svf *other)
+{
+	self->g = other->g;
+	self->k = other->k;
+	self->a[0] = other->a[0];
+	self->a[1] = other->a[1];
+	self->a[2] = other->a[2];
+	self->m[0] = other->m[0];
+	self->m[1] = other->m[1];
+	self->m[2] = other->m[2];
+}
+
+/*
+ * Multiply re + j im, a response at n frequencies given as
+ * t = tan(pi f / rate), by the response of the filter.  On the unit circle
+ * the formulas in a-eq/transfer share one form in g, k and m[], where the
+ * shelving and peaking gain is already folded in:
+ *
+ *	H = (m0 (g^2 - t^2 + j g k t) + j m1 g t + m2 g^2) / (g^2 - t^2 + j g k t)
+ *
+ * Plain arithmetic without branches, so the loop vectorizes.
+ */
+static inline void
+linear_svf_response(const struct linear_svf *self, const float *t,
+                    float *re, float *im, uint32_t n)
+{
+	const float g = self->g;
+	const float gk = g * self->k;
+	const float g2 = g * g;
+	const float m0 = self->m[0];
+	const float m1g = self->m[1] * g;
+	const float m2g2 = self->m[2] * g2;
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		const float a = g2 - t[i] * t[i];
+		const float b = gk * t[i];
+		const float nr = m0 * a + m2g2;
+		const float ni = m0 * b + m1g * t[i];
+		const float d = 1.f / (a * a + b * b);
+		const float hr = (nr * a + ni * b) * d;
+		const float hi = (ni * a - nr * b) * d;
+		const float r = re[i] * hr - im[i] * hi;
+
+		im[i] = re[i] * hi + im[i] * hr;
+		re[i] = r;
+	}
+}
+
+/* Output mix a filter needs, from its m[]. Kernels are specialized per
+ * type so terms with a zero or unit coefficient cost nothing. */
+enum svf_type {
+	SVF_GENERIC = 0, // m0 in + m1 band + m2 low
+	SVF_PEQ,         // m0 in + m1 band
+	SVF_LP,          // m2 low
+	SVF_BP,          // m1 band
+	SVF_HP,          // in + m1 band - low
+	SVF_NOTCH,       // in + m1 band, also allpass
+	SVF_TYPES
+};
+
+static inline enum svf_type
+linear_svf_type(const struct linear_svf *self)
+{
+	if (self->m[0] == 0.0 && self->m[1] == 0.0) {
+		return SVF_LP;
+	}
+	if (self->m[0] == 0.0 && self->m[2] == 0.0) {
+		return SVF_BP;
+	}
+	if (self->m[0] == 1.0 && self->m[2] == -1.0) {
+		return SVF_HP;
+	}
+	if (self->m[0] == 1.0 && self->m[2] == 0.0) {
+		return SVF_NOTCH;
+	}
+	if (self->m[2] == 0.0) {
+		return SVF_PEQ;
+	}
+	return SVF_GENERIC;
+}
+
+/* Output of a filter of type for input u, band output v1 and low output
+ * v2. Expanded with a constant type only the terms of that type remain,
+ * it works on scalars and vectors alike. */
+#define LINEAR_SVF_MIX(type, m0, m1, m2, u, v1, v2) \
+	((type) == SVF_LP ? (m2) * (v2) \
+	 : (type) == SVF_BP ? (m1) * (v1) \
+	 : (type) == SVF_HP ? (u) + (m1) * (v1) - (v2) \
+	 : (type) == SVF_NOTCH ? (u) + (m1) * (v1) \
+	 : (type) == SVF_PEQ ? (m0) * (u) + (m1) * (v1) \
+	 : (m0) * (u) + (m1) * (v1) + (m2) * (v2))
+
+static inline __attribute__((always_inline)) float
+run_linear_svf(struct linear_svf *self, float in, const enum svf_type type)
+{
+	double v[3];
+	double din = (double)in;
+
+	v[2] = din - self->s[1];
+	v[0] = (self->a[0] * self->s[0]) + (self->a[1] * v[2]);
+	v[1] = self->s[1] + (self->a[1] * self->s[0]) + (self->a[2] * v[2]);
+
+	self->s[0] = (2.0 * v[0]) - self->s[0];
+	self->s[1] = (2.0 * v[1]) - self->s[1];
+
+	return (float)LINEAR_SVF_MIX(type, self->m[0], self->m[1], self->m[2], din, v[0], v[1]);
+}
+
+#endif
@@ -0,0 +1,45 @@
+/* Bypass of run() once a plugin has decayed into silence
+ * Copyright (C) 2016 Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef A_COMMON_TAIL_H
+#define A_COMMON_TAIL_H
+
+#include "lv2/lv2plug.in/ns/lv2core/lv2.h"
+
+/*
+ * Muted tracks and the gaps between takes feed plugins silence, which
+ * costs as much as music once the filters run on it.  Each plugin keeps
+ * track of its input and of its own tail: filter state, delay line
+ * contents, the compressor envelope.  When all of it is below
+ * ATAIL_SILENCE run() writes silence to the outputs and clears the
+ * state instead of processing, and picks up again with the first input
+ * above it.  Up to that point the output is exactly that of the full
+ * processing.
+ */
+
+// -120 dBFS
+#define ATAIL_SILENCE 1e-6f
+
+/* Returned by extension_data() of plugins with a bypass, which is on
+ * after instantiate().  Turning it off gives the full processing to
+ * compare against. */
+#define ATAIL__interface "urn:ardour:a-plugins#tail"
+
+typedef struct {
+	void (*set_bypass)(LV2_Handle instance, int enabled);
+	// Non-zero if the last run() wrote silence for any part of its block
+	int (*bypassed)(LV2_Handle instance);
+} ATailInterface;
+
+#endif
@@ -13,11 +13,53 @@
  */
 
 #include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "lv2/lv2plug.in/ns/lv2core/lv2.h"
+#include "lv2/lv2plug.in/ns/ext/atom/atom.h"
+#include "lv2/lv2plug.in/ns/ext/atom/forge.h"
+#include "lv2/lv2plug.in/ns/ext/urid/urid.h"
 
-#define ACOMP_URI "urn:ardour:a-comp"
+#include "arena.h"
+#include "denormal.h"
+#include "dsp.h"
+#include "meter.h"
+#include "tail.h"
+
+#define ACOMP_URI		"urn:ardour:a-comp"
+#define ACOMP_STEREO_URI	"urn:ardour:a-comp#stereo"
+
+// Samples per pass of the block gain computer
+#define ACOMP_BLOCK 64
+
+// Channels sharing one linked detector, at compile time
+#ifndef ACOMP_MAX_CHANNELS
+#define ACOMP_MAX_CHANNELS 2
+#endif
+
+// Maximum look-ahead in ms
+#define ACOMP_MAX_LOOKAHEAD 10.f
+
+// Highest oversampling factor of the gain path
+#define ACOMP_MAX_OVERSAMPLE 4
+
+/* Polyphase taps of the two half-band stages, 2K + 2 for a 4K + 3 tap
+ * half-band filter.  The first stage sets the passband, the second one
+ * only has to reject images of an already band limited signal. */
+#define ACOMP_HB1_TAPS 32
+#define ACOMP_HB2_TAPS 12
+
+// Outputs per pass of the half-band FIR kernel
+#define ACOMP_FIR_GROUP 8
+
+// Window of the RMS detector in ms
+#define ACOMP_RMS_WINDOW 10.f
+
+/* Time constant of the average gain reduction the program dependent
+ * release falls back to, in multiples of the release time */
+#define ACOMP_PDR_SLOW 5.f
 
 typedef enum {
 	ACOMP_INPUT0 = 0,
@@ -34,13 +76,24 @@ typedef enum {
 	ACOMP_GAINR,
 	ACOMP_OUTLEVEL,
 	ACOMP_SIDECHAIN,
+	ACOMP_LOOKAHEAD,
+	ACOMP_LATENCY,
+	ACOMP_OVERSAMPLE,
+	ACOMP_DETECTOR,
+	ACOMP_AUTORELEASE,
+	ACOMP_NOTIFY,
+
+	// multichannel only, channel c > 0 uses ACOMP_INPUT2 + 2 * (c - 1)
+	ACOMP_LINK,
+	ACOMP_INPUT2,
+	ACOMP_OUTPUT2,
 } PortIndex;
 
 
 typedef struct {
-	float* input0;
-	float* input1;
-	float* output;
+	float* input[ACOMP_MAX_CHANNELS];
+	float* output[ACOMP_MAX_CHANNELS];
+	float* sidechain_in;
 
 	float* attack;
 	float* release;
@@ -52,23 +105,211 @@ typedef struct {
 	float* gainr;
 	float* outlevel;
 	float* sidechain;
+	float* lookahead;
+	float* latency;
+	float* oversample;
+	float* detector;
+	float* autorelease;
+	float* link;
+	LV2_Atom_Sequence* notify;
 
+	const struct adsp* dsp;
+	uint32_t n_channels;
 	float srate;
 	float old_yl;
-	float old_y1;
-	float old_yg;
+	/* Release stage and average gain reduction of the program dependent
+	 * release, double as their steps fall below float resolution */
+	double old_y1;
+	double old_ya;
+
+	// Block statistics for the notify port and the meter ring
+	LV2_URID_Map* map;
+	LV2_Atom_Forge forge;
+	AMeterURIs uris;
+	AMeterRing meter;
+	uint64_t frame;
+
+	// Bypass once silent, and samples of silent input in a row so far
+	int tail_bypass;
+	int bypassed;
+	uint32_t silent;
+
+	/* Look-ahead: per channel audio delay lines and a monotonic deque
+	 * of (sample, level) pairs holding the sliding window maximum.
+	 * The audio rings are la_mask + 1 long, the deque dq_mask + 1 to
+	 * cover the window at the highest detector rate, both powers of two. */
+	float* la_audio[ACOMP_MAX_CHANNELS];
+	uint32_t* dq_pos;
+	float* dq_level;
+	uint32_t la_mask;
+	uint32_t la_pos;
+	uint32_t dq_mask;
+	uint32_t dq_clock;
+	uint32_t dq_head;
+	uint32_t dq_tail;
+
+	/* RMS detector: the last rms_len detector powers and their sum,
+	 * rms_len is rms_base, ACOMP_RMS_WINDOW in samples, at the detector
+	 * rate */
+	float* rms_ring;
+	uint32_t rms_base;
+	uint32_t rms_len;
+	uint32_t rms_pos;
+	double rms_sum;
+	int rms;
+
+	float lxl[ACOMP_MAX_OVERSAMPLE * ACOMP_BLOCK];
+	float delayed[ACOMP_BLOCK];
+
+	/* Oversampled gain path.  Every half-band stage keeps its history in
+	 * front of the samples of the current block.  Upsampler c carries the
+	 * audio of channel c, ACOMP_MAX_CHANNELS + c its detector input. */
+	uint32_t os_factor;
+	float hb1[ACOMP_HB1_TAPS];
+	float hb2[ACOMP_HB2_TAPS];
+	float os_up1[2 * ACOMP_MAX_CHANNELS][ACOMP_HB1_TAPS - 1 + ACOMP_BLOCK];
+	float os_up2[2 * ACOMP_MAX_CHANNELS][ACOMP_HB2_TAPS - 1 + 2 * ACOMP_BLOCK];
+	float os_dn1[ACOMP_MAX_CHANNELS][2][ACOMP_HB1_TAPS - 1 + ACOMP_BLOCK];
+	float os_dn2[ACOMP_MAX_CHANNELS][2][ACOMP_HB2_TAPS + 2 * ACOMP_BLOCK];
+	float os_det[ACOMP_MAX_CHANNELS][ACOMP_MAX_OVERSAMPLE * ACOMP_BLOCK];
+	float os_audio[ACOMP_MAX_OVERSAMPLE * ACOMP_BLOCK];
+	float os_mid[2 * ACOMP_BLOCK];
+	float os_tmp[2 * ACOMP_BLOCK];
 } AComp;
 
+static void
+cleanup(LV2_Handle instance)
+{
+	aarena_free(instance);
+}
+
+/* The instance, look-ahead lines of la_size samples per channel, the
+ * deque of dq_size entries and the RMS ring of rms_size */
+static AComp*
+acomp_layout(AArena* arena, uint32_t n_channels, uint32_t la_size,
+             uint32_t dq_size, uint32_t rms_size)
+{
+	AComp* acomp = (AComp*)aarena_take(arena, sizeof(AComp));
+	float* la_audio[ACOMP_MAX_CHANNELS];
+	uint32_t* dq_pos;
+	float* dq_level;
+	float* rms_ring;
+	uint32_t i;
+
+	for (i = 0; i < n_channels; i++) {
+		la_audio[i] = (float*)aarena_take(arena, la_size * sizeof(float));
+	}
+	dq_pos = (uint32_t*)aarena_take(arena, dq_size * sizeof(uint32_t));
+	dq_level = (float*)aarena_take(arena, dq_size * sizeof(float));
+	rms_ring = (float*)aarena_take(arena, rms_size * sizeof(float));
+
+	if (acomp) {
+		for (i = 0; i < n_channels; i++) {
+			acomp->la_audio[i] = la_audio[i];
+		}
+		acomp->dq_pos = dq_pos;
+		acomp->dq_level = dq_level;
+		acomp->rms_ring = rms_ring;
+	}
+	return acomp;
+}
+
+static double
+bessel_i0(double x)
+{
+	double sum = 1., term = 1.;
+	uint32_t k;
+
+	for (k = 1; k < 32; k++) {
+		term *= (x / (2. * k)) * (x / (2. * k));
+		sum += term;
+	}
+	return sum;
+}
+
+/*
+ * Kaiser windowed half-band lowpass, beta 8 for about 80 dB of stopband.
+ * Only the odd taps around the center are stored, a[j] sits at offset
+ * 2K + 1 - 2j from the center tap of 0.5 and the set is normalized to
+ * unity DC gain, which is the interpolator's filtered phase.
+ */
+static void
+halfband_design(float* a, uint32_t taps)
+{
+	const double beta = 8.;
+	const double c = taps - 1;
+	double h[ACOMP_HB1_TAPS];
+	double sum = 0.;
+	uint32_t j;
+
+	for (j = 0; j < taps; j++) {
+		const double d = c - 2. * j;
+		const double r = d / (c + 1.);
+		const double w = bessel_i0(beta * sqrt(1. - r * r)) / bessel_i0(beta);
+		h[j] = sin(M_PI * d / 2.) / (M_PI * d / 2.) * w;
+		sum += h[j];
+	}
+	for (j = 0; j < taps; j++) {
+		a[j] = (float)(h[j] / sum);
+	}
+}
+
 static LV2_Handle
 instantiate(const LV2_Descriptor* descriptor,
             double rate,
             const char* bundle_path,
             const LV2_Feature* const* features)
 {
-	AComp* acomp = (AComp*)malloc(sizeof(AComp));
+	const uint32_t n_channels = strcmp(descriptor->URI, ACOMP_STEREO_URI) ? 1 : 2;
+	const uint32_t lookahead = (uint32_t)ceilf(ACOMP_MAX_LOOKAHEAD * rate / 1000.f);
+	const uint32_t rms_base = (uint32_t)ceil(ACOMP_RMS_WINDOW * rate / 1000.);
+	LV2_URID_Map* map = NULL;
+	AArena arena = { NULL, 0, 0 };
+	AComp* acomp;
+	uint32_t i, la_size = 1, dq_size = 1;
+
+	for (i = 0; features[i]; ++i) {
+		if (!strcmp(features[i]->URI, LV2_URID__map)) {
+			map = (LV2_URID_Map*)features[i]->data;
+		}
+	}
+	if (!map) {
+		fprintf(stderr, "a-comp.lv2 error: Host does not support urid:map\n");
+		return NULL;
+	}
+
+	// Room for the longest look-ahead plus one block being written
+	while (la_size < lookahead + ACOMP_BLOCK + 1) {
+		la_size <<= 1;
+	}
+	// The deque window is counted in detector samples, plus one being pushed
+	while (dq_size < lookahead * ACOMP_MAX_OVERSAMPLE + 2) {
+		dq_size <<= 1;
+	}
+
+	acomp_layout(&arena, n_channels, la_size, dq_size, rms_base * ACOMP_MAX_OVERSAMPLE);
+	if (aarena_alloc(&arena)) {
+		return NULL;
+	}
+	acomp = acomp_layout(&arena, n_channels, la_size, dq_size, rms_base * ACOMP_MAX_OVERSAMPLE);
+	acomp->map = map;
+	ameter_map_uris(acomp->map, &acomp->uris);
+	lv2_atom_forge_init(&acomp->forge, acomp->map);
+
+	acomp->dsp = adsp_get();
+	acomp->tail_bypass = 1;
+	acomp->n_channels = n_channels;
 	acomp->srate = rate;
 
-	acomp->old_yl=acomp->old_y1=acomp->old_yg=0.f;
+	acomp->old_yl=0.f;
+	acomp->old_y1=acomp->old_ya=0.;
+
+	halfband_design(acomp->hb1, ACOMP_HB1_TAPS);
+	halfband_design(acomp->hb2, ACOMP_HB2_TAPS);
+
+	acomp->la_mask = la_size - 1;
+	acomp->dq_mask = dq_size - 1;
+	acomp->rms_base = rms_base;
 
 	return (LV2_Handle)acomp;
 }
@@ -108,115 +349,656 @@ connect_port(LV2_Handle instance,
 	case ACOMP_SIDECHAIN:
 		acomp->sidechain = (float*)data;
 		break;
+	case ACOMP_LOOKAHEAD:
+		acomp->lookahead = (float*)data;
+		break;
+	case ACOMP_LATENCY:
+		acomp->latency = (float*)data;
+		break;
+	case ACOMP_OVERSAMPLE:
+		acomp->oversample = (float*)data;
+		break;
+	case ACOMP_DETECTOR:
+		acomp->detector = (float*)data;
+		break;
+	case ACOMP_AUTORELEASE:
+		acomp->autorelease = (float*)data;
+		break;
+	case ACOMP_LINK:
+		acomp->link = (float*)data;
+		break;
+	case ACOMP_NOTIFY:
+		acomp->notify = (LV2_Atom_Sequence*)data;
+		break;
 	case ACOMP_INPUT0:
-		acomp->input0 = (float*)data;
+		acomp->input[0] = (float*)data;
 		break;
 	case ACOMP_INPUT1:
-		acomp->input1 = (float*)data;
+		acomp->sidechain_in = (float*)data;
 		break;
 	case ACOMP_OUTPUT:
-		acomp->output = (float*)data;
+		acomp->output[0] = (float*)data;
+		break;
+	default:
+		if (port >= ACOMP_INPUT2 && port < ACOMP_INPUT2 + 2 * (ACOMP_MAX_CHANNELS - 1)) {
+			uint32_t c = 1 + (port - ACOMP_INPUT2) / 2;
+			if ((port - ACOMP_INPUT2) & 1) {
+				acomp->output[c] = (float*)data;
+			} else {
+				acomp->input[c] = (float*)data;
+			}
+		}
 		break;
 	}
 }
 
-// Force already-denormal float value to zero
+// Static compression curve with soft knee, returns output level in dB
 static inline float
-sanitize_denormal(float value) {
-	if (!isnormal(value)) {
-		value = 0.f;
-	}
-	return value;
+gain_curve(float Lxg, float thresdb, float ratio, float width)
+{
+	const float d = Lxg - thresdb;
+	const float k = d + width / 2.f;
+	const float knee = Lxg + (1.f/ratio - 1.f) * k * k / (2.f * width);
+	const float above = thresdb + d / ratio;
+
+	return (2.f * d < -width) ? Lxg : ((2.f * d > width) ? above : knee);
 }
 
-static inline float
-from_dB(float gdb) {
-	return (exp(gdb/20.f*log(10.f)));
+// Empty the RMS window, which holds rms_len detector samples
+static void
+rms_reset(AComp* acomp, uint32_t len)
+{
+	memset(acomp->rms_ring, 0, acomp->rms_len * sizeof(float));
+	acomp->rms_len = len;
+	acomp->rms_pos = 0;
+	acomp->rms_sum = 0.;
 }
 
-static inline float
-to_dB(float g) {
-	return (20.f*log10(g));
+/* Clear the half-band histories, the look-ahead deque and the RMS window,
+ * which count detector samples, on activation and when the factor changes */
+static void
+oversample_reset(AComp* acomp, uint32_t factor)
+{
+	acomp->os_factor = factor;
+	acomp->dq_clock = 0;
+	acomp->dq_head = acomp->dq_tail = 0;
+	rms_reset(acomp, acomp->rms_base * factor);
+	memset(acomp->os_up1, 0, sizeof(acomp->os_up1));
+	memset(acomp->os_up2, 0, sizeof(acomp->os_up2));
+	memset(acomp->os_dn1, 0, sizeof(acomp->os_dn1));
+	memset(acomp->os_dn2, 0, sizeof(acomp->os_dn2));
 }
 
 static void
 activate(LV2_Handle instance)
 {
 	AComp* acomp = (AComp*)instance;
+	uint32_t i;
 
 	*(acomp->gainr) = 0.0f;
 	*(acomp->outlevel) = -45.0f;
-	acomp->old_yl=acomp->old_y1=acomp->old_yg=0.f;
+	*(acomp->latency) = 0.0f;
+	acomp->old_yl=0.f;
+	acomp->old_y1=acomp->old_ya=0.;
+	acomp->silent = 0;
+	acomp->frame = 0;
+
+	for (i = 0; i < acomp->n_channels; i++) {
+		memset(acomp->la_audio[i], 0, (acomp->la_mask + 1) * sizeof(float));
+	}
+	acomp->la_pos = 0;
+
+	oversample_reset(acomp, 1);
+}
+
+/*
+ * Sliding window maximum over the last window + 1 detector levels.
+ * Levels that can never become the maximum again are dropped from the
+ * back of the deque, so each level is pushed and popped at most once.
+ */
+static void
+lookahead_peak(AComp* acomp, float* lxl, uint32_t n, uint32_t window)
+{
+	const uint32_t mask = acomp->dq_mask;
+	uint32_t* const dq_pos = acomp->dq_pos;
+	float* const dq_level = acomp->dq_level;
+	uint32_t head = acomp->dq_head;
+	uint32_t tail = acomp->dq_tail;
+	uint32_t pos = acomp->dq_clock;
+	uint32_t i;
+
+	for (i = 0; i < n; i++, pos++) {
+		while (tail != head && dq_level[(tail - 1) & mask] <= lxl[i]) {
+			tail--;
+		}
+		dq_pos[tail & mask] = pos;
+		dq_level[tail & mask] = lxl[i];
+		tail++;
+
+		while (pos - dq_pos[head & mask] > window) {
+			head++;
+		}
+		lxl[i] = dq_level[head & mask];
+	}
+
+	acomp->dq_clock = pos;
+	acomp->dq_head = head;
+	acomp->dq_tail = tail;
+}
+
+/*
+ * Mean square over the last rms_len detector powers in lxl.  The running
+ * sum adds the power entering the window and drops the one leaving it,
+ * and is summed over the ring again each time the window wraps, so the
+ * rounding of loud passages does not linger in quiet ones.
+ */
+static void
+rms_window(AComp* acomp, float* lxl, uint32_t n)
+{
+	float* const ring = acomp->rms_ring;
+	const uint32_t len = acomp->rms_len;
+	const double scale = 1. / len;
+	double sum = acomp->rms_sum;
+	uint32_t pos = acomp->rms_pos;
+	uint32_t i, j;
+
+	for (i = 0; i < n; i++) {
+		sum += (double)lxl[i] - ring[pos];
+		ring[pos] = lxl[i];
+		if (++pos == len) {
+			pos = 0;
+			sum = 0.;
+			for (j = 0; j < len; j++) {
+				sum += ring[j];
+			}
+		}
+		lxl[i] = (sum > 0.) ? (float)(sum * scale) : 0.f;
+	}
+
+	acomp->rms_pos = pos;
+	acomp->rms_sum = sum;
+}
+
+// Delay lines are written in every run so enabling look-ahead has history
+static void
+lookahead_write(float* ring, uint32_t mask, uint32_t pos,
+                const float* in, uint32_t n)
+{
+	uint32_t w = pos & mask;
+	uint32_t len = mask + 1 - w;
+
+	if (len >= n) {
+		memcpy(ring + w, in, n * sizeof(float));
+	} else {
+		memcpy(ring + w, in, len * sizeof(float));
+		memcpy(ring, in + len, (n - len) * sizeof(float));
+	}
+}
+
+static void
+lookahead_read(const float* ring, uint32_t mask, uint32_t pos,
+               float* out, uint32_t n, uint32_t delay)
+{
+	uint32_t r = (pos - delay) & mask;
+	uint32_t len = mask + 1 - r;
+
+	if (len >= n) {
+		memcpy(out, ring + r, n * sizeof(float));
+	} else {
+		memcpy(out, ring + r, len * sizeof(float));
+		memcpy(out + len, ring, (n - len) * sizeof(float));
+	}
+}
+
+/*
+ * Symmetric FIR over n outputs, out[i] = sum a[j] * x[i + j] with an even
+ * number of taps, a[j] == a[taps - 1 - j].  Outputs are computed
+ * in groups of ACOMP_FIR_GROUP whose accumulators stay in vector registers
+ * across all taps, the last group may write and read past n, so out and x
+ * need room for n rounded up to a whole group.
+ */
+static void
+halfband_fir(const float* a, uint32_t taps, const float* x, float* out, uint32_t n)
+{
+	uint32_t i, j, k;
+
+	for (i = 0; i < n; i += ACOMP_FIR_GROUP) {
+		float acc[ACOMP_FIR_GROUP];
+
+		for (k = 0; k < ACOMP_FIR_GROUP; k++) {
+			acc[k] = a[0] * (x[i + k] + x[i + taps - 1 + k]);
+		}
+		for (j = 1; j < taps / 2; j++) {
+			const float aj = a[j];
+			for (k = 0; k < ACOMP_FIR_GROUP; k++) {
+				acc[k] += aj * (x[i + j + k] + x[i + taps - 1 - j + k]);
+			}
+		}
+		for (k = 0; k < ACOMP_FIR_GROUP; k++) {
+			out[i + k] = acc[k];
+		}
+	}
+}
+
+/*
+ * Half-band interpolator.  buf holds taps - 1 samples of history followed
+ * by n new samples, out receives 2n samples at twice the rate.  Even
+ * outputs are the filtered phase, computed into tmp, odd ones a pure delay.
+ */
+static void
+halfband_up(const float* a, uint32_t taps, float* buf, float* tmp,
+            float* out, uint32_t n)
+{
+	const float* const mid = buf + taps / 2;
+	uint32_t i;
+
+	halfband_fir(a, taps, buf, tmp, n);
+	for (i = 0; i < n; i++) {
+		out[2 * i] = tmp[i];
+		out[2 * i + 1] = mid[i];
+	}
+	memmove(buf, buf + n, (taps - 1) * sizeof(float));
+}
+
+/*
+ * Half-band decimator, the transpose of halfband_up.  The 2n input samples
+ * are split into the even and odd phases e and o, each behind taps - 1 +
+ * lag samples of history, where lag delays the output by whole samples.
+ */
+static void
+halfband_down(const float* a, uint32_t taps, uint32_t lag, float* e, float* o,
+              float* tmp, const float* in, float* out, uint32_t n)
+{
+	const uint32_t hist = taps - 1 + lag;
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		e[hist + i] = in[2 * i];
+		o[hist + i] = in[2 * i + 1];
+	}
+	halfband_fir(a, taps, e, tmp, n);
+	for (i = 0; i < n; i++) {
+		out[i] = 0.5f * (tmp[i] + o[i + taps / 2 - 1]);
+	}
+	memmove(e, e + n, hist * sizeof(float));
+	memmove(o, o + n, hist * sizeof(float));
+}
+
+/* Group delay of the up and down half-band chain in base rate samples,
+ * 2K + 1 for the first stage, K + 1 for the second one with its lag */
+static uint32_t
+oversample_latency(uint32_t factor)
+{
+	switch (factor) {
+	case 2:
+		return ACOMP_HB1_TAPS - 1;
+	case 4:
+		return ACOMP_HB1_TAPS - 1 + ACOMP_HB2_TAPS / 2;
+	default:
+		return 0;
+	}
+}
+
+// Upsample n samples of signal k by os_factor into out
+static void
+oversample_up(AComp* acomp, uint32_t k, const float* in, float* out, uint32_t n)
+{
+	float* const b1 = acomp->os_up1[k];
+	float* const b2 = acomp->os_up2[k];
+
+	memcpy(b1 + ACOMP_HB1_TAPS - 1, in, n * sizeof(float));
+	if (acomp->os_factor == 2) {
+		halfband_up(acomp->hb1, ACOMP_HB1_TAPS, b1, acomp->os_tmp, out, n);
+		return;
+	}
+	halfband_up(acomp->hb1, ACOMP_HB1_TAPS, b1, acomp->os_tmp,
+	            b2 + ACOMP_HB2_TAPS - 1, n);
+	halfband_up(acomp->hb2, ACOMP_HB2_TAPS, b2, acomp->os_tmp, out, 2 * n);
+}
+
+// Decimate os_factor * n samples of channel c back to n samples in out
+static void
+oversample_down(AComp* acomp, uint32_t c, const float* in, float* out, uint32_t n)
+{
+	const float* mid = in;
+
+	if (acomp->os_factor == 4) {
+		/* One sample of lag at the middle rate rounds the group delay
+		 * of the 4x chain up to whole base rate samples */
+		halfband_down(acomp->hb2, ACOMP_HB2_TAPS, 1, acomp->os_dn2[c][0],
+		              acomp->os_dn2[c][1], acomp->os_tmp, in, acomp->os_mid, 2 * n);
+		mid = acomp->os_mid;
+	}
+	halfband_down(acomp->hb1, ACOMP_HB1_TAPS, 0, acomp->os_dn1[c][0],
+	              acomp->os_dn1[c][1], acomp->os_tmp, mid, out, n);
+}
+
+// Sum of a^(m - k) * b^k over k = 1 .. m
+static double
+geometric_sum(double a, double b, uint32_t m)
+{
+	const double am = pow(a, m);
+	return (fabs(a - b) > 1e-9) ? b * (am - pow(b, m)) / (a - b) : m * am;
+}
+
+/*
+ * The envelope after m detector samples without gain reduction, as in
+ * silence: Lya decays with the slow coefficient s, Ly1 with the release
+ * towards it and Lyl follows Ly1 through the attack.  Closed form of the
+ * smoothing in run(), Lya is 0 without program dependent release.
+ */
+static void
+envelope_decay(double* Ly1, float* Lyl, double* Lya, double a, double r, double s, uint32_t m)
+{
+	const double y1 = *Ly1, yl = *Lyl, ya = *Lya;
+	const double ra = geometric_sum(a, r, m);
+	uint32_t k;
+
+	if (ya == 0.) {
+		*Lyl = pow(a, m) * yl + (1. - a) * y1 * ra;
+		*Ly1 = pow(r, m) * y1;
+	} else if (fabs(r - s) > 1e-9) {
+		// Sum of a^(m - k) * geometric_sum(r, s, k) over k = 1 .. m
+		const double ras = s * (ra - geometric_sum(a, s, m)) / (r - s);
+
+		*Lyl = pow(a, m) * yl + (1. - a) * (y1 * ra + (1. - r) * ya * ras);
+		*Ly1 = pow(r, m) * y1 + (1. - r) * ya * geometric_sum(r, s, m);
+		*Lya = pow(s, m) * ya;
+	} else {
+		double f1 = *Ly1, fa = *Lya;
+		float fl = *Lyl;
+		for (k = 0; k < m; k++) {
+			fa = s * fa;
+			f1 = r * f1 + (1. - r) * fa;
+			fl = a * fl + (1.f - a) * (float)f1;
+		}
+		*Ly1 = f1;
+		*Lyl = fl;
+		*Lya = fa;
+	}
+}
+
+/* Statistics of the n samples just run: into the ring, and as the only
+ * event of the notify port when connected */
+static void
+acomp_meter(AComp* acomp, uint32_t n, float gr_min, float gr_max, float peak)
+{
+	const float level = (peak > 0.f) ? to_dB(peak) : AMETER_FLOOR;
+	LV2_Atom_Forge_Frame frame;
+	AMeterBlock block;
+
+	block.frame = acomp->frame;
+	block.length = n;
+	block.gr_min = gr_min;
+	block.gr_max = gr_max;
+	block.peak = (level > AMETER_FLOOR) ? level : AMETER_FLOOR;
+	acomp->frame += n;
+
+	if (n > 0) {
+		ameter_push(&acomp->meter, &block);
+	}
+	if (!acomp->notify) {
+		return;
+	}
+	lv2_atom_forge_set_buffer(&acomp->forge, (uint8_t*)acomp->notify, acomp->notify->atom.size);
+	lv2_atom_forge_sequence_head(&acomp->forge, &frame, 0);
+	if (n > 0) {
+		ameter_forge(&acomp->forge, &acomp->uris, &block);
+	}
+	lv2_atom_forge_pop(&acomp->forge, &frame);
+}
+
+// Audio and detector inputs of the block below ATAIL_SILENCE
+static int
+acomp_silent(const AComp* acomp, uint32_t n_samples, int usesidechain)
+{
+	uint32_t c;
+
+	for (c = 0; c < acomp->n_channels; c++) {
+		if (acomp->dsp->peak(acomp->input[c], n_samples) >= ATAIL_SILENCE) {
+			return 0;
+		}
+	}
+	return !usesidechain || acomp->dsp->peak(acomp->sidechain_in, n_samples) < ATAIL_SILENCE;
 }
 
 static void
 run(LV2_Handle instance, uint32_t n_samples)
 {
 	AComp* acomp = (AComp*)instance;
+	const afpu_state fpu = afpu_flush_denormals();
 
-	const float* const input0 = acomp->input0;
-	const float* const input1 = acomp->input1;
-	float* const output = acomp->output;
+	const uint32_t n_channels = acomp->n_channels;
+	float* const lxl = acomp->lxl;
 
+	const uint32_t os_factor = (*(acomp->oversample) > 1.5f) ? 4 : ((*(acomp->oversample) > 0.5f) ? 2 : 1);
 	float srate = acomp->srate;
 	float width = (6.f * *(acomp->knee)) + 0.01;
-	float cdb=0.f;
-	float attack_coeff = exp(-1000.f/(*(acomp->attack) * srate));
-	float release_coeff = exp(-1000.f/(*(acomp->release) * srate));
-
-	float max = 0.f;
-	float lgaininp = 0.f;
-	float Lgain = 1.f;
-	float Lxg, Lxl, Lyg, Lyl, Ly1;
+	// The gain path runs at the oversampled rate
+	float attack_coeff = exp(-1000.f/(*(acomp->attack) * srate * os_factor));
+	float release_coeff = exp(-1000.f/(*(acomp->release) * srate * os_factor));
+	double slow_coeff = exp(-1000./(ACOMP_PDR_SLOW * *(acomp->release) * srate * os_factor));
+	float makeup_gain = from_dB(*(acomp->makeup));
+
+	const struct adsp* const dsp = acomp->dsp;
+	float max = 0.f, p;
+	float gr_min = INFINITY, gr_max = -INFINITY;
+	double Ly1 = acomp->old_y1;
+	float Lyl = acomp->old_yl;
+	double Lya = acomp->old_ya;
 	int usesidechain = (*(acomp->sidechain) < 0.5) ? 0 : 1;
-	uint32_t i;
-	float ingain;
-	float in0;
-	float in1;
+	int linkrms = (!usesidechain && n_channels > 1 && *(acomp->link) > 0.5) ? 1 : 0;
+	int rms = (*(acomp->detector) > 0.5) ? 1 : 0;
+	int autorelease = (*(acomp->autorelease) > 0.5) ? 1 : 0;
+	uint32_t i, c;
+	uint32_t offset = 0;
 	float ratio = *(acomp->ratio);
 	float thresdb = *(acomp->thresdb);
+	float lookahead_ms = *(acomp->lookahead);
+	uint32_t delay;
+
+	if (lookahead_ms > ACOMP_MAX_LOOKAHEAD) {
+		lookahead_ms = ACOMP_MAX_LOOKAHEAD;
+	}
+	delay = (lookahead_ms > 0.f) ? (uint32_t)(lookahead_ms * srate / 1000.f) : 0;
+
+	if (os_factor != acomp->os_factor) {
+		oversample_reset(acomp, os_factor);
+	}
+	if (rms != acomp->rms) {
+		rms_reset(acomp, acomp->rms_len);
+		acomp->rms = rms;
+	}
+	if (!autorelease) {
+		Lya = 0.;
+	}
+	acomp->bypassed = 0;
+
+	/* Silent for longer than the look-ahead, the half-band filters and
+	 * the RMS window hold: the output is silence and the envelope only
+	 * decays.  The delay lines are still written, the look-ahead and RMS
+	 * windows restart. */
+	if (acomp_silent(acomp, n_samples, usesidechain)) {
+		const uint32_t held = delay + 2 * (ACOMP_HB1_TAPS + ACOMP_HB2_TAPS)
+		                      + (rms ? acomp->rms_len / os_factor : 0);
 
-	for (i = 0; i < n_samples; i++) {
-		in0 = input0[i];
-		in1 = input1[i];
-		ingain = usesidechain ? in1 : in0;
-		Lyg = 0.f;
-		Lxg = (ingain==0.f) ? -160.f : to_dB(fabs(ingain));
-		Lxg = sanitize_denormal(Lxg);
+		if (acomp->tail_bypass && acomp->silent >= held) {
+			// The rings are shorter than a long block, only its end stays
+			const uint32_t k = (n_samples <= acomp->la_mask) ? n_samples : acomp->la_mask + 1;
+			for (c = 0; c < n_channels; c++) {
+				lookahead_write(acomp->la_audio[c], acomp->la_mask, acomp->la_pos + n_samples - k,
+				                acomp->input[c] + n_samples - k, k);
+				memset(acomp->output[c], 0, n_samples * sizeof(float));
+			}
+			acomp->la_pos += n_samples;
+			acomp->dq_head = acomp->dq_tail;
+			if (acomp->rms_sum != 0.) {
+				rms_reset(acomp, acomp->rms_len);
+			}
+			gr_max = Lyl;
+			envelope_decay(&Ly1, &Lyl, &Lya, attack_coeff, release_coeff, slow_coeff,
+			               n_samples * os_factor);
+			acomp->old_y1 = Ly1;
+			acomp->old_yl = Lyl;
+			acomp->old_ya = Lya;
+			acomp->bypassed = 1;
 
-		Lyg = Lxg + (1.f/ratio-1.f)*(Lxg-thresdb+width/2.f)*(Lxg-thresdb+width/2.f)/(2.f*width);
+			// The decay is monotonic once the envelope left the attack
+			gr_min = (Lyl < gr_max) ? Lyl : gr_max;
+			gr_max = (Lyl > gr_max) ? Lyl : gr_max;
+			acomp_meter(acomp, n_samples, gr_min, gr_max, 0.f);
 
-		if (2.f*(Lxg-thresdb) < -width) {
-			Lyg = Lxg;
+			*(acomp->gainr) = gr_max;
+			*(acomp->outlevel) = -45.f;
+			*(acomp->latency) = (float)(delay + oversample_latency(os_factor));
+			afpu_restore(fpu);
+			return;
+		}
+		acomp->silent = (acomp->silent < held) ? acomp->silent + n_samples : held;
+	} else {
+		acomp->silent = 0;
+	}
+
+	/* Detector level in dB is dbscale * log2(lxl) + dboffset, where lxl
+	 * holds the peak magnitude or, for the RMS detector or RMS link, a
+	 * power.  Either stays linear up to the one conversion per sample. */
+	const float dbscale = (rms || linkrms) ? 3.01029996f : 6.02059991f;
+	const float dboffset = linkrms ? -10.f * log10f((float)n_channels) : 0.f;
+
+	while (offset < n_samples) {
+		const uint32_t n = (n_samples - offset < ACOMP_BLOCK) ? n_samples - offset : ACOMP_BLOCK;
+		const uint32_t m = n * os_factor;
+		const float* det[ACOMP_MAX_CHANNELS] = { NULL };
+
+		// Detector inputs, upsampled along with the audio when oversampling
+		if (usesidechain) {
+			det[0] = acomp->sidechain_in + offset;
+			if (os_factor > 1) {
+				oversample_up(acomp, ACOMP_MAX_CHANNELS, det[0], acomp->os_det[0], n);
+				det[0] = acomp->os_det[0];
+			}
 		} else {
-			Lyg = thresdb + (Lxg-thresdb)/ratio;
-			Lyg = sanitize_denormal(Lyg);
+			for (c = 0; c < n_channels; c++) {
+				det[c] = acomp->input[c] + offset;
+				if (os_factor > 1) {
+					oversample_up(acomp, ACOMP_MAX_CHANNELS + c, det[c], acomp->os_det[c], n);
+					det[c] = acomp->os_det[c];
+				}
+			}
 		}
 
-		Lxl = Lxg - Lyg;
+		// Linked level detection, one envelope for all channels
+		if (usesidechain) {
+			if (rms) {
+				dsp->sqr(lxl, det[0], m);
+			} else {
+				dsp->abs(lxl, det[0], m);
+			}
+		} else if (linkrms) {
+			dsp->sqr(lxl, det[0], m);
+			for (c = 1; c < n_channels; c++) {
+				dsp->sqr_add(lxl, det[c], m);
+			}
+		} else {
+			dsp->abs(lxl, det[0], m);
+			for (c = 1; c < n_channels; c++) {
+				dsp->abs_max(lxl, det[c], m);
+			}
+			if (rms) {
+				dsp->mul(lxl, lxl, lxl, m);
+			}
+		}
 
-		acomp->old_y1 = sanitize_denormal(acomp->old_y1);
-		acomp->old_yl = sanitize_denormal(acomp->old_yl);
-		Ly1 = fmaxf(Lxl, release_coeff * acomp->old_y1+(1.f-release_coeff)*Lxl);
-		Lyl = attack_coeff * acomp->old_yl+(1.f-attack_coeff)*Ly1;
-		Ly1 = sanitize_denormal(Ly1);
-		Lyl = sanitize_denormal(Lyl);
+		if (rms) {
+			rms_window(acomp, lxl, m);
+		}
+
+		if (delay > 0) {
+			lookahead_peak(acomp, lxl, m, delay * os_factor);
+		}
+
+		// Static curve, gain reduction in dB
+		dsp->level_dB(lxl, lxl, dbscale, dboffset, -160.f, m);
+		for (i = 0; i < m; i++) {
+			lxl[i] -= gain_curve(lxl[i], thresdb, ratio, width);
+		}
+
+		// Attack/release smoothing is recursive and stays scalar
+		if (autorelease) {
+			/* The release falls back to the average gain reduction, not
+			 * to the detector: quickly after short peaks, slowly once
+			 * the compression has been held for a while */
+			for (i = 0; i < m; i++) {
+				Lya = slow_coeff * Lya + (1.-slow_coeff) * lxl[i];
+				const double Lfb = (lxl[i] > Lya) ? lxl[i] : Lya;
+				const double Lrel = release_coeff * Ly1 + (1.-release_coeff)*Lfb;
+				Ly1 = (lxl[i] > Lrel) ? lxl[i] : Lrel;
+				Lyl = attack_coeff * Lyl + (1.f-attack_coeff) * (float)Ly1;
+				lxl[i] = Lyl;
+			}
+		} else {
+			float y1 = Ly1;
+			for (i = 0; i < m; i++) {
+				const float Lrel = release_coeff * y1 + (1.f-release_coeff)*lxl[i];
+				y1 = (lxl[i] > Lrel) ? lxl[i] : Lrel;
+				Lyl = attack_coeff * Lyl + (1.f-attack_coeff) * y1;
+				lxl[i] = Lyl;
+			}
+			Ly1 = y1;
+		}
+		dsp->min_max(lxl, m, &gr_min, &gr_max);
 
-		cdb = -Lyl;
-		Lgain = from_dB(cdb);
+		dsp->gain_dB(lxl, lxl, -1.f, makeup_gain, m);
 
-		*(acomp->gainr) = Lyl;
+		// Gain application and output peak
+		for (c = 0; c < n_channels; c++) {
+			const float* in = acomp->input[c] + offset;
+			float* const out = acomp->output[c] + offset;
 
-		lgaininp = in0 * Lgain;
-		output[i] = lgaininp * from_dB(*(acomp->makeup));
+			lookahead_write(acomp->la_audio[c], acomp->la_mask, acomp->la_pos, in, n);
+			if (delay > 0) {
+				lookahead_read(acomp->la_audio[c], acomp->la_mask, acomp->la_pos,
+				               acomp->delayed, n, delay);
+				in = acomp->delayed;
+			}
 
-		max = (fabsf(output[i]) > max) ? fabsf(output[i]) : sanitize_denormal(max);
+			if (os_factor > 1) {
+				float* up = acomp->os_det[c];
 
-		acomp->old_yl = Lyl;
-		acomp->old_y1 = Ly1;
-		acomp->old_yg = Lyg;
+				// Without look-ahead the detector already upsampled this input
+				if (usesidechain || delay > 0) {
+					up = acomp->os_audio;
+					oversample_up(acomp, c, in, up, n);
+				}
+				dsp->mul(up, up, lxl, m);
+				oversample_down(acomp, c, up, out, n);
+			} else {
+				dsp->mul(out, in, lxl, n);
+			}
+
+			p = dsp->peak(out, n);
+			max = (p > max) ? p : max;
+		}
+
+		acomp->la_pos += n;
+		offset += n;
+	}
+
+	acomp->old_y1 = Ly1;
+	acomp->old_yl = Lyl;
+	acomp->old_ya = Lya;
+
+	if (n_samples == 0) {
+		gr_min = gr_max = Lyl;
 	}
+	acomp_meter(acomp, n_samples, gr_min, gr_max, max);
+
+	// Highest gain reduction of the block, not its last sample
+	*(acomp->gainr) = gr_max;
 	*(acomp->outlevel) = (max == 0.f) ? -45.f : to_dB(max);
+	*(acomp->latency) = (float)(delay + oversample_latency(os_factor));
+
+	afpu_restore(fpu);
 }
 
 static void
@@ -225,18 +1007,44 @@ deactivate(LV2_Handle instance)
 }
 
 static void
-cleanup(LV2_Handle instance)
+set_bypass(LV2_Handle instance, int enabled)
+{
+	((AComp*)instance)->tail_bypass = enabled;
+}
+
+static int
+bypassed(LV2_Handle instance)
+{
+	return ((AComp*)instance)->bypassed;
+}
+
+static uint32_t
+meter_read(LV2_Handle instance, AMeterBlock* blocks, uint32_t n)
 {
-	free(instance);
+	return ameter_pop(&((AComp*)instance)->meter, blocks, n);
+}
+
+static uint32_t
+meter_dropped(LV2_Handle instance)
+{
+	return __atomic_load_n(&((AComp*)instance)->meter.dropped, __ATOMIC_RELAXED);
 }
 
 const void*
 extension_data(const char* uri)
 {
+	static const ATailInterface tail = { set_bypass, bypassed };
+	static const AMeterInterface meter = { meter_read, meter_dropped };
+
+	if (!strcmp(uri, ATAIL__interface)) {
+		return &tail;
+	} else if (!strcmp(uri, AMETER__interface)) {
+		return &meter;
+	}
 	return NULL;
 }
 
-static const LV2_Descriptor descriptor = {
+static const LV2_Descriptor descriptor_mono = {
 	ACOMP_URI,
 	instantiate,
 	connect_port,
@@ -247,13 +1055,26 @@ static const LV2_Descriptor descriptor = {
 	extension_data
 };
 
+static const LV2_Descriptor descriptor_stereo = {
+	ACOMP_STEREO_URI,
+	instantiate,
+	connect_port,
+	activate,
+	run,
+	deactivate,
+	cleanup,
+	extension_data
+};
+
 LV2_SYMBOL_EXPORT
 const LV2_Descriptor*
 lv2_descriptor(uint32_t index)
 {
 	switch (index) {
 	case 0:
-		return &descriptor;
+		return &descriptor_mono;
+	case 1:
+		return &descriptor_stereo;
 	default:
 		return NULL;
 	}
@@ -0,0 +1,1049 @@
+/* a-conv
+ * Copyright (C) 2016 Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lv2/lv2plug.in/ns/lv2core/lv2.h"
+#include "lv2/lv2plug.in/ns/ext/atom/atom.h"
+#include "lv2/lv2plug.in/ns/ext/atom/forge.h"
+#include "lv2/lv2plug.in/ns/ext/atom/util.h"
+#include "lv2/lv2plug.in/ns/ext/buf-size/buf-size.h"
+#include "lv2/lv2plug.in/ns/ext/options/options.h"
+#include "lv2/lv2plug.in/ns/ext/patch/patch.h"
+#include "lv2/lv2plug.in/ns/ext/state/state.h"
+#include "lv2/lv2plug.in/ns/ext/urid/urid.h"
+#include "lv2/lv2plug.in/ns/ext/worker/worker.h"
+
+#include "denormal.h"
+#include "fft.h"
+
+#define ACONV_URI	"urn:ardour:a-conv"
+#define ACONV__ir	ACONV_URI "#ir"
+
+/* The first ACONV_HEAD taps of the IR are a direct FIR, the early part
+ * up to the tail offset is convolved in partitions of ACONV_HEAD samples
+ * in run(), the tail in partitions of ACONV_TAIL on the worker thread */
+#define ACONV_HEAD 64
+#define ACONV_TAIL 1024
+
+// Block length assumed when the host does not give maxBlockLength
+#define ACONV_DEFAULT_BLOCK 1024
+
+// Longest IR in frames, longer files are truncated
+#define ACONV_MAX_LENGTH (1 << 21)
+#define ACONV_MAX_PATH 1024
+
+#define ACONV_NO_BLOCK ((uint32_t)-1)
+
+typedef enum {
+	ACONV_INPUT0 = 0,
+	ACONV_INPUT1,
+	ACONV_OUTPUT0,
+	ACONV_OUTPUT1,
+
+	ACONV_CONTROL,
+	ACONV_NOTIFY,
+
+	ACONV_BLEND,
+} PortIndex;
+
+typedef struct {
+	LV2_URID atom_Blank;
+	LV2_URID atom_Object;
+	LV2_URID atom_Path;
+	LV2_URID atom_URID;
+	LV2_URID patch_Get;
+	LV2_URID patch_Set;
+	LV2_URID patch_property;
+	LV2_URID patch_value;
+	LV2_URID aconv_ir;
+} ConvURIs;
+
+/* Frequency domain delay line of uniformly partitioned overlap-save
+ * convolution: spectra of the last parts input blocks of size samples,
+ * 2 * size floats each, the newest at idx */
+typedef struct {
+	uint32_t size;
+	uint32_t parts;
+	uint32_t idx;
+	float* x;
+} ConvFDL;
+
+/* An impulse response, built on the worker and handed to run() whole.
+ * Spectra are 2 * partition size floats per partition, a mono IR shares
+ * them between both channels. */
+typedef struct ConvIR {
+	struct ConvIR* next;
+	char* path;
+	uint32_t channels;
+	uint32_t length;
+
+	// Head taps in reverse order
+	float head[2][ACONV_HEAD];
+	uint32_t early_parts;
+	float* early[2];
+	uint32_t tail_parts;
+	float* tail[2];
+
+	// Tail convolution state, only touched by the worker
+	ConvFDL fdl[2];
+	float in[2][2 * ACONV_TAIL];
+	float acc[2 * ACONV_TAIL];
+	float y[2 * ACONV_TAIL];
+} ConvIR;
+
+typedef enum {
+	ACONV_LOAD = 0,
+	ACONV_LOADED,
+	ACONV_TAIL_BLOCK,
+	ACONV_TAIL_DONE,
+	ACONV_FREE,
+} ConvMessageType;
+
+// Worker message, the path follows a load request
+typedef struct {
+	uint32_t type;
+	uint32_t block;
+	int reset;
+	ConvIR* ir;
+} ConvMessage;
+
+typedef struct {
+	float* input[2];
+	float* output[2];
+
+	const LV2_Atom_Sequence* control;
+	LV2_Atom_Sequence* notify;
+
+	float* blend;
+
+	float srate;
+	float oldblend;
+	int blend_reset; // oldblend is taken from the first run()
+
+	ConvURIs uris;
+	LV2_Atom_Forge forge;
+	LV2_URID_Map* map;
+	LV2_Worker_Schedule* schedule;
+
+	struct afft head_fft;
+	struct afft tail_fft;
+
+	ConvIR* ir;
+	// Replaced IRs, freed on the worker once it has seen their last block
+	ConvIR* retired;
+	int notify_ir;
+	int tail_reset;
+
+	/* The tail starts offset samples into the IR: its block b is sent
+	 * to the worker when complete and needed offset - ACONV_TAIL samples
+	 * later, at least two maximum block lengths.  A worker thread may
+	 * only answer after the next run(). */
+	uint32_t offset;
+	uint32_t now;
+	uint32_t pos;
+
+	// Previous and current head block of input, early output per channel
+	float in[2][2 * ACONV_HEAD];
+	float early_y[2][2 * ACONV_HEAD];
+	float acc[2 * ACONV_HEAD];
+	ConvFDL fdl[2];
+
+	/* Tail blocks in flight: input written by run(), output by the
+	 * worker.  Slot b & slot_mask holds the output of block b once
+	 * done[] says so, enough slots for the blocks between the two. */
+	uint32_t slot_mask;
+	float* tail_in[2];
+	float* tail_out[2];
+	uint32_t* done;
+} AConv;
+
+static inline void
+map_uris(LV2_URID_Map* map, ConvURIs* uris)
+{
+	uris->atom_Blank     = map->map(map->handle, LV2_ATOM__Blank);
+	uris->atom_Object    = map->map(map->handle, LV2_ATOM__Object);
+	uris->atom_Path      = map->map(map->handle, LV2_ATOM__Path);
+	uris->atom_URID      = map->map(map->handle, LV2_ATOM__URID);
+	uris->patch_Get      = map->map(map->handle, LV2_PATCH__Get);
+	uris->patch_Set      = map->map(map->handle, LV2_PATCH__Set);
+	uris->patch_property = map->map(map->handle, LV2_PATCH__property);
+	uris->patch_value    = map->map(map->handle, LV2_PATCH__value);
+	uris->aconv_ir       = map->map(map->handle, ACONV__ir);
+}
+
+/* Convolution */
+
+/* Push the spectrum of in, the previous and the current block, into the
+ * delay line and convolve it with the first nh partitions of h.  The
+ * current block of output is the second half of the 2 * size samples
+ * written to y, acc is scratch of the same size. */
+static void
+fdl_run(const struct afft* fft, ConvFDL* fdl, const float* h, uint32_t nh,
+        const float* in, float* acc, float* y)
+{
+	const uint32_t size = fdl->size;
+	const uint32_t spectrum = 2 * size;
+	uint32_t k, slot;
+	float* x;
+
+	fdl->idx = (fdl->idx + 1 == fdl->parts) ? 0 : fdl->idx + 1;
+	x = fdl->x + fdl->idx * spectrum;
+	afft_forward(fft, in, x, x + size);
+
+	// The history is kept for the next impulse response, the output is silent
+	if (!nh) {
+		memset(y, 0, spectrum * sizeof(float));
+		return;
+	}
+
+	memset(acc, 0, spectrum * sizeof(float));
+	for (k = 0, slot = fdl->idx; k < nh; k++) {
+		const float* const hk = h + k * spectrum;
+		x = fdl->x + slot * spectrum;
+		afft_mac(size, x, x + size, hk, hk + size, acc, acc + size);
+		slot = slot ? slot - 1 : fdl->parts - 1;
+	}
+	afft_inverse(fft, acc, acc + size, y);
+}
+
+/* Impulse responses
+ *
+ * The WAV file is mapped and its samples read straight from the mapping
+ * into the partition spectra, the file is never copied as a whole.
+ */
+
+typedef struct {
+	const uint8_t* data;
+	uint32_t frames;
+	uint32_t channels;
+	uint32_t format;
+	uint32_t bytes;
+	uint32_t stride;
+} Wav;
+
+static inline uint32_t
+le16(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t
+le32(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int
+wav_parse(const uint8_t* map, size_t size, Wav* wav)
+{
+	size_t pos = 12;
+	int fmt = 0;
+
+	memset(wav, 0, sizeof(Wav));
+	if (size < 12 || memcmp(map, "RIFF", 4) || memcmp(map + 8, "WAVE", 4)) {
+		return -1;
+	}
+
+	while (pos + 8 <= size) {
+		const uint8_t* chunk = map + pos;
+		size_t len = le32(chunk + 4);
+
+		if (len > size - pos - 8) {
+			len = size - pos - 8;
+		}
+		if (!memcmp(chunk, "fmt ", 4) && len >= 16) {
+			wav->format = le16(chunk + 8);
+			wav->channels = le16(chunk + 10);
+			wav->stride = le16(chunk + 20);
+			wav->bytes = le16(chunk + 22) / 8;
+			// WAVE_FORMAT_EXTENSIBLE, the sub format GUID starts with the tag
+			if (wav->format == 0xfffe && len >= 26) {
+				wav->format = le16(chunk + 32);
+			}
+			fmt = 1;
+		} else if (!memcmp(chunk, "data", 4) && fmt) {
+			wav->data = chunk + 8;
+			wav->frames = wav->stride ? len / wav->stride : 0;
+			break;
+		}
+		pos += 8 + len + (len & 1);
+	}
+
+	if (!wav->data || !wav->frames || !wav->channels
+	    || wav->stride < wav->channels * wav->bytes) {
+		return -1;
+	}
+	if (wav->format == 1 && wav->bytes >= 2 && wav->bytes <= 4) {
+		return 0;
+	}
+	if (wav->format == 3 && wav->bytes == 4) {
+		return 0;
+	}
+	return -1;
+}
+
+static inline float
+wav_sample(const Wav* wav, uint32_t frame, uint32_t channel)
+{
+	const uint8_t* p = wav->data + (size_t)frame * wav->stride + channel * wav->bytes;
+	uint32_t u;
+	float f;
+
+	switch (wav->bytes) {
+	case 2:
+		return (int16_t)le16(p) / 32768.f;
+	case 3:
+		return (int32_t)(le16(p) << 8 | (uint32_t)p[2] << 24) / 2147483648.f;
+	default:
+		u = le32(p);
+		if (wav->format == 3) {
+			memcpy(&f, &u, sizeof(f));
+			return f;
+		}
+		return (int32_t)u / 2147483648.f;
+	}
+}
+
+// Spectrum of size IR samples from start, zero padded to 2 * size
+static void
+ir_partition(const struct afft* fft, const Wav* wav, uint32_t length,
+             uint32_t channel, uint32_t start, float gain, float* tmp, float* spectrum)
+{
+	const uint32_t size = fft->n;
+	uint32_t i;
+
+	for (i = 0; i < size; i++) {
+		tmp[i] = (start + i < length) ? gain * wav_sample(wav, start + i, channel) : 0.f;
+	}
+	memset(tmp + size, 0, size * sizeof(float));
+	afft_forward(fft, tmp, spectrum, spectrum + size);
+}
+
+static void
+ir_free(ConvIR* ir)
+{
+	while (ir) {
+		ConvIR* next = ir->next;
+		if (ir->early[1] != ir->early[0]) {
+			free(ir->early[1]);
+		}
+		if (ir->tail[1] != ir->tail[0]) {
+			free(ir->tail[1]);
+		}
+		free(ir->early[0]);
+		free(ir->tail[0]);
+		free(ir->fdl[0].x);
+		free(ir->fdl[1].x);
+		free(ir->path);
+		free(ir);
+		ir = next;
+	}
+}
+
+static ConvIR*
+ir_build(const AConv* aconv, const Wav* wav, const char* path)
+{
+	const uint32_t length = (wav->frames < ACONV_MAX_LENGTH) ? wav->frames : ACONV_MAX_LENGTH;
+	const uint32_t channels = (wav->channels > 1) ? 2 : 1;
+	float tmp[2 * ACONV_TAIL];
+	double energy[2] = { 0., 0. };
+	float gain;
+	ConvIR* ir;
+	uint32_t c, i, k;
+
+	for (c = 0; c < channels; c++) {
+		for (i = 0; i < length; i++) {
+			const float s = wav_sample(wav, i, c);
+			energy[c] += s * s;
+		}
+	}
+	if (energy[0] < energy[1]) {
+		energy[0] = energy[1];
+	}
+	if (energy[0] <= 0.) {
+		return NULL;
+	}
+
+	ir = (ConvIR*)calloc(1, sizeof(ConvIR));
+	if (!ir) {
+		return NULL;
+	}
+	ir->path = strdup(path);
+	ir->channels = channels;
+	ir->length = length;
+
+	// Unit energy, so the wet level does not depend on the recording
+	gain = 1. / sqrt(energy[0]);
+
+	if (length > ACONV_HEAD) {
+		const uint32_t early = ((length < aconv->offset) ? length : aconv->offset) - ACONV_HEAD;
+		ir->early_parts = (early + ACONV_HEAD - 1) / ACONV_HEAD;
+	}
+	if (length > aconv->offset) {
+		ir->tail_parts = (length - aconv->offset + ACONV_TAIL - 1) / ACONV_TAIL;
+	}
+
+	for (c = 0; c < 2; c++) {
+		if (c < channels) {
+			ir->early[c] = (float*)malloc((ir->early_parts + 1) * 2 * ACONV_HEAD * sizeof(float));
+			ir->tail[c] = (float*)malloc((ir->tail_parts + 1) * 2 * ACONV_TAIL * sizeof(float));
+		} else {
+			ir->early[c] = ir->early[0];
+			ir->tail[c] = ir->tail[0];
+		}
+		ir->fdl[c].size = ACONV_TAIL;
+		ir->fdl[c].parts = ir->tail_parts ? ir->tail_parts : 1;
+		ir->fdl[c].x = (float*)calloc(ir->fdl[c].parts * 2 * ACONV_TAIL, sizeof(float));
+		if (!ir->path || !ir->early[c] || !ir->tail[c] || !ir->fdl[c].x) {
+			ir_free(ir);
+			return NULL;
+		}
+	}
+
+	for (c = 0; c < channels; c++) {
+		for (i = 0; i < ACONV_HEAD; i++) {
+			ir->head[c][ACONV_HEAD - 1 - i] = (i < length) ? gain * wav_sample(wav, i, c) : 0.f;
+		}
+		// Spectra include the 1 / n of the unnormalized inverse FFT
+		for (k = 0; k < ir->early_parts; k++) {
+			ir_partition(&aconv->head_fft, wav, length, c, ACONV_HEAD * (k + 1),
+			             gain / ACONV_HEAD, tmp, ir->early[c] + k * 2 * ACONV_HEAD);
+		}
+		for (k = 0; k < ir->tail_parts; k++) {
+			ir_partition(&aconv->tail_fft, wav, length, c, aconv->offset + ACONV_TAIL * k,
+			             gain / ACONV_TAIL, tmp, ir->tail[c] + k * 2 * ACONV_TAIL);
+		}
+	}
+	if (channels == 1) {
+		memcpy(ir->head[1], ir->head[0], sizeof(ir->head[0]));
+	}
+	return ir;
+}
+
+static ConvIR*
+ir_load(const AConv* aconv, const char* path)
+{
+	ConvIR* ir = NULL;
+	struct stat st;
+	void* map;
+	Wav wav;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "a-conv.lv2 error: cannot open %s\n", path);
+		return NULL;
+	}
+	if (fstat(fd, &st) || st.st_size <= 0) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	if (wav_parse((const uint8_t*)map, st.st_size, &wav)) {
+		fprintf(stderr, "a-conv.lv2 error: %s is not a PCM or float WAV file\n", path);
+	} else {
+		ir = ir_build(aconv, &wav, path);
+	}
+	munmap(map, st.st_size);
+	return ir;
+}
+
+/* Worker */
+
+static void
+tail_run(AConv* aconv, ConvIR* ir, uint32_t block, int reset)
+{
+	const uint32_t slot = block & aconv->slot_mask;
+	uint32_t c;
+
+	for (c = 0; c < 2; c++) {
+		if (reset) {
+			memset(ir->in[c], 0, sizeof(ir->in[c]));
+			memset(ir->fdl[c].x, 0, ir->fdl[c].parts * 2 * ACONV_TAIL * sizeof(float));
+		}
+		memcpy(ir->in[c], ir->in[c] + ACONV_TAIL, ACONV_TAIL * sizeof(float));
+		memcpy(ir->in[c] + ACONV_TAIL, aconv->tail_in[c] + slot * ACONV_TAIL, ACONV_TAIL * sizeof(float));
+		fdl_run(&aconv->tail_fft, &ir->fdl[c], ir->tail[c], ir->tail_parts,
+		        ir->in[c], ir->acc, ir->y);
+		memcpy(aconv->tail_out[c] + slot * ACONV_TAIL, ir->y + ACONV_TAIL, ACONV_TAIL * sizeof(float));
+	}
+}
+
+static LV2_Worker_Status
+work(LV2_Handle instance,
+     LV2_Worker_Respond_Function respond,
+     LV2_Worker_Respond_Handle handle,
+     uint32_t size,
+     const void* data)
+{
+	AConv* aconv = (AConv*)instance;
+	const ConvMessage* msg = (const ConvMessage*)data;
+	ConvMessage reply;
+
+	if (size < sizeof(ConvMessage)) {
+		return LV2_WORKER_ERR_UNKNOWN;
+	}
+	reply = *msg;
+
+	switch (msg->type) {
+	case ACONV_LOAD:
+		reply.type = ACONV_LOADED;
+		reply.ir = ir_load(aconv, (const char*)(msg + 1));
+		if (!reply.ir) {
+			return LV2_WORKER_ERR_UNKNOWN;
+		}
+		return respond(handle, sizeof(reply), &reply);
+	case ACONV_TAIL_BLOCK:
+		{
+			// The worker thread belongs to the host, as run() does
+			const afpu_state fpu = afpu_flush_denormals();
+			tail_run(aconv, msg->ir, msg->block, msg->reset);
+			afpu_restore(fpu);
+		}
+		reply.type = ACONV_TAIL_DONE;
+		return respond(handle, sizeof(reply), &reply);
+	case ACONV_FREE:
+		ir_free(msg->ir);
+		break;
+	}
+	return LV2_WORKER_SUCCESS;
+}
+
+static void
+retire(AConv* aconv)
+{
+	if (aconv->ir) {
+		aconv->ir->next = aconv->retired;
+		aconv->retired = aconv->ir;
+	}
+}
+
+static LV2_Worker_Status
+work_response(LV2_Handle instance, uint32_t size, const void* data)
+{
+	AConv* aconv = (AConv*)instance;
+	const ConvMessage* msg = (const ConvMessage*)data;
+
+	switch (msg->type) {
+	case ACONV_LOADED:
+		retire(aconv);
+		aconv->ir = msg->ir;
+		aconv->notify_ir = 1;
+		break;
+	case ACONV_TAIL_DONE:
+		if (msg->ir == aconv->ir) {
+			aconv->done[msg->block & aconv->slot_mask] = msg->block;
+		}
+		break;
+	}
+	return LV2_WORKER_SUCCESS;
+}
+
+/* Plugin */
+
+static void
+cleanup(LV2_Handle instance)
+{
+	AConv* aconv = (AConv*)instance;
+
+	ir_free(aconv->ir);
+	ir_free(aconv->retired);
+	aarena_free(instance);
+}
+
+/* The instance, the FFT tables, per channel the head FDL of fdl_parts
+ * partitions and the tail blocks in flight in slots of ACONV_TAIL.  IRs
+ * are loaded on the worker, which allocates them separately. */
+static AConv*
+aconv_layout(AArena* arena, uint32_t fdl_parts, uint32_t slots)
+{
+	AConv* aconv = (AConv*)aarena_take(arena, sizeof(AConv));
+	float* fdl[2];
+	float* tail_in[2];
+	float* tail_out[2];
+	uint32_t* done;
+	uint32_t c;
+
+	afft_take(aconv ? &aconv->head_fft : NULL, arena, ACONV_HEAD);
+	afft_take(aconv ? &aconv->tail_fft : NULL, arena, ACONV_TAIL);
+	for (c = 0; c < 2; c++) {
+		fdl[c] = (float*)aarena_take(arena, fdl_parts * 2 * ACONV_HEAD * sizeof(float));
+		tail_in[c] = (float*)aarena_take(arena, slots * ACONV_TAIL * sizeof(float));
+		tail_out[c] = (float*)aarena_take(arena, slots * ACONV_TAIL * sizeof(float));
+	}
+	done = (uint32_t*)aarena_take(arena, slots * sizeof(uint32_t));
+
+	if (aconv) {
+		for (c = 0; c < 2; c++) {
+			aconv->fdl[c].size = ACONV_HEAD;
+			aconv->fdl[c].parts = fdl_parts;
+			aconv->fdl[c].x = fdl[c];
+			aconv->tail_in[c] = tail_in[c];
+			aconv->tail_out[c] = tail_out[c];
+		}
+		aconv->done = done;
+	}
+	return aconv;
+}
+
+static LV2_Handle
+instantiate(const LV2_Descriptor* descriptor,
+            double rate,
+            const char* bundle_path,
+            const LV2_Feature* const* features)
+{
+	const LV2_Options_Option* options = NULL;
+	uint32_t block = ACONV_DEFAULT_BLOCK;
+	uint32_t slots = 1;
+	uint32_t offset;
+	LV2_URID_Map* map = NULL;
+	LV2_Worker_Schedule* schedule = NULL;
+	AArena arena = { NULL, 0, 0 };
+	AConv* aconv;
+	int i;
+
+	for (i = 0; features[i]; ++i) {
+		if (!strcmp(features[i]->URI, LV2_URID__map)) {
+			map = (LV2_URID_Map*)features[i]->data;
+		} else if (!strcmp(features[i]->URI, LV2_WORKER__schedule)) {
+			schedule = (LV2_Worker_Schedule*)features[i]->data;
+		} else if (!strcmp(features[i]->URI, LV2_OPTIONS__options)) {
+			options = (const LV2_Options_Option*)features[i]->data;
+		}
+	}
+
+	if (!map) {
+		fprintf(stderr, "a-conv.lv2 error: Host does not support urid:map\n");
+		return NULL;
+	}
+	if (!schedule) {
+		fprintf(stderr, "a-conv.lv2 error: Host does not support worker:schedule\n");
+		return NULL;
+	}
+
+	if (options) {
+		const LV2_URID max_block = map->map(map->handle, LV2_BUF_SIZE__maxBlockLength);
+		const LV2_URID atom_Int = map->map(map->handle, LV2_ATOM__Int);
+		for (; options->key; options++) {
+			if (options->key == max_block && options->type == atom_Int) {
+				block = *(const int32_t*)options->value;
+			}
+		}
+	}
+
+	offset = ACONV_TAIL + 2 * ((block + ACONV_HEAD - 1) / ACONV_HEAD * ACONV_HEAD);
+	while (slots < offset / ACONV_TAIL + 2) {
+		slots <<= 1;
+	}
+
+	aconv_layout(&arena, offset / ACONV_HEAD - 1, slots);
+	if (aarena_alloc(&arena)) {
+		return NULL;
+	}
+	aconv = aconv_layout(&arena, offset / ACONV_HEAD - 1, slots);
+	aconv->map = map;
+	aconv->schedule = schedule;
+
+	map_uris(aconv->map, &aconv->uris);
+	lv2_atom_forge_init(&aconv->forge, aconv->map);
+
+	aconv->srate = rate;
+	aconv->offset = offset;
+	aconv->slot_mask = slots - 1;
+	afft_init(&aconv->head_fft);
+	afft_init(&aconv->tail_fft);
+
+	return (LV2_Handle)aconv;
+}
+
+static void
+connect_port(LV2_Handle instance,
+             uint32_t port,
+             void* data)
+{
+	AConv* aconv = (AConv*)instance;
+
+	switch ((PortIndex)port) {
+	case ACONV_INPUT0:
+		aconv->input[0] = (float*)data;
+		break;
+	case ACONV_INPUT1:
+		aconv->input[1] = (float*)data;
+		break;
+	case ACONV_OUTPUT0:
+		aconv->output[0] = (float*)data;
+		break;
+	case ACONV_OUTPUT1:
+		aconv->output[1] = (float*)data;
+		break;
+	case ACONV_CONTROL:
+		aconv->control = (const LV2_Atom_Sequence*)data;
+		break;
+	case ACONV_NOTIFY:
+		aconv->notify = (LV2_Atom_Sequence*)data;
+		break;
+	case ACONV_BLEND:
+		aconv->blend = (float*)data;
+		break;
+	}
+}
+
+static void
+activate(LV2_Handle instance)
+{
+	AConv* aconv = (AConv*)instance;
+	uint32_t c, s;
+
+	for (c = 0; c < 2; c++) {
+		memset(aconv->fdl[c].x, 0, aconv->fdl[c].parts * 2 * ACONV_HEAD * sizeof(float));
+		aconv->fdl[c].idx = 0;
+		memset(aconv->tail_in[c], 0, (aconv->slot_mask + 1) * ACONV_TAIL * sizeof(float));
+	}
+	memset(aconv->in, 0, sizeof(aconv->in));
+	memset(aconv->early_y, 0, sizeof(aconv->early_y));
+	for (s = 0; s <= aconv->slot_mask; s++) {
+		aconv->done[s] = ACONV_NO_BLOCK;
+	}
+	aconv->now = 0;
+	aconv->pos = 0;
+	aconv->tail_reset = 1;
+	aconv->blend_reset = 1;
+}
+
+static void
+set_ir(AConv* aconv, const LV2_Atom_Object* obj)
+{
+	const ConvURIs* uris = &aconv->uris;
+	const LV2_Atom* property = NULL;
+	const LV2_Atom* value = NULL;
+	struct {
+		ConvMessage msg;
+		char path[ACONV_MAX_PATH];
+	} load;
+
+	lv2_atom_object_get(obj, uris->patch_property, &property, uris->patch_value, &value, 0);
+	if (!property || property->type != uris->atom_URID
+	    || ((const LV2_Atom_URID*)property)->body != uris->aconv_ir) {
+		return;
+	}
+	if (!value || value->type != uris->atom_Path
+	    || value->size < 2 || value->size > ACONV_MAX_PATH) {
+		return;
+	}
+
+	memset(&load.msg, 0, sizeof(load.msg));
+	load.msg.type = ACONV_LOAD;
+	memcpy(load.path, LV2_ATOM_BODY_CONST(value), value->size);
+	load.path[value->size - 1] = '\0';
+	aconv->schedule->schedule_work(aconv->schedule->handle,
+	                               sizeof(load.msg) + value->size, &load);
+}
+
+static void
+notify_ir(AConv* aconv)
+{
+	const ConvURIs* uris = &aconv->uris;
+	LV2_Atom_Forge_Frame frame;
+
+	lv2_atom_forge_frame_time(&aconv->forge, 0);
+	lv2_atom_forge_object(&aconv->forge, &frame, 0, uris->patch_Set);
+	lv2_atom_forge_key(&aconv->forge, uris->patch_property);
+	lv2_atom_forge_urid(&aconv->forge, uris->aconv_ir);
+	lv2_atom_forge_key(&aconv->forge, uris->patch_value);
+	lv2_atom_forge_path(&aconv->forge, aconv->ir->path, strlen(aconv->ir->path));
+	lv2_atom_forge_pop(&aconv->forge, &frame);
+}
+
+// End of a head block: early output for the next one, tail to the worker
+static void
+head_block(AConv* aconv)
+{
+	const ConvIR* ir = aconv->ir;
+	const uint32_t start = aconv->now - ACONV_HEAD;
+	const uint32_t slot = (start / ACONV_TAIL) & aconv->slot_mask;
+	uint32_t c;
+
+	for (c = 0; c < 2; c++) {
+		fdl_run(&aconv->head_fft, &aconv->fdl[c], ir ? ir->early[c] : NULL,
+		        ir ? ir->early_parts : 0, aconv->in[c], aconv->acc, aconv->early_y[c]);
+		memcpy(aconv->tail_in[c] + slot * ACONV_TAIL + start % ACONV_TAIL,
+		       aconv->in[c] + ACONV_HEAD, ACONV_HEAD * sizeof(float));
+		memcpy(aconv->in[c], aconv->in[c] + ACONV_HEAD, ACONV_HEAD * sizeof(float));
+	}
+
+	if (ir && ir->tail_parts && aconv->now % ACONV_TAIL == 0) {
+		ConvMessage msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.type = ACONV_TAIL_BLOCK;
+		msg.block = start / ACONV_TAIL;
+		msg.reset = aconv->tail_reset;
+		msg.ir = aconv->ir;
+		if (aconv->schedule->schedule_work(aconv->schedule->handle, sizeof(msg), &msg) == LV2_WORKER_SUCCESS) {
+			aconv->tail_reset = 0;
+		}
+	}
+}
+
+// n samples from offset, within one head block
+static void
+process(AConv* aconv, uint32_t offset, uint32_t n, float blend, float dblend)
+{
+	const ConvIR* ir = aconv->ir;
+	const uint32_t pos = aconv->pos;
+	const uint32_t t = aconv->now - aconv->offset;
+	const uint32_t block = t / ACONV_TAIL;
+	const uint32_t slot = block & aconv->slot_mask;
+	const int tail = aconv->done[slot] == block;
+	uint32_t c, i, j;
+
+	for (c = 0; c < 2; c++) {
+		const float* const in = aconv->input[c] + offset;
+		float* const out = aconv->output[c] + offset;
+		float* const x = aconv->in[c] + pos + 1;
+		float wet[ACONV_HEAD];
+
+		memcpy(aconv->in[c] + ACONV_HEAD + pos, in, n * sizeof(float));
+
+		if (ir) {
+			const float* const h = ir->head[c];
+			const float* const early = aconv->early_y[c] + ACONV_HEAD + pos;
+			for (i = 0; i < n; i++) {
+				float sum = early[i];
+				for (j = 0; j < ACONV_HEAD; j++) {
+					sum += h[j] * x[i + j];
+				}
+				wet[i] = sum;
+			}
+		} else {
+			memset(wet, 0, n * sizeof(float));
+		}
+		if (tail) {
+			const float* const y = aconv->tail_out[c] + slot * ACONV_TAIL + t % ACONV_TAIL;
+			for (i = 0; i < n; i++) {
+				wet[i] += y[i];
+			}
+		}
+
+		for (i = 0; i < n; i++) {
+			const float b = blend + (i + 1) * dblend;
+			out[i] = in[i] + b * (wet[i] - in[i]);
+		}
+	}
+}
+
+static void
+run(LV2_Handle instance, uint32_t n_samples)
+{
+	AConv* aconv = (AConv*)instance;
+	const afpu_state fpu = afpu_flush_denormals();
+	const ConvURIs* uris = &aconv->uris;
+	const uint32_t capacity = aconv->notify->atom.size;
+	LV2_Atom_Forge_Frame frame;
+
+	const float target = *(aconv->blend);
+	float blend = aconv->blend_reset ? target : aconv->oldblend;
+	const float dblend = n_samples ? (target - blend) / n_samples : 0.f;
+	uint32_t i = 0;
+
+	lv2_atom_forge_set_buffer(&aconv->forge, (uint8_t*)aconv->notify, capacity);
+	lv2_atom_forge_sequence_head(&aconv->forge, &frame, 0);
+
+	LV2_ATOM_SEQUENCE_FOREACH(aconv->control, ev) {
+		if (ev->body.type == uris->atom_Blank || ev->body.type == uris->atom_Object) {
+			const LV2_Atom_Object* obj = (const LV2_Atom_Object*)&ev->body;
+			if (obj->body.otype == uris->patch_Set) {
+				set_ir(aconv, obj);
+			} else if (obj->body.otype == uris->patch_Get) {
+				aconv->notify_ir = 1;
+			}
+		}
+	}
+
+	if (aconv->retired) {
+		ConvMessage msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.type = ACONV_FREE;
+		msg.ir = aconv->retired;
+		if (aconv->schedule->schedule_work(aconv->schedule->handle, sizeof(msg), &msg) == LV2_WORKER_SUCCESS) {
+			aconv->retired = NULL;
+		}
+	}
+
+	if (aconv->notify_ir && aconv->ir) {
+		notify_ir(aconv);
+		aconv->notify_ir = 0;
+	}
+
+	// Head blocks are aligned to the tail blocks and to the tail offset
+	while (i < n_samples) {
+		uint32_t n = ACONV_HEAD - aconv->pos;
+		if (n > n_samples - i) {
+			n = n_samples - i;
+		}
+		process(aconv, i, n, blend, dblend);
+		blend += n * dblend;
+		i += n;
+		aconv->pos += n;
+		aconv->now += n;
+		if (aconv->pos == ACONV_HEAD) {
+			aconv->pos = 0;
+			head_block(aconv);
+		}
+	}
+
+	aconv->oldblend = target;
+	aconv->blend_reset = 0;
+	lv2_atom_forge_pop(&aconv->forge, &frame);
+
+	afpu_restore(fpu);
+}
+
+static void
+deactivate(LV2_Handle instance)
+{
+}
+
+/* State: the IR is saved as a path, made portable with state:mapPath */
+
+static LV2_State_Status
+save(LV2_Handle instance,
+     LV2_State_Store_Function store,
+     LV2_State_Handle handle,
+     uint32_t flags,
+     const LV2_Feature* const* features)
+{
+	AConv* aconv = (AConv*)instance;
+	LV2_State_Map_Path* map_path = NULL;
+	LV2_State_Status status;
+	char* path;
+	int i;
+
+	if (!aconv->ir) {
+		return LV2_STATE_SUCCESS;
+	}
+	for (i = 0; features && features[i]; ++i) {
+		if (!strcmp(features[i]->URI, LV2_STATE__mapPath)) {
+			map_path = (LV2_State_Map_Path*)features[i]->data;
+		}
+	}
+	if (!map_path) {
+		return LV2_STATE_ERR_NO_FEATURE;
+	}
+
+	path = map_path->abstract_path(map_path->handle, aconv->ir->path);
+	if (!path) {
+		return LV2_STATE_ERR_UNKNOWN;
+	}
+	status = store(handle, aconv->uris.aconv_ir, path, strlen(path) + 1,
+	               aconv->uris.atom_Path, LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+	free(path);
+	return status;
+}
+
+static LV2_State_Status
+restore(LV2_Handle instance,
+        LV2_State_Retrieve_Function retrieve,
+        LV2_State_Handle handle,
+        uint32_t flags,
+        const LV2_Feature* const* features)
+{
+	AConv* aconv = (AConv*)instance;
+	LV2_State_Map_Path* map_path = NULL;
+	const void* value;
+	size_t size;
+	uint32_t type, valflags;
+	ConvIR* ir;
+	char* path;
+	int i;
+
+	value = retrieve(handle, aconv->uris.aconv_ir, &size, &type, &valflags);
+	if (!value || type != aconv->uris.atom_Path) {
+		return LV2_STATE_SUCCESS;
+	}
+	for (i = 0; features && features[i]; ++i) {
+		if (!strcmp(features[i]->URI, LV2_STATE__mapPath)) {
+			map_path = (LV2_State_Map_Path*)features[i]->data;
+		}
+	}
+
+	path = map_path ? map_path->absolute_path(map_path->handle, (const char*)value)
+	                : strdup((const char*)value);
+	if (!path) {
+		return LV2_STATE_ERR_UNKNOWN;
+	}
+	ir = ir_load(aconv, path);
+	free(path);
+	if (!ir) {
+		return LV2_STATE_ERR_UNKNOWN;
+	}
+
+	/* run() is not running, but tail blocks of the old IR may still be
+	 * queued: let the worker free it after them */
+	retire(aconv);
+	aconv->ir = ir;
+	aconv->notify_ir = 1;
+	return LV2_STATE_SUCCESS;
+}
+
+const void*
+extension_data(const char* uri)
+{
+	static const LV2_Worker_Interface worker = { work, work_response, NULL };
+	static const LV2_State_Interface state = { save, restore };
+
+	if (!strcmp(uri, LV2_WORKER__interface)) {
+		return &worker;
+	}
+	if (!strcmp(uri, LV2_STATE__interface)) {
+		return &state;
+	}
+	return NULL;
+}
+
+static const LV2_Descriptor descriptor = {
+	ACONV_URI,
+	instantiate,
+	connect_port,
+	activate,
+	run,
+	deactivate,
+	cleanup,
+	extension_data
+};
+
+LV2_SYMBOL_EXPORT
+const LV2_Descriptor*
+lv2_descriptor(uint32_t index)
+{
+	switch (index) {
+	case 0:
+		return &descriptor;
+	default:
+		return NULL;
+	}
+}
@@ -12,9 +12,13 @@
  * GNU General Public License for more details.
  */
 
+// posix_memalign() with -std=c11
+#define _POSIX_C_SOURCE 200112L
+
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "lv2/lv2plug.in/ns/lv2core/lv2.h"
 #include "lv2/lv2plug.in/ns/ext/atom/atom.h"
@@ -22,10 +26,30 @@
 #include "lv2/lv2plug.in/ns/ext/atom/forge.h"
 #include "lv2/lv2plug.in/ns/ext/urid/urid.h"
 
+#include "arena.h"
+#include "denormal.h"
+#include "dsp.h"
+#include "tail.h"
+
 #define ADELAY_URI "urn:ardour:a-delay"
+#define ADELAY_MULTITAP_URI "urn:ardour:a-delay#multitap"
+
+// Longest delay time in ms, the buffer is sized for it at the actual rate
+#define ADELAY_MAX_TIME 8000.f
+
+// Samples per pass of the block path
+#define ADELAY_BLOCK 256
 
-// 8 seconds of delay at 96kHz
-#define MAX_DELAY 768000
+// Time constant of the delay time glide with interpolated taps, in ms
+#define ADELAY_SMOOTH_MS 50.f
+
+// Taps of the multitap variant, including the main one
+#define ADELAY_MAX_TAPS 4
+// Control ports per further tap: time, level, pan and lpf
+#define ADELAY_TAP_PORTS 4
+
+// Upper bound of the feedback gain
+#define ADELAY_MAX_FEEDBACK 0.95f
 
 #ifndef M_PI
 # define M_PI 3.1415926
@@ -46,8 +70,38 @@ typedef enum {
 	ADELAY_GAIN,
 	
 	ADELAY_DELAYTIME,
+	ADELAY_INTERP,
+	ADELAY_FEEDBACK,
+
+	// Multitap only
+	ADELAY_OUTPUT2,
+	ADELAY_PAN,
+	ADELAY_TAPS,
 } PortIndex;
 
+typedef enum {
+	INTERP_NONE = 0, // integer taps, crossfade on change
+	INTERP_LINEAR,
+	INTERP_CUBIC,
+	INTERP_ALLPASS,
+} InterpMode;
+
+/* A further tap of the multitap variant, reading the shared delay line
+ * at a fixed integer delay through its own lowpass */
+typedef struct {
+	float* time;
+	float* level;
+	float* pan;
+	float* lpf;
+
+	uint32_t tap[2];
+	int active;
+	int changed;
+	float timeold;
+	float lpfold;
+	float coeff[5];
+	float state[4];
+} DelayTap;
 
 typedef struct {
 	LV2_URID atom_Blank;
@@ -77,19 +131,34 @@ typedef struct {
 	float* gain;
 	
 	float* delaytime;
+	float* interp;
+	float* feedback;
+
+	float* output2;
+	float* pan;
 
+	const struct adsp* dsp;
 	float srate;
 	float bpm;
 	float beatunit;
 	int beatuniti;
 	int bpmvalid;
+	int bpmchanged;
 
+	/* Delay line of mask + 1 samples, a power of two. Only the last
+	 * valid samples before posz have been written since activate(). */
+	float* z;
+	uint32_t mask;
+	uint32_t valid;
 	uint32_t posz;
-	float tap[2];
-	float z[MAX_DELAY];
+	/* Samples written in a row below ATAIL_SILENCE, the line is silent
+	 * for taps up to that far back */
+	uint32_t quiet;
+	int tail_bypass;
+	int bypassed;
+	uint32_t tap[2];
 	int active;
 	int next;
-	float fbstate;
 	float lpfold;
 	float divisorold;
 	float gainold;
@@ -104,6 +173,24 @@ typedef struct {
 	float B0, B1, B2, B3, B4, B5;
 	float state[4];
 
+	float buf[ADELAY_BLOCK];
+
+	/* Interpolated taps: the delay in samples glides towards its target
+	 * per sample, read positions are gathered into x[] per block */
+	float delay;
+	float delaytarget;
+	float smooth;
+	float apstate;
+	uint32_t idx[ADELAY_BLOCK];
+	float frac[ADELAY_BLOCK];
+	float x[4][ADELAY_BLOCK];
+
+	/* Multitap: taps[0] is unused, the main tap is the one above.
+	 * All taps are summed into the stereo wet signal in mix[] */
+	int multitap;
+	DelayTap taps[ADELAY_MAX_TAPS];
+	float mix[2][ADELAY_BLOCK];
+
 	DelayURIs uris;
 	LV2_Atom_Forge forge;
 	LV2_URID_Map* map;
@@ -124,33 +211,68 @@ map_uris(LV2_URID_Map* map, DelayURIs* uris)
 	uris->time_Position       = map->map(map->handle, LV2_TIME__Position);
 }
 
+// The instance and its delay line of size samples
+static ADelay*
+adelay_layout(AArena* arena, uint32_t size)
+{
+	ADelay* adelay = (ADelay*)aarena_take(arena, sizeof(ADelay));
+	float* z = (float*)aarena_take(arena, size * sizeof(float));
+
+	if (adelay) {
+		adelay->z = z;
+	}
+	return adelay;
+}
+
 static LV2_Handle
 instantiate(const LV2_Descriptor* descriptor,
             double rate,
             const char* bundle_path,
             const LV2_Feature* const* features)
 {
+	LV2_URID_Map* map = NULL;
+	AArena arena = { NULL, 0, 0 };
+	ADelay* adelay;
+	uint32_t size = 1;
+	uint32_t needed = (uint32_t)ceil(ADELAY_MAX_TIME * rate / 1000.) + 1;
 	int i;
-	ADelay* adelay = (ADelay*)calloc(1, sizeof(ADelay));
-	if (!adelay) return NULL;
 
-	for (i = 0; features[i]; ++i) {
+	// A feature without data is as good as none
+	for (i = 0; features && features[i]; ++i) {
 		if (!strcmp(features[i]->URI, LV2_URID__map)) {
-			adelay->map = (LV2_URID_Map*)features[i]->data;
+			map = (LV2_URID_Map*)features[i]->data;
 		}
 	}
-
-	if (!adelay->map) {
+	if (!map || !map->map) {
 		fprintf(stderr, "a-delay.lv2 error: Host does not support urid:map\n");
-		free(adelay);
 		return NULL;
 	}
 
+	while (size < needed) {
+		size <<= 1;
+	}
+	adelay_layout(&arena, size);
+	if (aarena_alloc(&arena)) {
+		return NULL;
+	}
+	adelay = adelay_layout(&arena, size);
+	adelay->map = map;
+
 	map_uris(adelay->map, &adelay->uris);
 	lv2_atom_forge_init(&adelay->forge, adelay->map);
 
+	adelay->dsp = adsp_get();
+	adelay->tail_bypass = 1;
 	adelay->srate = rate;
+	adelay->multitap = !strcmp(descriptor->URI, ADELAY_MULTITAP_URI);
 	adelay->bpmvalid = 0;
+	adelay->bpmchanged = 0;
+	// Position updates may carry only one of tempo and beat unit
+	adelay->bpm = 120.f;
+	adelay->beatunit = 4.f;
+
+	adelay->mask = size - 1;
+	adelay->smooth = 1.f - expf(-1000.f / (ADELAY_SMOOTH_MS * rate));
 
 	return (LV2_Handle)adelay;
 }
@@ -196,27 +318,32 @@ connect_port(LV2_Handle instance,
 	case ADELAY_DELAYTIME:
 		adelay->delaytime = (float*)data;
 		break;
+	case ADELAY_INTERP:
+		adelay->interp = (float*)data;
+		break;
+	case ADELAY_FEEDBACK:
+		adelay->feedback = (float*)data;
+		break;
+	case ADELAY_OUTPUT2:
+		adelay->output2 = (float*)data;
+		break;
+	case ADELAY_PAN:
+		adelay->pan = (float*)data;
+		break;
+	default:
+		if (port >= ADELAY_TAPS && port < ADELAY_TAPS + (ADELAY_MAX_TAPS - 1) * ADELAY_TAP_PORTS) {
+			DelayTap* tp = &adelay->taps[1 + (port - ADELAY_TAPS) / ADELAY_TAP_PORTS];
+			switch ((port - ADELAY_TAPS) % ADELAY_TAP_PORTS) {
+			case 0: tp->time = (float*)data; break;
+			case 1: tp->level = (float*)data; break;
+			case 2: tp->pan = (float*)data; break;
+			case 3: tp->lpf = (float*)data; break;
+			}
+		}
+		break;
 	}
 }
 
-static inline float
-sanitize_denormal(float value) {
-	if (!isnormal(value)) {
-		value = 0.f;
-	}
-	return value;
-}
-
-static inline float
-from_dB(float gdb) {
-	return (exp(gdb/20.f*log(10.f)));
-}
-
-static inline float
-to_dB(float g) {
-	return (20.f*log10(g));
-}
-
 static void clearfilter(LV2_Handle instance)
 {
 	ADelay* adelay = (ADelay*)instance;
@@ -229,17 +356,16 @@ static void
 activate(LV2_Handle instance)
 {
 	ADelay* adelay = (ADelay*)instance;
-
 	int i;
-	for (i = 0; i < MAX_DELAY; i++) {
-		adelay->z[i] = 0.f;
-	}
+
+	// The delay line is cleared lazily, see clear_history()
+	adelay->valid = 0;
 	adelay->posz = 0;
+	adelay->quiet = 0;
 	adelay->tap[0] = 0;
 	adelay->tap[1] = 0;
 	adelay->active = 0;
 	adelay->next = 1;
-	adelay->fbstate = 0.f;
 
 	clearfilter(adelay);
 
@@ -252,6 +378,18 @@ activate(LV2_Handle instance)
 	adelay->syncold = 0.f;
 	adelay->wetdryold = 0.f;
 	adelay->delaysamplesold = 1.f;
+	adelay->delay = adelay->delaytarget = 0.f;
+	adelay->apstate = 0.f;
+
+	for (i = 1; i < ADELAY_MAX_TAPS; i++) {
+		DelayTap* tp = &adelay->taps[i];
+		tp->tap[0] = tp->tap[1] = 0;
+		tp->active = 0;
+		tp->changed = 0;
+		tp->timeold = 0.f;
+		tp->lpfold = 0.f;
+		memset(tp->state, 0, sizeof(tp->state));
+	}
 }
 
 static void lpfRbj(LV2_Handle instance, float fc, float srate)
@@ -280,21 +418,204 @@ static void lpfRbj(LV2_Handle instance, float fc, float srate)
 	adelay->B5 = adelay->B3;
 }
 
-static float runfilter(LV2_Handle instance, float in)
+// Lowpass coefficients for a tap, normalized: b0 b1 b2 a1 a2
+static void
+lpf_coeffs(float fc, float srate, float* c)
+{
+	const float q = 0.707;
+	const float w0 = (2. * M_PI * fc / srate);
+	const float cw = cos(w0);
+	const float alpha = sin(w0) / (2. * q);
+	const float a0 = 1. + alpha;
+
+	c[0] = (1. - cw) / 2. / a0;
+	c[1] = (1. - cw) / a0;
+	c[2] = c[0];
+	c[3] = -2. * cw / a0;
+	c[4] = (1. - alpha) / a0;
+}
+
+// Biquad over buf in place, c[] as from lpf_coeffs()
+static void
+biquad_block(const float* c, float* state, float* buf, uint32_t n)
+{
+	const float b0 = c[0], b1 = c[1], b2 = c[2];
+	const float a1 = c[3], a2 = c[4];
+	float s0 = state[0], s1 = state[1];
+	float s2 = state[2], s3 = state[3];
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		const float in = buf[i];
+		const float out = b0*in + b1*s0 + b2*s1 - a1*s2 - a2*s3;
+		s1 = s0;
+		s0 = in;
+		s3 = s2;
+		s2 = out;
+		buf[i] = out;
+	}
+
+	state[0] = s0; state[1] = s1;
+	state[2] = s2; state[3] = s3;
+}
+
+static void
+runfilter_block(ADelay* a, float* buf, uint32_t n)
+{
+	const float c[5] = {
+		a->B0 / a->A0, a->B1 / a->A0, a->B2 / a->A0,
+		a->A1 / a->A0, a->A2 / a->A0
+	};
+
+	biquad_block(c, a->state, buf, n);
+}
+
+// Copy n samples into the delay line at posz, in at most two runs
+static void
+delay_write(ADelay* adelay, const float* in, uint32_t n)
+{
+	const uint32_t w = adelay->posz;
+	const uint32_t len = adelay->mask + 1 - w;
+
+	if (len >= n) {
+		memcpy(adelay->z + w, in, n * sizeof(float));
+	} else {
+		memcpy(adelay->z + w, in, len * sizeof(float));
+		memcpy(adelay->z, in + len, (n - len) * sizeof(float));
+	}
+}
+
+// Copy the n samples starting tap samples before posz out of the delay line
+static void
+delay_read(const ADelay* adelay, uint32_t tap, float* out, uint32_t n)
+{
+	const uint32_t r = (adelay->posz - tap) & adelay->mask;
+	const uint32_t len = adelay->mask + 1 - r;
+
+	if (len >= n) {
+		memcpy(out, adelay->z + r, n * sizeof(float));
+	} else {
+		memcpy(out, adelay->z + r, len * sizeof(float));
+		memcpy(out + len, adelay->z, (n - len) * sizeof(float));
+	}
+}
+
+/* Recirculate fb times the filtered tap into the n samples just written
+ * at posz.  A decaying loop flushes to zero once it leaves the normal
+ * range, run() has the FPU treat denormals as zero. */
+static void
+delay_feedback(ADelay* adelay, const float* buf, float fb, uint32_t n)
+{
+	float* const z = adelay->z;
+	const uint32_t w = adelay->posz;
+	const uint32_t len = adelay->mask + 1 - w;
+	const uint32_t n0 = (len >= n) ? n : len;
+	uint32_t i;
+
+	for (i = 0; i < n0; i++) {
+		z[w + i] += fb * buf[i];
+	}
+	for (; i < n; i++) {
+		z[i - n0] += fb * buf[i];
+	}
+}
+
+// Peak of the n samples just written at posz
+static float
+delay_peak(const ADelay* adelay, uint32_t n)
+{
+	const uint32_t w = adelay->posz;
+	const uint32_t len = adelay->mask + 1 - w;
+	float p;
+
+	if (len >= n) {
+		return adelay->dsp->peak(adelay->z + w, n);
+	}
+	p = adelay->dsp->peak(adelay->z + w, len);
+	return fmaxf(p, adelay->dsp->peak(adelay->z, n - len));
+}
+
+static void
+delay_quiet(ADelay* adelay, float peak, uint32_t n)
+{
+	if (peak >= ATAIL_SILENCE) {
+		adelay->quiet = 0;
+	} else if (adelay->quiet + n > adelay->mask) {
+		adelay->quiet = adelay->mask + 1;
+	} else {
+		adelay->quiet += n;
+	}
+}
+
+/*
+ * Fractional delay read of n samples into buf. Positions and fractions
+ * are computed first, the taps gathered next, so the interpolation itself
+ * is a plain vectorizable loop (the allpass is recursive and stays scalar).
+ */
+static void
+delay_read_interp(ADelay* adelay, InterpMode mode, float* buf, uint32_t n)
 {
-	ADelay* a = (ADelay*)instance;
+	const uint32_t mask = adelay->mask;
+	const float* const z = adelay->z;
+	const float target = adelay->delaytarget;
+	const float smooth = adelay->smooth;
+	// The allpass keeps its fraction in [0.5, 1.5) where it is well behaved
+	const float shift = (mode == INTERP_ALLPASS) ? 0.5f : 0.f;
+	uint32_t* const idx = adelay->idx;
+	float* const frac = adelay->frac;
+	float* const xm1 = adelay->x[0];
+	float* const x0 = adelay->x[1];
+	float* const x1 = adelay->x[2];
+	float* const x2 = adelay->x[3];
+	float d = adelay->delay;
+	uint32_t i;
 
-	float out;
-	in = sanitize_denormal(in);
+	for (i = 0; i < n; i++) {
+		uint32_t di;
+		d += smooth * (target - d);
+		di = (uint32_t)(d - shift);
+		frac[i] = d - (float)di;
+		idx[i] = (adelay->posz + i - di) & mask;
+	}
+	adelay->delay = d;
 
-	out = a->B0/a->A0*in + a->B1/a->A0*a->state[0] + a->B2/a->A0*a->state[1]
-			-a->A1/a->A0*a->state[2] - a->A2/a->A0*a->state[3] + 1e-20;
+	for (i = 0; i < n; i++) {
+		x0[i] = z[idx[i]];
+		x1[i] = z[(idx[i] - 1) & mask];
+	}
 
-	a->state[1] = a->state[0];
-	a->state[0] = in;
-	a->state[3] = a->state[2];
-	a->state[2] = out;
-	return out;
+	switch (mode) {
+	case INTERP_CUBIC:
+		for (i = 0; i < n; i++) {
+			xm1[i] = z[(idx[i] + 1) & mask];
+			x2[i] = z[(idx[i] - 2) & mask];
+		}
+		// 4-point, 3rd order Hermite between x0 and the older x1
+		for (i = 0; i < n; i++) {
+			const float f = frac[i];
+			const float c1 = 0.5f * (x1[i] - xm1[i]);
+			const float c2 = xm1[i] - 2.5f * x0[i] + 2.f * x1[i] - 0.5f * x2[i];
+			const float c3 = 0.5f * (x2[i] - xm1[i]) + 1.5f * (x0[i] - x1[i]);
+			buf[i] = ((c3 * f + c2) * f + c1) * f + x0[i];
+		}
+		break;
+	case INTERP_ALLPASS:
+		{
+			float y = adelay->apstate;
+			for (i = 0; i < n; i++) {
+				const float eta = (1.f - frac[i]) / (1.f + frac[i]);
+				y = eta * (x0[i] - y) + x1[i];
+				buf[i] = y;
+			}
+			adelay->apstate = y;
+		}
+		break;
+	default:
+		for (i = 0; i < n; i++) {
+			buf[i] = x0[i] + frac[i] * (x1[i] - x0[i]);
+		}
+		break;
+	}
 }
 
 static void
@@ -329,24 +650,215 @@ update_bpm(ADelay* self, const LV2_Atom_Object* obj)
 		self->beatunit = (float)b;
 	}
 	self->bpmvalid = 1;
+	self->bpmchanged = 1;
 }
 
+/* Zero the part of the last tap samples that has not been written since
+ * activate(), so the cost is bounded by the delay actually in use */
 static void
-run(LV2_Handle instance, uint32_t n_samples)
+clear_history(ADelay* adelay, uint32_t tap)
 {
-	ADelay* adelay = (ADelay*)instance;
+	uint32_t start, len, first;
 
-	const float* const input = adelay->input;
-	float* const output = adelay->output;
+	if (tap <= adelay->valid) {
+		return;
+	}
+	start = (adelay->posz - tap) & adelay->mask;
+	len = tap - adelay->valid;
+	first = adelay->mask + 1 - start;
+	if (first >= len) {
+		memset(adelay->z + start, 0, len * sizeof(float));
+	} else {
+		memset(adelay->z + start, 0, first * sizeof(float));
+		memset(adelay->z, 0, (len - first) * sizeof(float));
+	}
+	adelay->valid = tap;
+}
 
-	float srate = adelay->srate;
+// Balance pan: the louder side stays at level
+static inline void
+pan_gains(float pan, float level, float* l, float* r)
+{
+	*l = (pan > 0.f) ? level * (1.f - pan) : level;
+	*r = (pan < 0.f) ? level * (1.f + pan) : level;
+}
 
+/* Pick up control changes of the further taps. A new time is reached by
+ * a crossfade over the segment, a tap switched on or off starts or stops
+ * at once. */
+static void
+update_taps(ADelay* adelay)
+{
+	int t;
+
+	for (t = 1; t < ADELAY_MAX_TAPS; t++) {
+		DelayTap* tp = &adelay->taps[t];
+		const float time = *(tp->time);
+
+		tp->changed = 0;
+		if (time != tp->timeold) {
+			int samples = (int)(time * adelay->srate) / 1000;
+			if (samples < 0) {
+				samples = 0;
+			} else if ((uint32_t)samples > adelay->mask) {
+				samples = adelay->mask;
+			}
+			if (time > 0.f && tp->timeold > 0.f) {
+				tp->tap[!tp->active] = samples;
+				tp->changed = 1;
+			} else {
+				tp->tap[tp->active] = samples;
+				memset(tp->state, 0, sizeof(tp->state));
+			}
+			clear_history(adelay, samples);
+			tp->timeold = time;
+		}
+		if (*(tp->lpf) != tp->lpfold) {
+			lpf_coeffs(*(tp->lpf), adelay->srate, tp->coeff);
+			tp->lpfold = *(tp->lpf);
+		}
+	}
+}
+
+/* Sum the filtered main tap in buf and all further taps into mix[],
+ * xf0 and xstep being the position in the crossfade of changed taps */
+static void
+run_taps(ADelay* adelay, const float* buf, uint32_t n, float xf0, float xstep)
+{
+	float* const l = adelay->mix[0];
+	float* const r = adelay->mix[1];
+	float* const x0 = adelay->x[0];
+	float* const x1 = adelay->x[1];
+	float gl, gr;
+	uint32_t i;
+	int t;
+
+	pan_gains(*(adelay->pan), 1.f, &gl, &gr);
+	for (i = 0; i < n; i++) {
+		l[i] = gl * buf[i];
+		r[i] = gr * buf[i];
+	}
+
+	for (t = 1; t < ADELAY_MAX_TAPS; t++) {
+		DelayTap* tp = &adelay->taps[t];
+
+		if (tp->timeold <= 0.f) {
+			continue;
+		}
+		delay_read(adelay, tp->tap[tp->active], x0, n);
+		if (tp->changed) {
+			delay_read(adelay, tp->tap[!tp->active], x1, n);
+			for (i = 0; i < n; i++) {
+				const float xf = xf0 + (float)(i + 1) * xstep;
+				x0[i] += xf * (x1[i] - x0[i]);
+			}
+		}
+		biquad_block(tp->coeff, tp->state, x0, n);
+
+		pan_gains(*(tp->pan), from_dB(*(tp->level)), &gl, &gr);
+		for (i = 0; i < n; i++) {
+			l[i] += gl * x0[i];
+			r[i] += gr * x0[i];
+		}
+	}
+}
+
+/* Nothing but silence left to read: the input of the segment, every
+ * sample as far back as the taps reach and the filter states are below
+ * ATAIL_SILENCE */
+static int
+delay_silent(const ADelay* adelay, const float* input, uint32_t n, InterpMode mode, int recalc)
+{
+	uint32_t reach = adelay->tap[adelay->active];
+	int t;
+
+	if (recalc && adelay->tap[adelay->next] > reach) {
+		reach = adelay->tap[adelay->next];
+	}
+	if (mode != INTERP_NONE) {
+		const float d = (adelay->delay > adelay->delaytarget) ? adelay->delay : adelay->delaytarget;
+		if ((uint32_t)d + 2 > reach) {
+			reach = (uint32_t)d + 2;
+		}
+	}
+	if (adelay->dsp->peak(adelay->state, 4) >= ATAIL_SILENCE
+	    || fabsf(adelay->apstate) >= ATAIL_SILENCE) {
+		return 0;
+	}
+	if (adelay->multitap) {
+		for (t = 1; t < ADELAY_MAX_TAPS; t++) {
+			const DelayTap* tp = &adelay->taps[t];
+			if (tp->timeold <= 0.f) {
+				continue;
+			}
+			if (tp->tap[tp->active] > reach) {
+				reach = tp->tap[tp->active];
+			}
+			if (tp->changed && tp->tap[!tp->active] > reach) {
+				reach = tp->tap[!tp->active];
+			}
+			if (adelay->dsp->peak(tp->state, 4) >= ATAIL_SILENCE) {
+				return 0;
+			}
+		}
+	}
+	return adelay->quiet >= reach && adelay->dsp->peak(input, n) < ATAIL_SILENCE;
+}
+
+/* Skip a silent segment: zeros are written to the line, the filters
+ * restart from zero and the delay time glides on as if processed */
+static void
+delay_bypass(ADelay* adelay, uint32_t n, InterpMode mode)
+{
+	const uint32_t w = adelay->posz;
+	const uint32_t len = adelay->mask + 1 - w;
 	uint32_t i;
-	float in;
-	int delaysamples;
+	int t;
+
+	if (len >= n) {
+		memset(adelay->z + w, 0, n * sizeof(float));
+	} else {
+		memset(adelay->z + w, 0, len * sizeof(float));
+		memset(adelay->z, 0, (n - len) * sizeof(float));
+	}
+	delay_quiet(adelay, 0.f, n);
+
+	clearfilter(adelay);
+	adelay->apstate = 0.f;
+	for (t = 1; t < ADELAY_MAX_TAPS; t++) {
+		memset(adelay->taps[t].state, 0, sizeof(adelay->taps[t].state));
+	}
+
+	if (mode != INTERP_NONE) {
+		const float target = adelay->delaytarget;
+		const float smooth = adelay->smooth;
+		float d = adelay->delay;
+		for (i = 0; i < n; i++) {
+			d += smooth * (target - d);
+		}
+		adelay->delay = d;
+	}
+	adelay->posz = (adelay->posz + n) & adelay->mask;
+}
+
+// Process n_samples frames starting at offset with the current tempo
+static void
+run_segment(ADelay* adelay, uint32_t offset, uint32_t n_samples)
+{
+	const float* const input = adelay->input + offset;
+	float* const output = adelay->output + offset;
+
+	float srate = adelay->srate;
+
+	const uint32_t mask = adelay->mask;
+	uint32_t i, chunk;
+	uint32_t pos = 0;
+	int delaysamples = adelay->delaysamplesold;
 	unsigned int tmp;
 	float inv;
+	float gain, dry, wet, fb;
 	float xfade;
+	InterpMode mode;
 	int recalc;
 	if (*(adelay->inv) < 0.5) {
 		inv = -1.f;
@@ -373,7 +885,11 @@ run(LV2_Handle instance, uint32_t n_samples)
 	if (*(adelay->gain) != adelay->gainold) {
 		recalc = 1;
 	}
-	
+	if (adelay->bpmchanged && *(adelay->sync) > 0.5f) {
+		recalc = 1;
+	}
+	adelay->bpmchanged = 0;
+
 	if (recalc) {
 		if (*(adelay->sync) > 0.5f && adelay->bpmvalid) {
 			*(adelay->delaytime) = adelay->beatunit * 1000.f * 60.f / (adelay->bpm * *(adelay->divisor));
@@ -381,30 +897,139 @@ run(LV2_Handle instance, uint32_t n_samples)
 			*(adelay->delaytime) = *(adelay->time);
 		}
 		delaysamples = (int)(*(adelay->delaytime) * srate) / 1000;
+		// Tempo synced times can exceed the buffer
+		if (delaysamples < 0) {
+			delaysamples = 0;
+		} else if ((uint32_t)delaysamples > mask) {
+			delaysamples = mask;
+		}
 		adelay->tap[adelay->next] = delaysamples;
+		clear_history(adelay, adelay->tap[adelay->next]);
+
+		/* Interpolated taps need one sample either side of the read
+		 * position, and never read ahead of the block just written */
+		adelay->delaytarget = *(adelay->delaytime) * srate / 1000.f;
+		if (adelay->delaytarget < 1.f) {
+			adelay->delaytarget = 1.f;
+		} else if (adelay->delaytarget > (float)(mask - 2)) {
+			adelay->delaytarget = (float)(mask - 2);
+		}
+	}
+	clear_history(adelay, adelay->tap[adelay->active]);
+
+	mode = (InterpMode)*(adelay->interp);
+	if (mode > INTERP_ALLPASS) {
+		mode = INTERP_ALLPASS;
+	}
+	if (mode == INTERP_NONE || adelay->delay == 0.f) {
+		// Glide from wherever the integer taps are
+		adelay->delay = (float)adelay->tap[recalc ? adelay->next : adelay->active];
+		if (adelay->delay < 1.f) {
+			adelay->delay = 1.f;
+		}
+	}
+	if (mode != INTERP_NONE) {
+		const float d = (adelay->delay > adelay->delaytarget) ? adelay->delay : adelay->delaytarget;
+		clear_history(adelay, (uint32_t)d + 2);
+	}
+
+	gain = from_dB(*(adelay->gain));
+	dry = (100.f - *(adelay->wetdry)) / 100.f;
+	wet = *(adelay->wetdry) / 100.f * -inv;
+
+	fb = *(adelay->feedback) / 100.f;
+	if (fb < 0.f) {
+		fb = 0.f;
+	} else if (fb > ADELAY_MAX_FEEDBACK) {
+		fb = ADELAY_MAX_FEEDBACK;
+	}
+
+	/* Feedback is added to the line after the main tap has been read, so
+	 * a pass must not be longer than the shortest delay it reads */
+	chunk = ADELAY_BLOCK;
+	if (fb > 0.f) {
+		uint32_t shortest;
+		if (mode != INTERP_NONE) {
+			const float d = (adelay->delay < adelay->delaytarget) ? adelay->delay : adelay->delaytarget;
+			shortest = (d > 3.f) ? (uint32_t)d - 2 : 1;
+		} else {
+			shortest = adelay->tap[adelay->active];
+			if (recalc && adelay->tap[adelay->next] < shortest) {
+				shortest = adelay->tap[adelay->next];
+			}
+		}
+		if (shortest < 1) {
+			shortest = 1;
+		}
+		if (shortest < chunk) {
+			chunk = shortest;
+		}
 	}
 
+	if (adelay->multitap) {
+		update_taps(adelay);
+	}
+
+	if (adelay->tail_bypass && delay_silent(adelay, input, n_samples, mode, recalc)) {
+		delay_bypass(adelay, n_samples, mode);
+		adelay->bypassed = 1;
+		memset(output, 0, n_samples * sizeof(float));
+		if (adelay->multitap) {
+			memset(adelay->output2 + offset, 0, n_samples * sizeof(float));
+		}
+		pos = n_samples;
+	}
+
+	/* The block is written and the main tap read back as contiguous
+	 * runs, filtered and mixed in separate passes */
 	xfade = 0.f;
-	for (i = 0; i < n_samples; i++) {
-		in = input[i];
-		adelay->z[adelay->posz] = in; // + feedb / 100. * fbstate;
-		adelay->fbstate = 0.f;
-		int p = adelay->posz - adelay->tap[adelay->active]; // active line
-		if (p<0) p += MAX_DELAY;
-		adelay->fbstate += adelay->z[p];
-		
-		if (recalc) {
-			xfade += 1.0f / (float)n_samples;
-			adelay->fbstate *= (1.-xfade);
-			int p = adelay->posz - adelay->tap[adelay->next]; // next line
-			if (p<0) p += MAX_DELAY;
-			adelay->fbstate += adelay->z[p] * xfade;
+	while (pos < n_samples) {
+		const uint32_t n = (n_samples - pos < chunk) ? n_samples - pos : chunk;
+		const float* const in = input + pos;
+		float* const out = output + pos;
+		float* const buf = adelay->buf;
+
+		delay_write(adelay, in, n);
+		if (mode != INTERP_NONE) {
+			delay_read_interp(adelay, mode, buf, n);
+		} else if (recalc) {
+			// Crossfade from the active to the next tap over the segment
+			float* const xn = adelay->x[0];
+			delay_read(adelay, adelay->tap[adelay->active], buf, n);
+			delay_read(adelay, adelay->tap[adelay->next], xn, n);
+			for (i = 0; i < n; i++) {
+				xfade += 1.0f / (float)n_samples;
+				buf[i] = buf[i] * (1.-xfade) + xn[i] * xfade;
+			}
+		} else {
+			delay_read(adelay, adelay->tap[adelay->active], buf, n);
 		}
-		output[i] = from_dB(*(adelay->gain)) * ((100.-*(adelay->wetdry)) / 100. * in + *(adelay->wetdry) / 100. * -inv * runfilter(adelay, adelay->fbstate));
-		if (++(adelay->posz) >= MAX_DELAY) {
-			adelay->posz = 0;
+		runfilter_block(adelay, buf, n);
+		if (fb > 0.f) {
+			delay_feedback(adelay, buf, fb, n);
 		}
+		delay_quiet(adelay, delay_peak(adelay, n), n);
+
+		if (adelay->multitap) {
+			float* const out2 = adelay->output2 + offset + pos;
+			const float* const l = adelay->mix[0];
+			const float* const r = adelay->mix[1];
+
+			run_taps(adelay, buf, n, (float)pos / (float)n_samples, 1.f / (float)n_samples);
+			for (i = 0; i < n; i++) {
+				out[i] = gain * (dry * in[i] + wet * l[i]);
+				out2[i] = gain * (dry * in[i] + wet * r[i]);
+			}
+		} else {
+			for (i = 0; i < n; i++) {
+				out[i] = gain * (dry * in[i] + wet * buf[i]);
+			}
+		}
+
+		adelay->posz = (adelay->posz + n) & mask;
+		pos += n;
 	}
+	adelay->valid = (adelay->valid + n_samples > mask) ? mask + 1 : adelay->valid + n_samples;
 	adelay->lpfold = *(adelay->lpf);
 	adelay->divisorold = *(adelay->divisor);
 	adelay->gainold = *(adelay->gain);
@@ -419,30 +1044,80 @@ run(LV2_Handle instance, uint32_t n_samples)
 		adelay->active = adelay->next;
 		adelay->next = tmp;
 	}
-	
-	if (adelay->atombpm) {
-		LV2_Atom_Event* ev = lv2_atom_sequence_begin(&(adelay->atombpm)->body);
-		while(!lv2_atom_sequence_is_end(&(adelay->atombpm)->body, (adelay->atombpm)->atom.size, ev)) {
+	if (adelay->multitap) {
+		int t;
+		for (t = 1; t < ADELAY_MAX_TAPS; t++) {
+			if (adelay->taps[t].changed) {
+				adelay->taps[t].active = !adelay->taps[t].active;
+			}
+		}
+	}
+}
+
+static void
+run(LV2_Handle instance, uint32_t n_samples)
+{
+	ADelay* adelay = (ADelay*)instance;
+	const afpu_state fpu = afpu_flush_denormals();
+	const LV2_Atom_Sequence* const seq = adelay->atombpm;
+	uint32_t offset = 0;
+
+	adelay->bypassed = 0;
+
+	/* Tempo changes apply from their frame on: audio is processed in
+	 * segments between event timestamps */
+	if (seq && seq->atom.size > sizeof(LV2_Atom_Sequence_Body)) {
+		LV2_ATOM_SEQUENCE_FOREACH(seq, ev) {
 			if (ev->body.type == adelay->uris.atom_Blank || ev->body.type == adelay->uris.atom_Object) {
 				const LV2_Atom_Object* obj = (LV2_Atom_Object*)&ev->body;
 				if (obj->body.otype == adelay->uris.time_Position) {
+					uint32_t frame = (ev->time.frames < 0) ? 0 : (uint32_t)ev->time.frames;
+					if (frame > n_samples) {
+						frame = n_samples;
+					}
+					if (frame > offset) {
+						run_segment(adelay, offset, frame - offset);
+						offset = frame;
+					}
 					update_bpm(adelay, obj);
 				}
 			}
-			ev = lv2_atom_sequence_next(ev);
 		}
 	}
+
+	if (offset < n_samples) {
+		run_segment(adelay, offset, n_samples - offset);
+	}
+
+	afpu_restore(fpu);
 }
 
 static void
 cleanup(LV2_Handle instance)
 {
-	free(instance);
+	aarena_free(instance);
+}
+
+static void
+set_bypass(LV2_Handle instance, int enabled)
+{
+	((ADelay*)instance)->tail_bypass = enabled;
+}
+
+static int
+bypassed(LV2_Handle instance)
+{
+	return ((ADelay*)instance)->bypassed;
 }
 
 const void*
 extension_data(const char* uri)
 {
+	static const ATailInterface tail = { set_bypass, bypassed };
+
+	if (!strcmp(uri, ATAIL__interface)) {
+		return &tail;
+	}
 	return NULL;
 }
 
@@ -457,6 +1132,17 @@ static const LV2_Descriptor descriptor = {
 	extension_data
 };
 
+static const LV2_Descriptor descriptor_multitap = {
+	ADELAY_MULTITAP_URI,
+	instantiate,
+	connect_port,
+	activate,
+	run,
+	NULL,
+	cleanup,
+	extension_data
+};
+
 LV2_SYMBOL_EXPORT
 const LV2_Descriptor*
 lv2_descriptor(uint32_t index)
@@ -464,6 +1150,8 @@ lv2_descriptor(uint32_t index)
 	switch (index) {
 	case 0:
 		return &descriptor;
+	case 1:
+		return &descriptor_multitap;
 	default:
 		return NULL;
 	}
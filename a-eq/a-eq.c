@@ -13,13 +13,43 @@
  */
 
 #include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "lv2/lv2plug.in/ns/lv2core/lv2.h"
+#include "lv2/lv2plug.in/ns/ext/atom/atom.h"
+#include "lv2/lv2plug.in/ns/ext/atom/forge.h"
+#include "lv2/lv2plug.in/ns/ext/urid/urid.h"
+
+#include "arena.h"
+#include "denormal.h"
+#include "dsp.h"
+#include "meter.h"
+#include "response.h"
+#include "svf.h"
+#include "tail.h"
 
 #define AEQ_URI	"urn:ardour:a-eq"
+#define AEQ_STEREO_URI	"urn:ardour:a-eq#stereo"
+#define AEQ_8CH_URI	"urn:ardour:a-eq#8ch"
 #define BANDS	6
 
+// Multichannel engine: samples per sub-block and channels per instance
+#define AEQ_BLOCK	64
+#define AEQ_MAX_CHANNELS	8
+#define AEQ_MAX_LANES	8
+
+// Time constant of coefficient smoothing in ms
+#define AEQ_SMOOTH_MS	20.f
+
+/* Response curve on the notify port: log spaced points, at most
+ * AEQ_CURVE_RATE updates per second and repeated every second */
+#define AEQ_CURVE_POINTS	128
+#define AEQ_CURVE_LO	20.f
+#define AEQ_CURVE_HI	20000.f
+#define AEQ_CURVE_RATE	30
+
 typedef enum {
 	AEQ_SHELFTOGL = 0,
 	AEQ_FREQL,
@@ -48,19 +78,18 @@ typedef enum {
 	AEQ_FILTOGH,
 	AEQ_INPUT,
 	AEQ_OUTPUT,
+	// multichannel only, channel c > 0 uses AEQ_INPUT + 2 * c
 } PortIndex;
 
-struct linear_svf {
-	double g, k;
-	double a[3];
-	double m[3];
-	double s[2];
-};
+// The notify port follows the audio ports of each variant
+#define AEQ_NOTIFY(n_channels) (AEQ_INPUT + 2 * (n_channels))
 
-static void linear_svf_reset(struct linear_svf *self)
-{
-	self->s[0] = self->s[1] = 0.0;
-}
+// What the response depends on, published by run() for response()
+typedef struct {
+	struct linear_svf band[BANDS];
+	int enabled[BANDS];
+	double master;
+} AeqSettings;
 
 typedef struct {
 	float* shelftogl;
@@ -70,26 +99,131 @@ typedef struct {
 	float* bw[BANDS];
 	float* filtog[BANDS];
 	float* master;
+	LV2_Atom_Sequence* notify;
+
+	// Block statistics for the notify port and the meter ring
+	LV2_URID_Map* map;
+	LV2_Atom_Forge forge;
+	AMeterURIs uris;
+	AMeterRing meter;
+	uint64_t frame;
+
+	/* Settings behind the response, guarded by a sequence count that is
+	 * odd while run() writes them and counts two per change */
+	AeqSettings settings;
+	uint32_t sequence;
+	AResponseURIs response_uris;
+	float curve_t[AEQ_CURVE_POINTS];
+	float curve_freq[AEQ_CURVE_POINTS];
+	float curve_mag[AEQ_CURVE_POINTS];
+	float curve_phase[AEQ_CURVE_POINTS];
+	int curve_dirty;
+	uint32_t curve_age;
 
+	const struct adsp* dsp;
+	uint32_t n_channels;
 	float srate;
+	int tail_bypass;
+	int bypassed;
 
-	float* input;
-	float* output;
+	float* input[AEQ_MAX_CHANNELS];
+	float* output[AEQ_MAX_CHANNELS];
 	struct linear_svf filter[BANDS];
+	int active[BANDS];
+
+	/* Coefficients the filters are smoothed towards, recomputed only
+	 * when the controls they are derived from change */
+	struct linear_svf target[BANDS];
+	float last_f0[BANDS];
+	float last_g[BANDS];
+	float last_bw[BANDS];
+	int last_shelf[BANDS];
+	int smoothing[BANDS];
+	int snap;
+	double smooth_coeff;
+
+	// Master gain, folded into the last stage of the cascade
+	float last_master;
+	double master_target;
+	double master_gain;
+
+	/* Processing order for the current sub-block: active bands grouped
+	 * by type, generic first. The bands are linear and time invariant,
+	 * so the grouping does not change the response. */
+	uint32_t order[BANDS];
+	uint32_t n_type[SVF_TYPES];
+	uint32_t n_active;
+
+	/* Float state of the multichannel engine, one lane per channel,
+	 * kept as structure-of-arrays so a band steps all lanes at once */
+	float s0[BANDS][AEQ_MAX_CHANNELS];
+	float s1[BANDS][AEQ_MAX_CHANNELS];
+	float x[AEQ_BLOCK * AEQ_MAX_LANES];
 } Aeq;
 
+static void
+aeq_reset_band(Aeq* aeq, int band)
+{
+	linear_svf_reset(&aeq->filter[band]);
+	memset(aeq->s0[band], 0, sizeof(aeq->s0[band]));
+	memset(aeq->s1[band], 0, sizeof(aeq->s1[band]));
+}
+
 static LV2_Handle
 instantiate(const LV2_Descriptor* descriptor,
             double rate,
             const char* bundle_path,
             const LV2_Feature* const* features)
 {
+	LV2_URID_Map* map = NULL;
+	AArena arena = { NULL, 0, 0 };
+	Aeq* aeq;
 	int i;
-	Aeq* aeq = (Aeq*)malloc(sizeof(Aeq));
+
+	for (i = 0; features[i]; ++i) {
+		if (!strcmp(features[i]->URI, LV2_URID__map)) {
+			map = (LV2_URID_Map*)features[i]->data;
+		}
+	}
+	if (!map) {
+		fprintf(stderr, "a-eq.lv2 error: Host does not support urid:map\n");
+		return NULL;
+	}
+
+	aarena_take(&arena, sizeof(Aeq));
+	if (aarena_alloc(&arena)) {
+		return NULL;
+	}
+	aeq = (Aeq*)aarena_take(&arena, sizeof(Aeq));
+	aeq->map = map;
+	ameter_map_uris(aeq->map, &aeq->uris);
+	aresponse_map_uris(aeq->map, &aeq->response_uris);
+	lv2_atom_forge_init(&aeq->forge, aeq->map);
+
+	aeq->dsp = adsp_get();
+	aeq->tail_bypass = 1;
+
+	if (!strcmp(descriptor->URI, AEQ_8CH_URI)) {
+		aeq->n_channels = 8;
+	} else if (!strcmp(descriptor->URI, AEQ_STEREO_URI)) {
+		aeq->n_channels = 2;
+	} else {
+		aeq->n_channels = 1;
+	}
 	aeq->srate = rate;
-	
-	for (i = 0; i < BANDS; i++)
-		linear_svf_reset(&aeq->filter[i]);
+	// One smoothing step per sub-block
+	aeq->smooth_coeff = 1.0 - exp(-1000.0 * AEQ_BLOCK / (AEQ_SMOOTH_MS * rate));
+
+	// Curve grid, cut off below Nyquist
+	for (i = 0; i < AEQ_CURVE_POINTS; i++) {
+		double f = AEQ_CURVE_LO * pow(AEQ_CURVE_HI / AEQ_CURVE_LO, i / (AEQ_CURVE_POINTS - 1.0));
+		if (f > 0.49 * rate) {
+			f = 0.49 * rate;
+		}
+		aeq->curve_freq[i] = f;
+		aeq->curve_t[i] = tan(M_PI * f / rate);
+	}
+	aeq->settings.master = 1.0;
 
 	return (LV2_Handle)aeq;
 }
@@ -178,10 +312,22 @@ connect_port(LV2_Handle instance,
 		aeq->filtog[5] = (float*)data;
 		break;
 	case AEQ_INPUT:
-		aeq->input = (float*)data;
+		aeq->input[0] = (float*)data;
 		break;
 	case AEQ_OUTPUT:
-		aeq->output = (float*)data;
+		aeq->output[0] = (float*)data;
+		break;
+	default:
+		if (port == AEQ_NOTIFY(aeq->n_channels)) {
+			aeq->notify = (LV2_Atom_Sequence*)data;
+		} else if (port > AEQ_OUTPUT && port < AEQ_NOTIFY(aeq->n_channels)) {
+			uint32_t c = (port - AEQ_INPUT) / 2;
+			if ((port - AEQ_INPUT) & 1) {
+				aeq->output[c] = (float*)data;
+			} else {
+				aeq->input[c] = (float*)data;
+			}
+		}
 		break;
 	}
 }
@@ -192,165 +338,648 @@ activate(LV2_Handle instance)
 	int i;
 	Aeq* aeq = (Aeq*)instance;
 
-	for (i = 0; i < BANDS; i++)
-		linear_svf_reset(&aeq->filter[i]);
+	for (i = 0; i < BANDS; i++) {
+		aeq_reset_band(aeq, i);
+		aeq->active[i] = 0;
+		aeq->smoothing[i] = 0;
+		// NaN never compares equal, so every target is computed once
+		aeq->last_f0[i] = NAN;
+	}
+	aeq->last_master = NAN;
+	aeq->snap = 1;
+	aeq->frame = 0;
+	// The first curve goes out with the first run()
+	aeq->curve_age = aeq->srate;
 }
 
-// SVF filters
-// http://www.cytomic.com/files/dsp/SvfLinearTrapOptimised2.pdf
+static inline int
+smooth_param(double* value, double target, double coeff)
+{
+	const double d = target - *value;
+	if (fabs(d) <= 1e-7 * (1.0 + fabs(target))) {
+		*value = target;
+		return 0;
+	}
+	*value += coeff * d;
+	return 1;
+}
 
-static void linear_svf_set_hp(struct linear_svf *self, float sample_rate, float cutoff, float resonance)
+/*
+ * One-pole step of g, k and m towards the target, a[] follows from g and k.
+ * Returns 0 once every parameter has snapped to its target.
+ */
+static int
+linear_svf_smooth(struct linear_svf *self, const struct linear_svf *target, double coeff)
+{
+	int moving = 0;
+
+	moving |= smooth_param(&self->g, target->g, coeff);
+	moving |= smooth_param(&self->k, target->k, coeff);
+	moving |= smooth_param(&self->m[0], target->m[0], coeff);
+	moving |= smooth_param(&self->m[1], target->m[1], coeff);
+	moving |= smooth_param(&self->m[2], target->m[2], coeff);
+
+	if (!moving) {
+		linear_svf_set_coeffs(self, target);
+		return 0;
+	}
+
+	linear_svf_set_gk(self, self->g, self->k);
+	return 1;
+}
+
+// Non-zero if a target or the master gain changed
+static int
+update_targets(Aeq* aeq)
 {
-	double f0 = (double)cutoff;
-	double q = (double)resonance;
-	double sr = (double)sample_rate;
+	float srate = aeq->srate;
+	uint32_t j;
+	int changed = 0;
+
+	for (j = 0; j < BANDS; j++) {
+		const float f0 = *(aeq->f0[j]);
+		const float g = *(aeq->g[j]);
+		const float bw = aeq->bw[j] ? *(aeq->bw[j]) : 0.f;
+		int shelf = 0;
+
+		if (j == 0) {
+			shelf = *(aeq->shelftogl) > 0.5f;
+		} else if (j == BANDS - 1) {
+			shelf = *(aeq->shelftogh) > 0.5f;
+		}
 
-	self->g = tan(M_PI * (f0 / sr));
-	self->k = 1.0 / q;
+		if (f0 == aeq->last_f0[j] && g == aeq->last_g[j] && bw == aeq->last_bw[j]
+		    && shelf == aeq->last_shelf[j]) {
+			continue;
+		}
+		aeq->last_f0[j] = f0;
+		aeq->last_g[j] = g;
+		aeq->last_bw[j] = bw;
+		aeq->last_shelf[j] = shelf;
 
-	self->a[0] = 1.0 / (1.0 + self->g * (self->g + self->k));
-	self->a[1] = self->g * self->a[0];
-	self->a[2] = self->g * self->a[1];
+		// Outer bands are a shelf or a high/low pass, the rest peaking
+		if (j == 0) {
+			if (shelf) {
+				linear_svf_set_lowshelf(&aeq->target[j], g, srate, f0, 0.7071068);
+			} else {
+				linear_svf_set_hp(&aeq->target[j], srate, f0, 0.7071068);
+			}
+		} else if (j == BANDS - 1) {
+			if (shelf) {
+				linear_svf_set_highshelf(&aeq->target[j], g, srate, f0, 0.7071068);
+			} else {
+				linear_svf_set_lp(&aeq->target[j], srate, f0, 0.7071068);
+			}
+		} else {
+			linear_svf_set_peq(&aeq->target[j], g, srate, f0, bw);
+		}
+		aeq->smoothing[j] = 1;
+		changed = 1;
+	}
 
-	self->m[0] = 1.0;
-	self->m[1] = -self->k;
-	self->m[2] = -1.0;
+	if (*(aeq->master) != aeq->last_master) {
+		aeq->last_master = *(aeq->master);
+		aeq->master_target = pow(10.0, aeq->last_master / 20.0);
+		changed = 1;
+	}
+	return changed;
 }
 
-static void linear_svf_set_lp(struct linear_svf *self, float sample_rate, float cutoff, float resonance)
+// Writer side of the settings, run() only
+static void
+aeq_publish(Aeq* aeq, const int* enabled)
 {
-	double f0 = (double)cutoff;
-	double q = (double)resonance;
-	double sr = (double)sample_rate;
+	const uint32_t sequence = aeq->sequence;
+	uint32_t j;
 
-	self->g = tan(M_PI * (f0 / sr));
-	self->k = 1.0 / q;
+	__atomic_store_n(&aeq->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (j = 0; j < BANDS; j++) {
+		linear_svf_set_coeffs(&aeq->settings.band[j], &aeq->target[j]);
+		aeq->settings.enabled[j] = enabled[j];
+	}
+	aeq->settings.master = aeq->master_target;
+	__atomic_store_n(&aeq->sequence, sequence + 2, __ATOMIC_RELEASE);
+	aeq->curve_dirty = 1;
+}
 
-	self->a[0] = 1.0 / (1.0 + self->g * (self->g + self->k));
-	self->a[1] = self->g * self->a[0];
-	self->a[2] = self->g * self->a[1];
+// Reader side: a consistent copy, returns its generation
+static uint32_t
+aeq_settings(Aeq* aeq, AeqSettings* settings)
+{
+	uint32_t sequence;
 
-	self->m[0] = 0.0;
-	self->m[1] = 0.0;
-	self->m[2] = 1.0;
+	do {
+		sequence = __atomic_load_n(&aeq->sequence, __ATOMIC_ACQUIRE);
+		*settings = aeq->settings;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((sequence & 1) || sequence != __atomic_load_n(&aeq->sequence, __ATOMIC_RELAXED));
+	return sequence / 2;
 }
 
-static void linear_svf_set_peq(struct linear_svf *self, float gdb, float sample_rate, float cutoff, float bandwidth)
+/*
+ * Response of the enabled bands and the master gain at n points given as
+ * t = tan(pi f / rate), in batches that vectorize: the complex product
+ * over the bands first, then levels and phases of the whole batch.
+ */
+static void
+aeq_response(const AeqSettings* settings, const struct adsp* dsp, const float* t,
+             float* magnitude, float* phase, uint32_t n)
 {
-	double f0 = (double)cutoff;
-	double q = (double)pow(2.0, 1.0 / bandwidth) / (pow(2.0, bandwidth) - 1.0);
-	double sr = (double)sample_rate;
-	double A = pow(10.0, gdb/40.0);
+	const float master = to_dB(settings->master);
+	float re[AEQ_BLOCK], im[AEQ_BLOCK];
+	uint32_t offset, i, j;
 
-	self->g = tan(M_PI * (f0 / sr));
-	self->k = 1.0 / (q * A);
+	for (offset = 0; offset < n; offset += AEQ_BLOCK) {
+		const uint32_t k = (n - offset < AEQ_BLOCK) ? n - offset : AEQ_BLOCK;
 
-	self->a[0] = 1.0 / (1.0 + self->g * (self->g + self->k));
-	self->a[1] = self->g * self->a[0];
-	self->a[2] = self->g * self->a[1];
+		for (i = 0; i < k; i++) {
+			re[i] = 1.f;
+			im[i] = 0.f;
+		}
+		for (j = 0; j < BANDS; j++) {
+			if (settings->enabled[j]) {
+				linear_svf_response(&settings->band[j], t + offset, re, im, k);
+			}
+		}
+		if (phase) {
+			for (i = 0; i < k; i++) {
+				phase[offset + i] = atan2f(im[i], re[i]);
+			}
+		}
+		for (i = 0; i < k; i++) {
+			re[i] = re[i] * re[i] + im[i] * im[i];
+		}
+		// 10 log10(|H|^2)
+		dsp->level_dB(magnitude + offset, re, 3.01029996f, master, ARESPONSE_FLOOR, k);
+	}
+}
 
-	self->m[0] = 1.0;
-	self->m[1] = self->k * (A * A - 1.0);
-	self->m[2] = 0.0;
+/* Kernel of a band: the master gain may be folded into its m[], so only
+ * generic, peaking and lowpass mixes are used */
+static enum svf_type
+aeq_band_type(const struct linear_svf *self)
+{
+	switch (linear_svf_type(self)) {
+	case SVF_LP:
+		return SVF_LP;
+	case SVF_PEQ:
+	case SVF_NOTCH:
+		return SVF_PEQ;
+	default:
+		return SVF_GENERIC;
+	}
 }
 
-static void linear_svf_set_highshelf(struct linear_svf *self, float gdb, float sample_rate, float cutoff, float resonance)
+// Group the active bands by kernel type for this sub-block
+static void
+plan_bands(Aeq* aeq)
 {
-	double f0 = (double)cutoff;
-	double q = (double)resonance;
-	double sr = (double)sample_rate;
-	double A = pow(10.0, gdb/40.0);
+	uint32_t j, t, n = 0;
 
-	self->g = tan(M_PI * (f0 / sr));
-	self->k = 1.0 / q;
+	for (t = 0; t < SVF_TYPES; t++) {
+		aeq->n_type[t] = 0;
+		for (j = 0; j < BANDS; j++) {
+			if (aeq->active[j] && aeq_band_type(&aeq->filter[j]) == t) {
+				aeq->order[n++] = j;
+				aeq->n_type[t]++;
+			}
+		}
+	}
+	aeq->n_active = n;
+}
 
-	self->a[0] = 1.0 / (1.0 + self->g * (self->g + self->k));
-	self->a[1] = self->g * self->a[0];
-	self->a[2] = self->g * self->a[1];
+/* Coefficients of the k-th band in processing order, with the master
+ * gain folded into m[] of the last one */
+static void
+plan_coeffs(const Aeq* aeq, uint32_t k, double m[3])
+{
+	const struct linear_svf* const f = &aeq->filter[aeq->order[k]];
+	const double gain = (k == aeq->n_active - 1) ? aeq->master_gain : 1.0;
 
-	self->m[0] = A * A;
-	self->m[1] = self->k * (1.0 - A) * A;
-	self->m[2] = 1.0 - A * A;
+	m[0] = f->m[0] * gain;
+	m[1] = f->m[1] * gain;
+	m[2] = f->m[2] * gain;
 }
 
-static void linear_svf_set_lowshelf(struct linear_svf *self, float gdb, float sample_rate, float cutoff, float resonance)
+static void
+run_mono(Aeq* aeq, uint32_t offset, uint32_t n)
 {
-	double f0 = (double)cutoff;
-	double q = (double)resonance;
-	double sr = (double)sample_rate;
-	double A = pow(10.0, gdb/40.0);
+	const float* const input = aeq->input[0] + offset;
+	float* const output = aeq->output[0] + offset;
+	const uint32_t n_generic = aeq->n_type[SVF_GENERIC];
+	const uint32_t n_peq = n_generic + aeq->n_type[SVF_PEQ];
+	const uint32_t n_bands = aeq->n_active;
+	struct linear_svf f[BANDS];
+	uint32_t i, j;
+	float out;
 
-	self->g = tan(M_PI * (f0 / sr));
-	self->k = 1.0 / q;
+	if (n_bands == 0) {
+		const float gain = aeq->master_gain;
+		if (gain == 1.f) {
+			if (input != output) {
+				memcpy(output, input, n * sizeof(float));
+			}
+		} else {
+			aeq->dsp->scale(output, input, gain, n);
+		}
+		return;
+	}
 
-	self->a[0] = 1.0 / (1.0 + self->g * (self->g + self->k));
-	self->a[1] = self->g * self->a[0];
-	self->a[2] = self->g * self->a[1];
+	// Active bands are copied to the stack so their state stays in registers
+	for (j = 0; j < n_bands; j++) {
+		f[j] = aeq->filter[aeq->order[j]];
+		plan_coeffs(aeq, j, f[j].m);
+	}
 
-	self->m[0] = 1.0;
-	self->m[1] = self->k * (A - 1.0);
-	self->m[2] = A * A - 1.0;
+	for (i = 0; i < n; i++) {
+		out = input[i];
+		for (j = 0; j < n_generic; j++) {
+			out = run_linear_svf(&f[j], out, SVF_GENERIC);
+		}
+		for (; j < n_peq; j++) {
+			out = run_linear_svf(&f[j], out, SVF_PEQ);
+		}
+		for (; j < n_bands; j++) {
+			out = run_linear_svf(&f[j], out, SVF_LP);
+		}
+		output[i] = out;
+	}
+
+	for (j = 0; j < n_bands; j++) {
+		aeq->filter[aeq->order[j]].s[0] = f[j].s[0];
+		aeq->filter[aeq->order[j]].s[1] = f[j].s[1];
+	}
 }
 
-static float run_linear_svf(struct linear_svf *self, float in)
+/*
+ * The active bands over n interleaved frames of x, all lanes in parallel.
+ * Coefficients are shared by every lane, only the state is per lane.
+ * Bands run sample by sample so consecutive bands overlap in the pipeline,
+ * each group of bands with the output mix of its type.
+ */
+static inline __attribute__((always_inline)) void
+run_svf_lanes(Aeq* aeq, uint32_t c0, float* x, uint32_t n, const uint32_t lanes)
 {
-	double v[3];
-	double din = (double)in;
-	double out;
+	const uint32_t n_generic = aeq->n_type[SVF_GENERIC];
+	const uint32_t n_peq = n_generic + aeq->n_type[SVF_PEQ];
+	const uint32_t n_bands = aeq->n_active;
+	float a0[BANDS], a1[BANDS], a2[BANDS];
+	float m0[BANDS], m1[BANDS], m2[BANDS];
+	float z0[BANDS][AEQ_MAX_LANES], z1[BANDS][AEQ_MAX_LANES];
+	uint32_t i, j, l;
 
-	v[2] = din - self->s[1];
-	v[0] = (self->a[0] * self->s[0]) + (self->a[1] * v[2]);
-	v[1] = self->s[1] + (self->a[1] * self->s[0]) + (self->a[2] * v[2]);
+	for (j = 0; j < n_bands; j++) {
+		const uint32_t band = aeq->order[j];
+		const struct linear_svf* const f = &aeq->filter[band];
+		double m[3];
 
-	self->s[0] = (2.0 * v[0]) - self->s[0];
-	self->s[1] = (2.0 * v[1]) - self->s[1];
+		plan_coeffs(aeq, j, m);
+		a0[j] = f->a[0]; a1[j] = f->a[1]; a2[j] = f->a[2];
+		m0[j] = m[0]; m1[j] = m[1]; m2[j] = m[2];
+		for (l = 0; l < lanes; l++) {
+			z0[j][l] = aeq->s0[band][c0 + l];
+			z1[j][l] = aeq->s1[band][c0 + l];
+		}
+	}
 
-	out = (self->m[0] * din)
-		+ (self->m[1] * v[0])
-		+ (self->m[2] * v[1]);
+	for (i = 0; i < n; i++) {
+		float* const v = x + i * lanes;
+		for (j = 0; j < n_generic; j++) {
+			for (l = 0; l < lanes; l++) {
+				const float v2 = v[l] - z1[j][l];
+				const float v0 = a0[j] * z0[j][l] + a1[j] * v2;
+				const float v1 = z1[j][l] + a1[j] * z0[j][l] + a2[j] * v2;
+				z0[j][l] = 2.f * v0 - z0[j][l];
+				z1[j][l] = 2.f * v1 - z1[j][l];
+				v[l] = m0[j] * v[l] + m1[j] * v0 + m2[j] * v1;
+			}
+		}
+		for (; j < n_peq; j++) {
+			for (l = 0; l < lanes; l++) {
+				const float v2 = v[l] - z1[j][l];
+				const float v0 = a0[j] * z0[j][l] + a1[j] * v2;
+				const float v1 = z1[j][l] + a1[j] * z0[j][l] + a2[j] * v2;
+				z0[j][l] = 2.f * v0 - z0[j][l];
+				z1[j][l] = 2.f * v1 - z1[j][l];
+				v[l] = m0[j] * v[l] + m1[j] * v0;
+			}
+		}
+		for (; j < n_bands; j++) {
+			for (l = 0; l < lanes; l++) {
+				const float v2 = v[l] - z1[j][l];
+				const float v0 = a0[j] * z0[j][l] + a1[j] * v2;
+				const float v1 = z1[j][l] + a1[j] * z0[j][l] + a2[j] * v2;
+				z0[j][l] = 2.f * v0 - z0[j][l];
+				z1[j][l] = 2.f * v1 - z1[j][l];
+				v[l] = m2[j] * v1;
+			}
+		}
+	}
 
-	return (float)out;
+	for (j = 0; j < n_bands; j++) {
+		const uint32_t band = aeq->order[j];
+		for (l = 0; l < lanes; l++) {
+			aeq->s0[band][c0 + l] = z0[j][l];
+			aeq->s1[band][c0 + l] = z1[j][l];
+		}
+	}
+}
+
+// Channels c0 .. c0 + lanes - 1, unused lanes carry silence
+static inline __attribute__((always_inline)) void
+run_group(Aeq* aeq, uint32_t c0, uint32_t offset, uint32_t n, const uint32_t lanes)
+{
+	float* const x = aeq->x;
+	const uint32_t n_lanes = (aeq->n_channels - c0 < lanes) ? aeq->n_channels - c0 : lanes;
+	const float gain = aeq->master_gain;
+	uint32_t i, l;
+
+	// Nothing to run but the master gain
+	if (aeq->n_active == 0) {
+		for (l = 0; l < n_lanes; l++) {
+			aeq->dsp->scale(aeq->output[c0 + l] + offset, aeq->input[c0 + l] + offset, gain, n);
+		}
+		return;
+	}
+
+	memset(x, 0, n * lanes * sizeof(float));
+	for (l = 0; l < n_lanes; l++) {
+		const float* const in = aeq->input[c0 + l] + offset;
+		for (i = 0; i < n; i++) {
+			x[i * lanes + l] = in[i];
+		}
+	}
+
+	run_svf_lanes(aeq, c0, x, n, lanes);
+
+	for (l = 0; l < n_lanes; l++) {
+		float* const out = aeq->output[c0 + l] + offset;
+		for (i = 0; i < n; i++) {
+			out[i] = x[i * lanes + l];
+		}
+	}
+}
+
+static void
+run_multi(Aeq* aeq, uint32_t offset, uint32_t n)
+{
+	uint32_t c0;
+
+	if (aeq->n_channels <= 4) {
+		run_group(aeq, 0, offset, n, 4);
+		return;
+	}
+	for (c0 = 0; c0 < aeq->n_channels; c0 += 8) {
+		run_group(aeq, c0, offset, n, 8);
+	}
+}
+
+/* Input and the state of every active band below ATAIL_SILENCE, so
+ * the block would decay into silence */
+static int
+aeq_silent(const Aeq* aeq, uint32_t n_samples)
+{
+	const uint32_t n_channels = aeq->n_channels;
+	uint32_t c, j;
+
+	for (c = 0; c < n_channels; c++) {
+		if (aeq->dsp->peak(aeq->input[c], n_samples) >= ATAIL_SILENCE) {
+			return 0;
+		}
+	}
+	for (j = 0; j < BANDS; j++) {
+		if (!aeq->active[j]) {
+			continue;
+		}
+		if (n_channels == 1) {
+			if (fabs(aeq->filter[j].s[0]) >= ATAIL_SILENCE
+			    || fabs(aeq->filter[j].s[1]) >= ATAIL_SILENCE) {
+				return 0;
+			}
+		} else if (aeq->dsp->peak(aeq->s0[j], n_channels) >= ATAIL_SILENCE
+		           || aeq->dsp->peak(aeq->s1[j], n_channels) >= ATAIL_SILENCE) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* The response curve when due and there is room for it, evaluated
+ * again only after the settings changed */
+static void
+aeq_curve(Aeq* aeq, uint32_t n)
+{
+	const uint32_t interval = aeq->srate / AEQ_CURVE_RATE;
+
+	aeq->curve_age += n;
+	if (aeq->curve_age < interval
+	    || (!aeq->curve_dirty && aeq->curve_age < aeq->srate)
+	    || aeq->forge.size - aeq->forge.offset < aresponse_forge_size(AEQ_CURVE_POINTS)) {
+		return;
+	}
+	if (aeq->curve_dirty) {
+		aeq_response(&aeq->settings, aeq->dsp, aeq->curve_t,
+		             aeq->curve_mag, aeq->curve_phase, AEQ_CURVE_POINTS);
+		aeq->curve_dirty = 0;
+	}
+	aresponse_forge(&aeq->forge, &aeq->response_uris, aeq->curve_freq,
+	                aeq->curve_mag, aeq->curve_phase, AEQ_CURVE_POINTS);
+	aeq->curve_age = 0;
+}
+
+/* Output peak of the n samples just run: into the ring, and as an event
+ * of the notify port when connected, along with the response curve */
+static void
+aeq_meter(Aeq* aeq, uint32_t n, float peak)
+{
+	const float level = (peak > 0.f) ? to_dB(peak) : AMETER_FLOOR;
+	LV2_Atom_Forge_Frame frame;
+	AMeterBlock block;
+
+	block.frame = aeq->frame;
+	block.length = n;
+	block.gr_min = block.gr_max = 0.f;
+	block.peak = (level > AMETER_FLOOR) ? level : AMETER_FLOOR;
+	aeq->frame += n;
+
+	if (n > 0) {
+		ameter_push(&aeq->meter, &block);
+	}
+	if (!aeq->notify) {
+		return;
+	}
+	lv2_atom_forge_set_buffer(&aeq->forge, (uint8_t*)aeq->notify, aeq->notify->atom.size);
+	lv2_atom_forge_sequence_head(&aeq->forge, &frame, 0);
+	if (n > 0) {
+		ameter_forge(&aeq->forge, &aeq->uris, &block);
+	}
+	aeq_curve(aeq, n);
+	lv2_atom_forge_pop(&aeq->forge, &frame);
 }
 
 static void
 run(LV2_Handle instance, uint32_t n_samples)
 {
 	Aeq* aeq = (Aeq*)instance;
+	const afpu_state fpu = afpu_flush_denormals();
 
-	const float* const input = aeq->input;
-	float* const output = aeq->output;
+	uint32_t offset = 0;
+	uint32_t c, j;
+	int smoothing = 0;
+	int enabled[BANDS];
+	int changed;
+	float max = 0.f, p;
 
-	float srate = aeq->srate;
-	float in0, out;
-	uint32_t i, j;
+	aeq->bypassed = 0;
+	changed = update_targets(aeq);
 
-	linear_svf_set_hp(&aeq->filter[0], srate, *(aeq->f0[0]), 0.7071068);
-	linear_svf_set_peq(&aeq->filter[1], *(aeq->g[1]), srate, *(aeq->f0[1]), *(aeq->bw[1]));
-	linear_svf_set_peq(&aeq->filter[2], *(aeq->g[2]), srate, *(aeq->f0[2]), *(aeq->bw[2]));
-	linear_svf_set_peq(&aeq->filter[3], *(aeq->g[3]), srate, *(aeq->f0[3]), *(aeq->bw[3]));
-	linear_svf_set_peq(&aeq->filter[4], *(aeq->g[4]), srate, *(aeq->f0[4]), *(aeq->bw[4]));
+	/* Bands switched off follow their target directly and bands at unity
+	 * are skipped once settled. A band restarts from silence. */
+	for (j = 0; j < BANDS; j++) {
+		int active;
 
-	linear_svf_set_lp(&aeq->filter[5], srate, *(aeq->f0[5]), 0.7071068);
+		enabled[j] = *(aeq->filtog[j]) > 0.5f;
+		changed |= (enabled[j] != aeq->settings.enabled[j]);
+		if (!enabled[j] || aeq->snap) {
+			linear_svf_set_coeffs(&aeq->filter[j], &aeq->target[j]);
+			aeq->smoothing[j] = 0;
+		}
+		active = enabled[j] && (aeq->smoothing[j] || !linear_svf_is_unity(&aeq->filter[j]));
+		if (active && !aeq->active[j]) {
+			aeq_reset_band(aeq, j);
+		}
+		aeq->active[j] = active;
+		smoothing |= aeq->smoothing[j];
+	}
+	if (aeq->snap) {
+		aeq->master_gain = aeq->master_target;
+	}
+	smoothing |= (aeq->master_gain != aeq->master_target);
+	aeq->snap = 0;
+	plan_bands(aeq);
+	if (changed) {
+		aeq_publish(aeq, enabled);
+	}
 
-	for (i = 0; i < n_samples; i++) {
-		in0 = input[i];
-		out = in0;
+	// Settled and decayed: silence out, the bands restart from zero
+	if (aeq->tail_bypass && !smoothing && aeq_silent(aeq, n_samples)) {
+		for (c = 0; c < aeq->n_channels; c++) {
+			memset(aeq->output[c], 0, n_samples * sizeof(float));
+		}
 		for (j = 0; j < BANDS; j++) {
-			out = run_linear_svf(&aeq->filter[j], out);
+			if (aeq->active[j]) {
+				aeq_reset_band(aeq, j);
+			}
 		}
-		output[i] = out;
+		aeq->bypassed = 1;
+		aeq_meter(aeq, n_samples, 0.f);
+		afpu_restore(fpu);
+		return;
 	}
+
+	while (offset < n_samples) {
+		const uint32_t n = (n_samples - offset < AEQ_BLOCK) ? n_samples - offset : AEQ_BLOCK;
+
+		if (smoothing) {
+			smoothing = 0;
+			for (j = 0; j < BANDS; j++) {
+				if (aeq->smoothing[j]) {
+					aeq->smoothing[j] = linear_svf_smooth(&aeq->filter[j], &aeq->target[j], aeq->smooth_coeff);
+					smoothing |= aeq->smoothing[j];
+				}
+			}
+			smoothing |= smooth_param(&aeq->master_gain, aeq->master_target, aeq->smooth_coeff);
+			plan_bands(aeq);
+		}
+
+		if (aeq->n_channels == 1) {
+			run_mono(aeq, offset, n);
+		} else {
+			run_multi(aeq, offset, n);
+		}
+		offset += n;
+	}
+
+	for (c = 0; c < aeq->n_channels; c++) {
+		p = aeq->dsp->peak(aeq->output[c], n_samples);
+		max = (p > max) ? p : max;
+	}
+	aeq_meter(aeq, n_samples, max);
+
+	afpu_restore(fpu);
 }
 
 static void
 cleanup(LV2_Handle instance)
 {
-	free(instance);
+	aarena_free(instance);
+}
+
+static void
+set_bypass(LV2_Handle instance, int enabled)
+{
+	((Aeq*)instance)->tail_bypass = enabled;
+}
+
+static int
+bypassed(LV2_Handle instance)
+{
+	return ((Aeq*)instance)->bypassed;
+}
+
+static uint32_t
+meter_read(LV2_Handle instance, AMeterBlock* blocks, uint32_t n)
+{
+	return ameter_pop(&((Aeq*)instance)->meter, blocks, n);
+}
+
+static uint32_t
+meter_dropped(LV2_Handle instance)
+{
+	return __atomic_load_n(&((Aeq*)instance)->meter.dropped, __ATOMIC_RELAXED);
+}
+
+static uint32_t
+response(LV2_Handle instance, const float* freq, float* magnitude, float* phase, uint32_t n)
+{
+	Aeq* aeq = (Aeq*)instance;
+	const double nyquist = 0.5 * aeq->srate;
+	AeqSettings settings;
+	float t[AEQ_BLOCK];
+	uint32_t generation, offset, i;
+
+	generation = aeq_settings(aeq, &settings);
+	for (offset = 0; offset < n; offset += AEQ_BLOCK) {
+		const uint32_t k = (n - offset < AEQ_BLOCK) ? n - offset : AEQ_BLOCK;
+
+		// Nyquist itself maps to t = infinity
+		for (i = 0; i < k; i++) {
+			double f = freq[offset + i];
+			f = (f > 0.0) ? f : 0.0;
+			f = (f < 0.9999 * nyquist) ? f : 0.9999 * nyquist;
+			t[i] = tan(M_PI * f / aeq->srate);
+		}
+		aeq_response(&settings, aeq->dsp, t, magnitude + offset,
+		             phase ? phase + offset : NULL, k);
+	}
+	return generation;
 }
 
 const void*
 extension_data(const char* uri)
 {
+	static const ATailInterface tail = { set_bypass, bypassed };
+	static const AMeterInterface meter = { meter_read, meter_dropped };
+	static const AResponseInterface curve = { response };
+
+	if (!strcmp(uri, ATAIL__interface)) {
+		return &tail;
+	} else if (!strcmp(uri, AMETER__interface)) {
+		return &meter;
+	} else if (!strcmp(uri, ARESPONSE__interface)) {
+		return &curve;
+	}
 	return NULL;
 }
 
@@ -365,6 +994,28 @@ static const LV2_Descriptor descriptor = {
 	extension_data
 };
 
+static const LV2_Descriptor descriptor_stereo = {
+	AEQ_STEREO_URI,
+	instantiate,
+	connect_port,
+	activate,
+	run,
+	NULL,
+	cleanup,
+	extension_data
+};
+
+static const LV2_Descriptor descriptor_8ch = {
+	AEQ_8CH_URI,
+	instantiate,
+	connect_port,
+	activate,
+	run,
+	NULL,
+	cleanup,
+	extension_data
+};
+
 LV2_SYMBOL_EXPORT
 const LV2_Descriptor*
 lv2_descriptor(uint32_t index)
@@ -372,6 +1023,10 @@ lv2_descriptor(uint32_t index)
 	switch (index) {
 	case 0:
 		return &descriptor;
+	case 1:
+		return &descriptor_stereo;
+	case 2:
+		return &descriptor_8ch;
 	default:
 		return NULL;
 	}
@@ -13,33 +13,83 @@
  */
 
 #include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "lv2/lv2plug.in/ns/lv2core/lv2.h"
 
+#include "arena.h"
+#include "denormal.h"
+#include "dsp.h"
+#include "svf.h"
+#include "tail.h"
+
 #define AFILTER_URI "urn:ardour:a-filter"
 
+// Cascaded 12dB/oct stages, one per lane of the pipeline
+#define AFILTER_MAX_STAGES 4
+
+/* Precision of the filter state and arithmetic, build with
+ * -DAFILTER_SINGLE for the float path */
+#ifdef AFILTER_SINGLE
+typedef float svf_t;
+typedef int32_t svf_index;
+#else
+typedef double svf_t;
+typedef int64_t svf_index;
+#endif
+
+/* Stages of one time step of the pipeline, in 16 byte vectors of
+ * SVF_LANES stages each */
+#define SVF_LANES (16 / (int)sizeof(svf_t))
+#define SVF_VECS (AFILTER_MAX_STAGES / SVF_LANES)
+typedef svf_t svf_vec __attribute__((vector_size(16)));
+typedef svf_index svf_mask __attribute__((vector_size(16)));
+
+/* Stage j takes the output of stage j - 1 of the previous time step:
+ * every lane from the one below, lane 0 from the last lane of the
+ * second operand */
+#ifdef AFILTER_SINGLE
+static const svf_mask svf_shift = { 7, 0, 1, 2 };
+#else
+static const svf_mask svf_shift = { 3, 0 };
+#endif
+
 typedef enum {
 	AFILTER_INPUT = 0,
 	AFILTER_OUTPUT,
 
 	AFILTER_CUTOFF,
 	AFILTER_SLOPE,
+	AFILTER_MODE,
+	AFILTER_RESONANCE,
 } PortIndex;
 
-struct linear_svf {
-	double g, k;
-	double a[3];
-	double m[3];
-	double s[4][2];
+typedef enum {
+	AFILTER_HIGHPASS = 0,
+	AFILTER_LOWPASS,
+	AFILTER_BANDPASS,
+	AFILTER_NOTCH,
+	AFILTER_ALLPASS,
+} FilterMode;
+
+/* Coefficients shared by all stages at the precision of the cascade,
+ * the state of stage j in s0[j] and s1[j] */
+struct svf_cascade {
+	svf_t a[3];
+	svf_t m[3];
+	enum svf_type type;
+	svf_t s0[AFILTER_MAX_STAGES];
+	svf_t s1[AFILTER_MAX_STAGES];
 };
 
-static void linear_svf_reset(struct linear_svf *self)
+static void svf_cascade_reset(struct svf_cascade *self)
 {
 	int i;
 
-	for (i = 0; i < 4; i++) {
-		self->s[i][0] = self->s[i][1] = 0.0;
+	for (i = 0; i < AFILTER_MAX_STAGES; i++) {
+		self->s0[i] = self->s1[i] = 0.0;
 	}
 }
 
@@ -49,11 +99,20 @@ typedef struct {
 
 	float* f0;
 	float* slope;
+	float* mode;
+	float* resonance;
 
 	float oldf0;
+	float oldmode;
+	float oldresonance;
 	float srate;
 
-	struct linear_svf highpass;
+	const struct adsp* dsp;
+	int tail_bypass;
+	int bypassed;
+
+	struct linear_svf svf;
+	struct svf_cascade cascade;
 } AFilter;
 
 static LV2_Handle
@@ -62,12 +121,24 @@ instantiate(const LV2_Descriptor* descriptor,
             const char* bundle_path,
             const LV2_Feature* const* features)
 {
-	AFilter* afilter = (AFilter*)malloc(sizeof(AFilter));
+	AArena arena = { NULL, 0, 0 };
+	AFilter* afilter;
+
+	aarena_take(&arena, sizeof(AFilter));
+	if (aarena_alloc(&arena)) {
+		return NULL;
+	}
+	afilter = (AFilter*)aarena_take(&arena, sizeof(AFilter));
 	afilter->srate = rate;
+	afilter->dsp = adsp_get();
+	afilter->tail_bypass = 1;
+	afilter->bypassed = 0;
 
 	afilter->oldf0 = 0.f;
+	afilter->oldmode = -1.f;
+	afilter->oldresonance = 0.f;
 
-	linear_svf_reset(&afilter->highpass);
+	svf_cascade_reset(&afilter->cascade);
 
 	return (LV2_Handle)afilter;
 }
@@ -86,6 +157,12 @@ connect_port(LV2_Handle instance,
 	case AFILTER_SLOPE:
 		afilter->slope = (float*)data;
 		break;
+	case AFILTER_MODE:
+		afilter->mode = (float*)data;
+		break;
+	case AFILTER_RESONANCE:
+		afilter->resonance = (float*)data;
+		break;
 	case AFILTER_INPUT:
 		afilter->input = (float*)data;
 		break;
@@ -100,91 +177,287 @@ activate(LV2_Handle instance)
 {
 	AFilter* afilter = (AFilter*)instance;
 
-	linear_svf_reset(&afilter->highpass);
+	svf_cascade_reset(&afilter->cascade);
+}
 
-	*(afilter->f0) = 160.0f;
-	*(afilter->slope) = 12.0f;
+// Design the filter for the current controls, with the kernel type its mix needs
+static void
+set_filter(AFilter* afilter)
+{
+	struct linear_svf* const svf = &afilter->svf;
+	struct svf_cascade* const cascade = &afilter->cascade;
+	const float srate = afilter->srate;
+	const float f0 = *(afilter->f0);
+	float q = *(afilter->resonance);
+	int i;
+
+	if (q < 0.1f) {
+		q = 0.1f;
+	}
+
+	switch ((FilterMode)*(afilter->mode)) {
+	case AFILTER_LOWPASS:
+		linear_svf_set_lp(svf, srate, f0, q);
+		break;
+	case AFILTER_BANDPASS:
+		linear_svf_set_bp(svf, srate, f0, q);
+		break;
+	case AFILTER_NOTCH:
+		linear_svf_set_notch(svf, srate, f0, q);
+		break;
+	case AFILTER_ALLPASS:
+		linear_svf_set_allpass(svf, srate, f0, q);
+		break;
+	default:
+		linear_svf_set_hp(svf, srate, f0, q);
+		break;
+	}
+
+	for (i = 0; i < 3; i++) {
+		cascade->a[i] = (svf_t)svf->a[i];
+		cascade->m[i] = (svf_t)svf->m[i];
+	}
+	cascade->type = linear_svf_type(svf);
+}
+
+/* One sample through stage j: u is the stage input, z0 and z1 the state
+ * of all stages. Returns the stage output. */
+static inline __attribute__((always_inline)) svf_t
+tick_linear_svf(const struct svf_cascade *self, svf_t* z0, svf_t* z1, int j, svf_t u,
+                const enum svf_type type)
+{
+	svf_t v[3];
+
+	v[2] = u - z1[j];
+	v[0] = (self->a[0] * z0[j]) + (self->a[1] * v[2]);
+	v[1] = z1[j] + (self->a[1] * z0[j]) + (self->a[2] * v[2]);
+
+	z0[j] = (v[0] + v[0]) - z0[j];
+	z1[j] = (v[1] + v[1]) - z1[j];
+
+	return LINEAR_SVF_MIX(type, self->m[0], self->m[1], self->m[2], u, v[0], v[1]);
 }
 
 /*
- * highpass SVF
- * http://www.cytomic.com/files/dsp/SvfLinearTrapOptimised2.pdf
+ * The cascade as a software pipeline: at time t stage j works on sample
+ * t - j, so all stages of a time step are independent of each other and
+ * map onto SIMD lanes. The first and last stages - 1 time steps fill and
+ * drain the pipeline within the block, so there is no added latency.
  */
-static void linear_svf_set_hp(struct linear_svf *self, float sample_rate, float cutoff, float resonance)
+static inline __attribute__((always_inline)) void
+run_cascade(struct svf_cascade *self, const float* input, float* output,
+            uint32_t n_samples, const int stages, const enum svf_type type)
 {
-	double f0 = (double)cutoff;
-	double q = (double)resonance;
-	double sr = (double)sample_rate;
+	const uint32_t end = n_samples + stages - 1;
+	const svf_t a0 = self->a[0], a1 = self->a[1], a2 = self->a[2];
+	const svf_t m0 = self->m[0], m1 = self->m[1], m2 = self->m[2];
+	svf_t z0[AFILTER_MAX_STAGES], z1[AFILTER_MAX_STAGES];
+	svf_t u[AFILTER_MAX_STAGES], y[AFILTER_MAX_STAGES];
+	uint32_t t;
+	int j;
+
+	for (j = 0; j < stages; j++) {
+		z0[j] = self->s0[j];
+		z1[j] = self->s1[j];
+		u[j] = y[j] = 0;
+	}
 
-	self->g = tan(M_PI * (f0 / sr));
-	self->k = 1.f / q;
+	// Fill: stages 0..t hold a sample
+	for (t = 0; t < (uint32_t)stages - 1 && t < n_samples; t++) {
+		u[0] = (svf_t)input[t];
+		for (j = 0; j <= (int)t; j++) {
+			y[j] = tick_linear_svf(self, z0, z1, j, u[j], type);
+		}
+		for (j = stages - 1; j > 0; j--) {
+			u[j] = y[j - 1];
+		}
+	}
 
-	self->a[0] = 1.0 / (1.0 + self->g * (self->g + self->k));
-	self->a[1] = self->g * self->a[0];
-	self->a[2] = self->g * self->a[1];
+	// All stages busy, one lane per stage. A single stage stays scalar.
+	if (stages > 1 && t < n_samples) {
+		const int vecs = (stages + SVF_LANES - 1) / SVF_LANES;
+		svf_vec vz0[SVF_VECS], vz1[SVF_VECS], vy[SVF_VECS];
+		int v;
+
+		for (j = 0; j < vecs * SVF_LANES; j++) {
+			vz0[j / SVF_LANES][j % SVF_LANES] = (j < stages) ? z0[j] : 0;
+			vz1[j / SVF_LANES][j % SVF_LANES] = (j < stages) ? z1[j] : 0;
+			// The inputs of stages 1.. are shifted in from vy
+			vy[j / SVF_LANES][j % SVF_LANES] = (j + 1 < stages) ? u[j + 1] : 0;
+		}
+		for (; t < n_samples; t++) {
+			svf_vec in = { 0 };
+			in[SVF_LANES - 1] = (svf_t)input[t];
+			for (v = vecs - 1; v >= 0; v--) {
+				const svf_vec vu = __builtin_shuffle(vy[v], v ? vy[v - 1] : in, svf_shift);
+				const svf_vec v2 = vu - vz1[v];
+				const svf_vec v0 = (a0 * vz0[v]) + (a1 * v2);
+				const svf_vec v1 = vz1[v] + (a1 * vz0[v]) + (a2 * v2);
+				vz0[v] = (v0 + v0) - vz0[v];
+				vz1[v] = (v1 + v1) - vz1[v];
+				vy[v] = LINEAR_SVF_MIX(type, m0, m1, m2, vu, v0, v1);
+			}
+			output[t - stages + 1] = (float)vy[(stages - 1) / SVF_LANES][(stages - 1) % SVF_LANES];
+		}
+		for (j = 0; j < stages; j++) {
+			z0[j] = vz0[j / SVF_LANES][j % SVF_LANES];
+			z1[j] = vz1[j / SVF_LANES][j % SVF_LANES];
+			u[j] = (j > 0) ? vy[(j - 1) / SVF_LANES][(j - 1) % SVF_LANES] : 0;
+		}
+	}
 
-	self->m[0] = 1.0;
-	self->m[1] = -self->k;
-	self->m[2] = -1.0;
+	/* Drain: stages lo..hi hold a sample, hi is below the last stage
+	 * when the block is shorter than the pipeline */
+	for (; t < end; t++) {
+		const int lo = (t < n_samples) ? 0 : (int)(t - n_samples + 1);
+		const int hi = (t < (uint32_t)stages - 1) ? (int)t : stages - 1;
+		if (t < n_samples) {
+			u[0] = (svf_t)input[t];
+		}
+		for (j = lo; j <= hi; j++) {
+			y[j] = tick_linear_svf(self, z0, z1, j, u[j], type);
+		}
+		if (t >= (uint32_t)stages - 1) {
+			output[t - stages + 1] = (float)y[stages - 1];
+		}
+		for (j = stages - 1; j > 0; j--) {
+			u[j] = y[j - 1];
+		}
+	}
+
+	for (j = 0; j < stages; j++) {
+		self->s0[j] = z0[j];
+		self->s1[j] = z1[j];
+	}
 }
 
-static float run_linear_svf(struct linear_svf *self, int c, float in)
+// The cascade for a constant number of stages and output mix
+static inline __attribute__((always_inline)) void
+run_type(AFilter* afilter, uint32_t n_samples, const int stages, const enum svf_type type)
 {
-	double v[3];
-	double din = (double)in;
-	double out;
-
-	v[2] = din - self->s[c][1];
-	v[0] = (self->a[0] * self->s[c][0]) + (self->a[1] * v[2]);
-	v[1] = self->s[c][1] + (self->a[1] * self->s[c][0]) + (self->a[2] * v[2]);
+	run_cascade(&afilter->cascade, afilter->input, afilter->output, n_samples, stages, type);
+}
 
-	self->s[c][0] = (2.0 * v[0]) - self->s[c][0];
-	self->s[c][1] = (2.0 * v[1]) - self->s[c][1];
+static inline __attribute__((always_inline)) void
+run_stages(AFilter* afilter, uint32_t n_samples, const int stages)
+{
+	switch (afilter->cascade.type) {
+	case SVF_HP:
+		run_type(afilter, n_samples, stages, SVF_HP);
+		break;
+	case SVF_LP:
+		run_type(afilter, n_samples, stages, SVF_LP);
+		break;
+	case SVF_BP:
+		run_type(afilter, n_samples, stages, SVF_BP);
+		break;
+	case SVF_NOTCH:
+		run_type(afilter, n_samples, stages, SVF_NOTCH);
+		break;
+	default:
+		run_type(afilter, n_samples, stages, SVF_GENERIC);
+		break;
+	}
+}
 
-	out = (self->m[0] * din)
-		+ (self->m[1] * v[0])
-		+ (self->m[2] * v[1]);
+// Input and the state of the first stages below ATAIL_SILENCE
+static int
+afilter_silent(const AFilter* afilter, uint32_t n_samples, int stages)
+{
+	const struct svf_cascade* const cascade = &afilter->cascade;
+	int j;
 
-	return (float)out;
+	for (j = 0; j < stages; j++) {
+		if (fabs(cascade->s0[j]) >= ATAIL_SILENCE || fabs(cascade->s1[j]) >= ATAIL_SILENCE) {
+			return 0;
+		}
+	}
+	return afilter->dsp->peak(afilter->input, n_samples) < ATAIL_SILENCE;
 }
 
 static void
 run(LV2_Handle instance, uint32_t n_samples)
 {
 	AFilter* afilter = (AFilter*)instance;
+	const afpu_state fpu = afpu_flush_denormals();
 
 	const float* const input = afilter->input;
 	float* const output = afilter->output;
 
-	float srate = afilter->srate;
 	int stacked = (int)(*(afilter->slope) / 12.f);
-	float in0, out;
-	uint32_t i, j;
 
-	if (*(afilter->f0) != afilter->oldf0)
-		linear_svf_set_hp(&afilter->highpass, srate, *(afilter->f0), 0.7071068);
+	if (stacked > AFILTER_MAX_STAGES) {
+		stacked = AFILTER_MAX_STAGES;
+	}
+
+	if (*(afilter->f0) != afilter->oldf0
+	    || *(afilter->mode) != afilter->oldmode
+	    || *(afilter->resonance) != afilter->oldresonance) {
+		set_filter(afilter);
+	}
 
-	for (i = 0; i < n_samples; i++) {
-		in0 = input[i];
-		out = in0;
-		for (j = 0; j < stacked; j++) {
-			out = run_linear_svf(&afilter->highpass, j, out);
+	afilter->bypassed = stacked > 0 && afilter->tail_bypass
+		&& afilter_silent(afilter, n_samples, stacked);
+	if (afilter->bypassed) {
+		// Decayed into silence, the cascade restarts from zero
+		memset(output, 0, n_samples * sizeof(float));
+		svf_cascade_reset(&afilter->cascade);
+	} else {
+		// The mix of the mode is resolved here, each kernel only has its terms
+		switch (stacked) {
+		case 1:
+			run_stages(afilter, n_samples, 1);
+			break;
+		case 2:
+			run_stages(afilter, n_samples, 2);
+			break;
+		case 3:
+			run_stages(afilter, n_samples, 3);
+			break;
+		case 4:
+			run_stages(afilter, n_samples, 4);
+			break;
+		default:
+			if (input != output) {
+				memcpy(output, input, n_samples * sizeof(float));
+			}
+			break;
 		}
-		output[i] = out;
 	}
 
 	afilter->oldf0 = *(afilter->f0);
+	afilter->oldmode = *(afilter->mode);
+	afilter->oldresonance = *(afilter->resonance);
+
+	afpu_restore(fpu);
 }
 
 static void
 cleanup(LV2_Handle instance)
 {
-	free(instance);
+	aarena_free(instance);
+}
+
+static void
+set_bypass(LV2_Handle instance, int enabled)
+{
+	((AFilter*)instance)->tail_bypass = enabled;
+}
+
+static int
+bypassed(LV2_Handle instance)
+{
+	return ((AFilter*)instance)->bypassed;
 }
 
 const void*
 extension_data(const char* uri)
 {
+	static const ATailInterface tail = { set_bypass, bypassed };
+
+	if (!strcmp(uri, ATAIL__interface)) {
+		return &tail;
+	}
 	return NULL;
 }
 
@@ -0,0 +1,470 @@
+/* a-reverb
+ * Copyright (C) 2016 Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lv2/lv2plug.in/ns/lv2core/lv2.h"
+
+#include "arena.h"
+#include "denormal.h"
+#include "dsp.h"
+#include "tail.h"
+
+#define AREVERB_URI "urn:ardour:a-reverb"
+
+/* Delay lines of the feedback delay network, processed as two vectors of
+ * four lines each */
+#define AREVERB_LINES 8
+#define AREVERB_VECS (AREVERB_LINES / 4)
+
+// Decay time in seconds at room size 0 and 1
+#define AREVERB_MIN_T60 0.2f
+#define AREVERB_MAX_T60 10.f
+
+typedef float areverb_vec __attribute__((vector_size(16)));
+typedef int32_t areverb_mask __attribute__((vector_size(16)));
+
+/* Line lengths in samples at 48 kHz, mutually prime and spread over
+ * 30 to 60 ms so the modes of the lines interleave evenly */
+static const float line_length[AREVERB_LINES] = {
+	1433.f, 1601.f, 1867.f, 2053.f, 2251.f, 2399.f, 2647.f, 2897.f
+};
+
+/* Rows of the Hadamard matrix used as input gains.  The outputs are two
+ * more rows, lanes 1 and 2 of the first vector of the transformed lines,
+ * all four orthogonal so the two channels stay decorrelated. */
+static const areverb_vec in_left[AREVERB_VECS] = { { 1, 1, 1, 1 }, { -1, -1, -1, -1 } };
+static const areverb_vec in_right[AREVERB_VECS] = { { 1, -1, -1, 1 }, { 1, -1, -1, 1 } };
+
+typedef enum {
+	AREVERB_INPUT0 = 0,
+	AREVERB_INPUT1,
+	AREVERB_OUTPUT0,
+	AREVERB_OUTPUT1,
+
+	AREVERB_BLEND,
+	AREVERB_ROOM,
+	AREVERB_DAMPING,
+} PortIndex;
+
+typedef struct {
+	float* input[2];
+	float* output[2];
+
+	float* blend;
+	float* room;
+	float* damping;
+
+	const struct adsp* dsp;
+	float srate;
+	float oldblend;
+	int blend_reset; // oldblend is taken from the first run()
+	float oldroom;
+	float olddamping;
+
+	/* Frame i of the network, one sample of every line, is stored at
+	 * lines + AREVERB_LINES * i.  The ring is mask + 1 frames long, a
+	 * power of two, and line l is read length[l] frames behind pos. */
+	float* lines;
+	uint32_t mask;
+	uint32_t pos;
+	uint32_t length[AREVERB_LINES];
+	// Sample offset of the tap of line l behind the frame at pos
+	uint32_t tap[AREVERB_LINES];
+	uint32_t longest;
+	/* Frames written in a row below ATAIL_SILENCE, once the longest
+	 * line has nothing else left the network is silent */
+	uint32_t quiet;
+	int tail_bypass;
+	int bypassed;
+
+	/* Per line damping lowpass: y = c0 * x + c1 * y, where c0 includes
+	 * the loss for the decay time of the line */
+	areverb_vec c0[AREVERB_VECS];
+	areverb_vec c1[AREVERB_VECS];
+	areverb_vec state[AREVERB_VECS];
+} AReverb;
+
+static void
+cleanup(LV2_Handle instance)
+{
+	aarena_free(instance);
+}
+
+// The instance and its lines of size frames each
+static AReverb*
+areverb_layout(AArena* arena, uint32_t size)
+{
+	AReverb* areverb = (AReverb*)aarena_take(arena, sizeof(AReverb));
+	float* lines = (float*)aarena_take(arena, size * AREVERB_LINES * sizeof(float));
+
+	if (areverb) {
+		areverb->lines = lines;
+	}
+	return areverb;
+}
+
+static LV2_Handle
+instantiate(const LV2_Descriptor* descriptor,
+            double rate,
+            const char* bundle_path,
+            const LV2_Feature* const* features)
+{
+	AArena arena = { NULL, 0, 0 };
+	AReverb* areverb;
+	uint32_t length[AREVERB_LINES];
+	uint32_t l, size = 1, longest = 0;
+
+	for (l = 0; l < AREVERB_LINES; l++) {
+		length[l] = (uint32_t)(line_length[l] * rate / 48000.f);
+		if (length[l] > longest) {
+			longest = length[l];
+		}
+	}
+
+	// Every line reads at least one frame behind the frame being written
+	while (size < longest + 1) {
+		size <<= 1;
+	}
+
+	areverb_layout(&arena, size);
+	if (aarena_alloc(&arena)) {
+		return NULL;
+	}
+	areverb = areverb_layout(&arena, size);
+
+	areverb->dsp = adsp_get();
+	areverb->tail_bypass = 1;
+	areverb->srate = rate;
+	areverb->oldroom = -1.f;
+	areverb->olddamping = -1.f;
+
+	for (l = 0; l < AREVERB_LINES; l++) {
+		areverb->length[l] = length[l];
+		areverb->tap[l] = AREVERB_LINES * length[l] - l;
+	}
+	areverb->longest = longest;
+	areverb->mask = size - 1;
+
+	return (LV2_Handle)areverb;
+}
+
+static void
+connect_port(LV2_Handle instance,
+             uint32_t port,
+             void* data)
+{
+	AReverb* areverb = (AReverb*)instance;
+
+	switch ((PortIndex)port) {
+	case AREVERB_INPUT0:
+		areverb->input[0] = (float*)data;
+		break;
+	case AREVERB_INPUT1:
+		areverb->input[1] = (float*)data;
+		break;
+	case AREVERB_OUTPUT0:
+		areverb->output[0] = (float*)data;
+		break;
+	case AREVERB_OUTPUT1:
+		areverb->output[1] = (float*)data;
+		break;
+	case AREVERB_BLEND:
+		areverb->blend = (float*)data;
+		break;
+	case AREVERB_ROOM:
+		areverb->room = (float*)data;
+		break;
+	case AREVERB_DAMPING:
+		areverb->damping = (float*)data;
+		break;
+	}
+}
+
+static void
+activate(LV2_Handle instance)
+{
+	AReverb* areverb = (AReverb*)instance;
+	uint32_t v;
+
+	memset(areverb->lines, 0, (areverb->mask + 1) * AREVERB_LINES * sizeof(float));
+	areverb->pos = 0;
+	areverb->quiet = 0;
+	for (v = 0; v < AREVERB_VECS; v++) {
+		areverb->state[v] = (areverb_vec){ 0, 0, 0, 0 };
+	}
+	areverb->blend_reset = 1;
+}
+
+/*
+ * Loss per line for the decay time of the room, with Jot's first order
+ * absorption filter: the pole grows with the line length so all lines
+ * reach the shorter decay time at Nyquist together.  Damping 0 decays
+ * evenly, damping 1 four times faster at Nyquist than at DC.
+ */
+static void
+set_decay(AReverb* areverb, float room, float damping)
+{
+	const float t60 = AREVERB_MIN_T60 * powf(AREVERB_MAX_T60 / AREVERB_MIN_T60, room);
+	const float alpha = 1.f - 0.75f * damping;
+	uint32_t l;
+
+	for (l = 0; l < AREVERB_LINES; l++) {
+		const float seconds = areverb->length[l] / areverb->srate;
+		const float g = powf(10.f, -3.f * seconds / t60);
+		float b = 0.25f * logf(10.f) * log10f(g) * (1.f - 1.f / (alpha * alpha));
+
+		b = (b < 0.95f) ? b : 0.95f;
+		areverb->c0[l / 4][l % 4] = g * (1.f - b);
+		areverb->c1[l / 4][l % 4] = b;
+	}
+}
+
+/*
+ * Normalized 8 point Hadamard transform of lines a (0..3) and b (4..7):
+ * one butterfly between the vectors, then two inside each of them.
+ */
+static inline void
+hadamard(areverb_vec* a, areverb_vec* b)
+{
+	static const areverb_mask pairs = { 1, 0, 3, 2 };
+	static const areverb_mask halves = { 2, 3, 0, 1 };
+	static const areverb_mask odd = { 0, 5, 2, 7 };
+	static const areverb_mask high = { 0, 1, 6, 7 };
+	const areverb_vec norm = { 0.35355339f, 0.35355339f, 0.35355339f, 0.35355339f };
+	areverb_vec x[2] = { *a + *b, *a - *b };
+	int v;
+
+	for (v = 0; v < 2; v++) {
+		areverb_vec p = __builtin_shuffle(x[v], pairs);
+		x[v] = __builtin_shuffle(x[v] + p, p - x[v], odd);
+		p = __builtin_shuffle(x[v], halves);
+		x[v] = __builtin_shuffle(x[v] + p, p - x[v], high);
+	}
+	*a = x[0] * norm;
+	*b = x[1] * norm;
+}
+
+// Peak of the n frames from frame pos on
+static float
+lines_peak(const AReverb* areverb, uint32_t pos, uint32_t n)
+{
+	const uint32_t frames = areverb->mask + 1;
+	const uint32_t w = pos & areverb->mask;
+	const float* const lines = areverb->lines;
+	float p;
+
+	if (n > frames) {
+		n = frames;
+	}
+	if (w + n <= frames) {
+		return areverb->dsp->peak(lines + AREVERB_LINES * w, AREVERB_LINES * n);
+	}
+	p = areverb->dsp->peak(lines + AREVERB_LINES * w, AREVERB_LINES * (frames - w));
+	return fmaxf(p, areverb->dsp->peak(lines, AREVERB_LINES * (w + n - frames)));
+}
+
+static void
+lines_quiet(AReverb* areverb, float peak, uint32_t n)
+{
+	if (peak >= ATAIL_SILENCE) {
+		areverb->quiet = 0;
+	} else if (areverb->quiet + n > areverb->longest) {
+		areverb->quiet = areverb->longest;
+	} else {
+		areverb->quiet += n;
+	}
+}
+
+/* Silent input, every frame a line can still read and the damping
+ * filters below ATAIL_SILENCE */
+static int
+reverb_silent(const AReverb* areverb, uint32_t n)
+{
+	return areverb->quiet >= areverb->longest
+		&& areverb->dsp->peak((const float*)areverb->state, AREVERB_LINES) < ATAIL_SILENCE
+		&& areverb->dsp->peak(areverb->input[0], n) < ATAIL_SILENCE
+		&& areverb->dsp->peak(areverb->input[1], n) < ATAIL_SILENCE;
+}
+
+// Skip n silent frames: zeros are written to the lines
+static void
+reverb_bypass(AReverb* areverb, uint32_t n)
+{
+	const uint32_t frames = areverb->mask + 1;
+	const uint32_t w = areverb->pos & areverb->mask;
+	float* const lines = areverb->lines;
+	uint32_t v;
+
+	if (n > frames) {
+		n = frames;
+	}
+	if (w + n <= frames) {
+		memset(lines + AREVERB_LINES * w, 0, AREVERB_LINES * n * sizeof(float));
+	} else {
+		memset(lines + AREVERB_LINES * w, 0, AREVERB_LINES * (frames - w) * sizeof(float));
+		memset(lines, 0, AREVERB_LINES * (w + n - frames) * sizeof(float));
+	}
+	for (v = 0; v < AREVERB_VECS; v++) {
+		areverb->state[v] = (areverb_vec){ 0, 0, 0, 0 };
+	}
+}
+
+static void
+run(LV2_Handle instance, uint32_t n_samples)
+{
+	AReverb* areverb = (AReverb*)instance;
+	const afpu_state fpu = afpu_flush_denormals();
+
+	const uint32_t* const tap = areverb->tap;
+	const float* const in_l = areverb->input[0];
+	const float* const in_r = areverb->input[1];
+	float* const out_l = areverb->output[0];
+	float* const out_r = areverb->output[1];
+	float* const lines = areverb->lines;
+	const uint32_t mask = areverb->mask;
+	const uint32_t samples = AREVERB_LINES * (mask + 1) - 1;
+
+	const float target = *(areverb->blend);
+	float blend = areverb->blend_reset ? target : areverb->oldblend;
+	const float dblend = n_samples ? (target - blend) / n_samples : 0.f;
+	/* The network is lossless up to c0, outputs are normalized Hadamard
+	 * rows, sqrt(8) times smaller than the plain sum of signed lines */
+	const float wet_gain = 0.70710678f;
+
+	areverb_vec s[AREVERB_VECS];
+	uint32_t pos = areverb->pos;
+	uint32_t i, v;
+
+	if (*(areverb->room) != areverb->oldroom || *(areverb->damping) != areverb->olddamping) {
+		areverb->oldroom = *(areverb->room);
+		areverb->olddamping = *(areverb->damping);
+		set_decay(areverb, areverb->oldroom, areverb->olddamping);
+	}
+
+	areverb->bypassed = areverb->tail_bypass && reverb_silent(areverb, n_samples);
+	if (areverb->bypassed) {
+		reverb_bypass(areverb, n_samples);
+		memset(out_l, 0, n_samples * sizeof(float));
+		memset(out_r, 0, n_samples * sizeof(float));
+		areverb->pos = pos + n_samples;
+		areverb->oldblend = target;
+		areverb->blend_reset = 0;
+		afpu_restore(fpu);
+		return;
+	}
+
+	for (v = 0; v < AREVERB_VECS; v++) {
+		s[v] = areverb->state[v];
+	}
+	for (i = 0; i < n_samples; i++) {
+		areverb_vec y[AREVERB_VECS];
+		const uint32_t t = AREVERB_LINES * pos;
+		areverb_vec* const w = (areverb_vec*)(lines + (t & samples));
+		float wl, wr;
+
+		// Each line sits in its own lane, so the taps are a gather
+		for (v = 0; v < AREVERB_VECS; v++) {
+			const uint32_t* const r = tap + 4 * v;
+			y[v] = (areverb_vec){
+				lines[(t - r[0]) & samples],
+				lines[(t - r[1]) & samples],
+				lines[(t - r[2]) & samples],
+				lines[(t - r[3]) & samples]
+			};
+		}
+
+		for (v = 0; v < AREVERB_VECS; v++) {
+			s[v] = areverb->c0[v] * y[v] + areverb->c1[v] * s[v];
+		}
+
+		y[0] = s[0];
+		y[1] = s[1];
+		hadamard(&y[0], &y[1]);
+		wl = y[0][1];
+		wr = y[0][2];
+		for (v = 0; v < AREVERB_VECS; v++) {
+			w[v] = y[v] + in_left[v] * in_l[i] + in_right[v] * in_r[i];
+		}
+		pos++;
+
+		blend += dblend;
+		out_l[i] = in_l[i] + blend * (wet_gain * wl - in_l[i]);
+		out_r[i] = in_r[i] + blend * (wet_gain * wr - in_r[i]);
+	}
+
+	for (v = 0; v < AREVERB_VECS; v++) {
+		areverb->state[v] = s[v];
+	}
+	lines_quiet(areverb, lines_peak(areverb, areverb->pos, n_samples), n_samples);
+	areverb->pos = pos;
+	areverb->oldblend = target;
+	areverb->blend_reset = 0;
+
+	afpu_restore(fpu);
+}
+
+static void
+deactivate(LV2_Handle instance)
+{
+}
+
+static void
+set_bypass(LV2_Handle instance, int enabled)
+{
+	((AReverb*)instance)->tail_bypass = enabled;
+}
+
+static int
+bypassed(LV2_Handle instance)
+{
+	return ((AReverb*)instance)->bypassed;
+}
+
+const void*
+extension_data(const char* uri)
+{
+	static const ATailInterface tail = { set_bypass, bypassed };
+
+	if (!strcmp(uri, ATAIL__interface)) {
+		return &tail;
+	}
+	return NULL;
+}
+
+static const LV2_Descriptor descriptor = {
+	AREVERB_URI,
+	instantiate,
+	connect_port,
+	activate,
+	run,
+	deactivate,
+	cleanup,
+	extension_data
+};
+
+LV2_SYMBOL_EXPORT
+const LV2_Descriptor*
+lv2_descriptor(uint32_t index)
+{
+	switch (index) {
+	case 0:
+		return &descriptor;
+	default:
+		return NULL;
+	}
+}
@@ -0,0 +1,824 @@
+/* a-bench: offline run() cost benchmark for a-plugins
+ * Copyright (C) 2016 Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "host.h"
+#include "tail.h"
+
+#define MAX_LIST 32
+#define MAX_SETS 32
+
+/* A silent tail may cost at most this many times noise input, denormals
+ * in a decaying state cost far more */
+#define TAIL_SLOWDOWN 2.0
+
+/* The bypass check feeds CHECK_BURSTS bursts of noise, each followed by
+ * the measurement length of silence.  From the first bypassed run() on
+ * the output may differ from the full processing by at most
+ * CHECK_TOLERANCE, -100 dBFS. */
+#define CHECK_BURST 0.25
+#define CHECK_BURSTS 3
+#define CHECK_TOLERANCE 1e-5f
+
+/* The block size check runs the plugin at each block size against an
+ * instance at the first one, on the same noise after COMPARE_WARMUP
+ * seconds of silence to settle the controls and load files */
+#define COMPARE_WARMUP 0.1
+
+typedef struct {
+	const char* bindir;
+	const char* filter;
+	uint32_t blocks[MAX_LIST];
+	uint32_t n_blocks;
+	double rates[MAX_LIST];
+	uint32_t n_rates;
+	double seconds;
+	int automation; // 0: static, 1: automated, 2: both
+	double budget;  // ns/sample, 0: none
+	int tail;       // also measure the silence after a noise burst
+	int check;      // compare the output with and without tail bypass
+	int compare;    // compare the output at each block size with the first
+	int late;       // worker responses after the next run()
+	const char* path;
+	uint32_t n_sets;
+	char set_symbol[MAX_SETS][64];
+	float set_value[MAX_SETS];
+} BenchOptions;
+
+typedef struct {
+	uint64_t samples;
+	double ns_total;
+	double cycles;
+	const char* cycle_source;
+	double p50;
+	double p99;
+	double max;
+} BenchResult;
+
+typedef struct {
+	int cutover;      // run() was bypassed at all
+	double tail_ms;   // from the end of the first burst to the cut-over
+	int early;        // the output differed before the cut-over
+	float max_diff;   // from the cut-over on
+	// Silent blocks, bypassed ones and run() time with and without bypass
+	uint64_t silence_samples;
+	uint64_t bypassed_samples;
+	double silence_ns[2];
+} CheckResult;
+
+typedef struct {
+	float max_diff;
+	uint64_t differing; // samples off by more than CHECK_TOLERANCE
+} CompareResult;
+
+/* Cycle counting: perf_event core cycles if the kernel lets us, else TSC */
+
+typedef struct {
+	int fd;
+	const char* source;
+} CycleCounter;
+
+static void
+cycles_open(CycleCounter* cc)
+{
+	cc->fd = -1;
+	cc->source = "none";
+#ifdef __linux__
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	cc->fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if (cc->fd >= 0) {
+		cc->source = "perf";
+		return;
+	}
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+	cc->source = "tsc";
+#endif
+}
+
+static uint64_t
+cycles_read(CycleCounter* cc)
+{
+#ifdef __linux__
+	if (cc->fd >= 0) {
+		uint64_t count = 0;
+		if (read(cc->fd, &count, sizeof(count)) != sizeof(count)) {
+			return 0;
+		}
+		return count;
+	}
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void
+cycles_start(CycleCounter* cc)
+{
+#ifdef __linux__
+	if (cc->fd >= 0) {
+		ioctl(cc->fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(cc->fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+}
+
+static void
+cycles_close(CycleCounter* cc)
+{
+#ifdef __linux__
+	if (cc->fd >= 0) {
+		close(cc->fd);
+	}
+#endif
+	cc->fd = -1;
+}
+
+static inline double
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Deterministic white noise at -12 dBFS */
+static inline float
+noise(uint32_t* seed)
+{
+	*seed = *seed * 1664525u + 1013904223u;
+	return 0.25f * ((float)(*seed >> 8) / 8388608.f - 1.f);
+}
+
+static void
+automate(HostInstance* inst, uint32_t* seed)
+{
+	const HostPlugin* plugin = inst->plugin;
+	uint32_t i;
+
+	for (i = 0; i < plugin->n_ports; i++) {
+		const HostPort* port = &plugin->ports[i];
+		float r;
+
+		if (port->type != PORT_CONTROL || !port->is_input
+		    || port->toggled || port->integer || port->enumeration
+		    || port->max <= port->min) {
+			continue;
+		}
+		*seed = *seed * 1664525u + 1013904223u;
+		r = (float)(*seed >> 8) / 16777216.f;
+		if (port->logarithmic && port->min > 0.f) {
+			inst->controls[i] = port->min * powf(port->max / port->min, r);
+		} else {
+			inst->controls[i] = port->min + r * (port->max - port->min);
+		}
+	}
+}
+
+static int
+cmp_double(const void* a, const void* b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+/* With tail set the input is noise only during the warm up, the blocks
+ * measured are the decay of the plugin's state into silence */
+static int
+bench_one(const BenchOptions* opts, const HostPlugin* plugin,
+          double rate, uint32_t block, int automated, int tail, BenchResult* res)
+{
+	HostInstance inst;
+	CycleCounter cc;
+	uint32_t n_blocks = (uint32_t)ceil(opts->seconds * rate / block);
+	uint32_t n_warmup = (uint32_t)ceil(0.1 * rate / block);
+	double* times;
+	uint64_t c0 = 0, c1;
+	uint32_t seed = 1;
+	uint32_t b, c, i;
+
+	if (host_instantiate(&inst, plugin, rate, block)) {
+		fprintf(stderr, "a-bench: failed to instantiate %s\n", plugin->uri);
+		return -1;
+	}
+	inst.late_worker = opts->late;
+	for (i = 0; i < opts->n_sets; i++) {
+		host_set_control(&inst, opts->set_symbol[i], opts->set_value[i]);
+	}
+	if (opts->path) {
+		// Loaded by the first warm up block
+		host_set_path(&inst, opts->path);
+	}
+	times = (double*)malloc(n_blocks * sizeof(double));
+	if (!times) {
+		fprintf(stderr, "a-bench: out of memory\n");
+		host_cleanup(&inst);
+		return -1;
+	}
+
+	plugin->descriptor->activate(inst.handle);
+
+	cycles_open(&cc);
+	res->samples = 0;
+	res->ns_total = 0.;
+	res->cycles = 0.;
+	res->cycle_source = cc.source;
+
+	for (b = 0; b < n_warmup + n_blocks; b++) {
+		const int silent = tail && b >= n_warmup;
+		double t0, t1;
+
+		for (c = 0; c < inst.n_audio_in; c++) {
+			float* buf = inst.audio[inst.audio_in[c]];
+			for (i = 0; i < block; i++) {
+				buf[i] = silent ? 0.f : noise(&seed);
+			}
+		}
+		if (automated) {
+			automate(&inst, &seed);
+		}
+		if (b == n_warmup) {
+			cycles_start(&cc);
+			c0 = cycles_read(&cc);
+		}
+
+		t0 = now_ns();
+		host_run(&inst, block);
+		t1 = now_ns();
+
+		if (b >= n_warmup) {
+			times[b - n_warmup] = t1 - t0;
+			res->ns_total += t1 - t0;
+			res->samples += block;
+		}
+	}
+	c1 = cycles_read(&cc);
+	res->cycles = (double)(c1 - c0);
+	cycles_close(&cc);
+
+	if (plugin->descriptor->deactivate) {
+		plugin->descriptor->deactivate(inst.handle);
+	}
+	host_cleanup(&inst);
+
+	qsort(times, n_blocks, sizeof(double), cmp_double);
+	res->p50 = times[n_blocks / 2];
+	res->p99 = times[(uint32_t)(0.99 * (n_blocks - 1))];
+	res->max = times[n_blocks - 1];
+	free(times);
+	return 0;
+}
+
+static void
+print_result(const HostPlugin* plugin, double rate, uint32_t block,
+             int automated, int tail, const BenchResult* res)
+{
+	printf("{\"plugin\":\"%s\",\"rate\":%.0f,\"block\":%u,\"automation\":%s,"
+	       "\"input\":\"%s\",\"samples\":%llu,\"ns_per_sample\":%.3f,",
+	       plugin->uri, rate, block, automated ? "true" : "false",
+	       tail ? "tail" : "noise",
+	       (unsigned long long)res->samples, res->ns_total / res->samples);
+	if (strcmp(res->cycle_source, "none")) {
+		printf("\"cycles_per_sample\":%.3f,", res->cycles / res->samples);
+	} else {
+		printf("\"cycles_per_sample\":null,");
+	}
+	printf("\"cycle_source\":\"%s\",\"block_ns_p50\":%.0f,\"block_ns_p99\":%.0f,"
+	       "\"block_ns_max\":%.0f}\n",
+	       res->cycle_source, res->p50, res->p99, res->max);
+	fflush(stdout);
+}
+
+/*
+ * Run the plugin with the tail bypass and, as the reference, without it
+ * on the same bursts of noise.  Up to the first bypassed run() both
+ * outputs must be identical.  Returns 1 if the plugin has no bypass.
+ */
+static int
+check_one(const BenchOptions* opts, const HostPlugin* plugin,
+          double rate, uint32_t block, CheckResult* res)
+{
+	const ATailInterface* tail = (const ATailInterface*)
+		plugin->descriptor->extension_data(ATAIL__interface);
+	const uint32_t burst = (uint32_t)(CHECK_BURST * rate);
+	const uint32_t period = burst + (uint32_t)(opts->seconds * rate);
+	HostInstance inst[2];
+	uint32_t seed = 1;
+	uint32_t t, c, i, k;
+
+	if (!tail) {
+		return 1;
+	}
+	for (k = 0; k < 2; k++) {
+		if (host_instantiate(&inst[k], plugin, rate, block)) {
+			fprintf(stderr, "a-bench: failed to instantiate %s\n", plugin->uri);
+			if (k) {
+				host_cleanup(&inst[0]);
+			}
+			return -1;
+		}
+		inst[k].late_worker = opts->late;
+		for (i = 0; i < opts->n_sets; i++) {
+			host_set_control(&inst[k], opts->set_symbol[i], opts->set_value[i]);
+		}
+		if (opts->path) {
+			host_set_path(&inst[k], opts->path);
+		}
+		plugin->descriptor->activate(inst[k].handle);
+	}
+	tail->set_bypass(inst[1].handle, 0);
+
+	memset(res, 0, sizeof(CheckResult));
+	for (t = 0; t < CHECK_BURSTS * period; t += block) {
+		const uint32_t n = (CHECK_BURSTS * period - t < block) ? CHECK_BURSTS * period - t : block;
+
+		for (c = 0; c < inst[0].n_audio_in; c++) {
+			float* const buf = inst[0].audio[inst[0].audio_in[c]];
+			for (i = 0; i < n; i++) {
+				buf[i] = ((t + i) % period < burst) ? noise(&seed) : 0.f;
+			}
+			memcpy(inst[1].audio[inst[1].audio_in[c]], buf, n * sizeof(float));
+		}
+		for (k = 0; k < 2; k++) {
+			const double t0 = now_ns();
+			host_run(&inst[k], n);
+			if (t % period >= burst) {
+				res->silence_ns[k] += now_ns() - t0;
+			}
+		}
+		if (t % period >= burst) {
+			res->silence_samples += n;
+		}
+		if (tail->bypassed(inst[0].handle)) {
+			if (!res->cutover) {
+				res->cutover = 1;
+				res->tail_ms = 1000. * ((double)t - burst) / rate;
+			}
+			res->bypassed_samples += n;
+		}
+
+		for (c = 0; c < inst[0].n_audio_out; c++) {
+			const float* const y = inst[0].audio[inst[0].audio_out[c]];
+			const float* const ref = inst[1].audio[inst[1].audio_out[c]];
+			for (i = 0; i < n; i++) {
+				const float d = fabsf(y[i] - ref[i]);
+				if (!res->cutover && d > 0.f) {
+					res->early = 1;
+				}
+				if (d > res->max_diff) {
+					res->max_diff = d;
+				}
+			}
+		}
+	}
+
+	for (k = 0; k < 2; k++) {
+		if (plugin->descriptor->deactivate) {
+			plugin->descriptor->deactivate(inst[k].handle);
+		}
+		host_cleanup(&inst[k]);
+	}
+	return 0;
+}
+
+static void
+print_check(const HostPlugin* plugin, double rate, uint32_t block, const CheckResult* res)
+{
+	printf("{\"plugin\":\"%s\",\"rate\":%.0f,\"block\":%u,\"check\":\"bypass\",",
+	       plugin->uri, rate, block);
+	if (res->cutover) {
+		printf("\"tail_ms\":%.1f,", res->tail_ms);
+	} else {
+		printf("\"tail_ms\":null,");
+	}
+	printf("\"identical_until_bypass\":%s,", res->early ? "false" : "true");
+	if (res->max_diff > 0.f) {
+		printf("\"max_diff_dB\":%.1f,", 20. * log10(res->max_diff));
+	} else {
+		printf("\"max_diff_dB\":null,");
+	}
+	printf("\"bypassed\":%.3f,\"silence_ns_per_sample\":%.3f,\"full_ns_per_sample\":%.3f}\n",
+	       (double)res->bypassed_samples / res->silence_samples,
+	       res->silence_ns[0] / res->silence_samples, res->silence_ns[1] / res->silence_samples);
+	fflush(stdout);
+}
+
+/* Feed total samples of noise through inst in blocks of block after
+ * warmup samples of silence, out holds the outputs one after another */
+static void
+compare_run(HostInstance* inst, uint32_t block, uint32_t warmup, uint32_t total, float* out)
+{
+	// One sequence per channel, the same whatever the block size
+	uint32_t seed[HOST_MAX_PORTS];
+	uint32_t t, c, i, n;
+
+	for (c = 0; c < inst->n_audio_in; c++) {
+		seed[c] = c + 1;
+	}
+
+	for (t = 0; t < warmup; t += n) {
+		n = (warmup - t < block) ? warmup - t : block;
+		for (c = 0; c < inst->n_audio_in; c++) {
+			memset(inst->audio[inst->audio_in[c]], 0, n * sizeof(float));
+		}
+		host_run(inst, n);
+	}
+	for (t = 0; t < total; t += n) {
+		n = (total - t < block) ? total - t : block;
+		for (c = 0; c < inst->n_audio_in; c++) {
+			float* const buf = inst->audio[inst->audio_in[c]];
+			for (i = 0; i < n; i++) {
+				buf[i] = noise(&seed[c]);
+			}
+		}
+		host_run(inst, n);
+		for (c = 0; c < inst->n_audio_out; c++) {
+			memcpy(out + (size_t)c * total + t, inst->audio[inst->audio_out[c]],
+			       n * sizeof(float));
+		}
+	}
+}
+
+/*
+ * Run the plugin at block and, as the reference, at the first block
+ * size on the same input with static controls.  With late only the
+ * plugin at block gets its worker responses a period late.  Returns 1
+ * if there is nothing to compare.
+ */
+static int
+compare_one(const BenchOptions* opts, const HostPlugin* plugin,
+            double rate, uint32_t block, CompareResult* res)
+{
+	const uint32_t blocks[2] = { opts->blocks[0], block };
+	const uint32_t warmup = (uint32_t)(COMPARE_WARMUP * rate);
+	const uint32_t total = (uint32_t)(opts->seconds * rate);
+	HostInstance inst[2];
+	float* out[2] = { NULL, NULL };
+	uint32_t c, i, k;
+
+	if (block == opts->blocks[0] && !opts->late) {
+		return 1;
+	}
+	for (k = 0; k < 2; k++) {
+		if (host_instantiate(&inst[k], plugin, rate, blocks[k])) {
+			fprintf(stderr, "a-bench: failed to instantiate %s\n", plugin->uri);
+			if (k) {
+				host_cleanup(&inst[0]);
+				free(out[0]);
+			}
+			return -1;
+		}
+		for (i = 0; i < opts->n_sets; i++) {
+			host_set_control(&inst[k], opts->set_symbol[i], opts->set_value[i]);
+		}
+		if (opts->path) {
+			host_set_path(&inst[k], opts->path);
+		}
+		inst[k].late_worker = k && opts->late;
+		out[k] = (float*)calloc((size_t)inst[k].n_audio_out * total, sizeof(float));
+		plugin->descriptor->activate(inst[k].handle);
+		compare_run(&inst[k], blocks[k], warmup, total, out[k]);
+	}
+
+	memset(res, 0, sizeof(CompareResult));
+	for (c = 0; c < inst[0].n_audio_out; c++) {
+		for (i = 0; i < total; i++) {
+			const float d = fabsf(out[0][c * total + i] - out[1][c * total + i]);
+			if (d > CHECK_TOLERANCE) {
+				res->differing++;
+			}
+			if (d > res->max_diff) {
+				res->max_diff = d;
+			}
+		}
+	}
+
+	for (k = 0; k < 2; k++) {
+		if (plugin->descriptor->deactivate) {
+			plugin->descriptor->deactivate(inst[k].handle);
+		}
+		host_cleanup(&inst[k]);
+		free(out[k]);
+	}
+	return 0;
+}
+
+static void
+print_compare(const HostPlugin* plugin, double rate, uint32_t block,
+              uint32_t reference, const CompareResult* res)
+{
+	printf("{\"plugin\":\"%s\",\"rate\":%.0f,\"block\":%u,\"check\":\"blocks\","
+	       "\"reference_block\":%u,",
+	       plugin->uri, rate, block, reference);
+	if (res->max_diff > 0.f) {
+		printf("\"max_diff_dB\":%.1f,", 20. * log10(res->max_diff));
+	} else {
+		printf("\"max_diff_dB\":null,");
+	}
+	printf("\"differing\":%llu}\n", (unsigned long long)res->differing);
+	fflush(stdout);
+}
+
+/* Stereo 32 bit float WAV of exponentially decaying noise, a 2 second
+ * reverb impulse response at 48 kHz to benchmark convolution with */
+static void
+write_le(uint8_t* p, uint32_t value, int bytes)
+{
+	int i;
+	for (i = 0; i < bytes; i++) {
+		p[i] = (value >> (8 * i)) & 0xff;
+	}
+}
+
+static int
+write_ir(const char* path)
+{
+	const uint32_t rate = 48000;
+	const uint32_t frames = 2 * rate;
+	const uint32_t bytes = frames * 2 * sizeof(float);
+	uint8_t header[44];
+	uint32_t seed = 1;
+	uint32_t i;
+	FILE* f = fopen(path, "wb");
+
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+
+	memcpy(header, "RIFF", 4);
+	write_le(header + 4, 36 + bytes, 4);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	write_le(header + 16, 16, 4);
+	write_le(header + 20, 3, 2);
+	write_le(header + 22, 2, 2);
+	write_le(header + 24, rate, 4);
+	write_le(header + 28, rate * 2 * sizeof(float), 4);
+	write_le(header + 32, 2 * sizeof(float), 2);
+	write_le(header + 34, 32, 2);
+	memcpy(header + 36, "data", 4);
+	write_le(header + 40, bytes, 4);
+	fwrite(header, 1, sizeof(header), f);
+
+	for (i = 0; i < frames; i++) {
+		// 60 dB down after 2 seconds
+		const float env = expf(-6.9077553f * i / frames);
+		float frame[2];
+		frame[0] = env * noise(&seed);
+		frame[1] = env * noise(&seed);
+		fwrite(frame, sizeof(float), 2, f);
+	}
+	return fclose(f) ? 1 : 0;
+}
+
+static uint32_t
+parse_list(const char* arg, double* out, uint32_t max)
+{
+	uint32_t n = 0;
+	char* end;
+
+	while (*arg && n < max) {
+		out[n++] = strtod(arg, &end);
+		if (*end != ',') {
+			break;
+		}
+		arg = end + 1;
+	}
+	return n;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: a-bench [OPTION]... [BINDIR]\n"
+		"Benchmark run() of every LV2 bundle in BINDIR (default: bin).\n"
+		"Results are printed to stdout as one JSON object per line.\n\n"
+		"  -b LIST       block sizes (default: 16,32,...,4096)\n"
+		"  -r LIST       sample rates (default: 44100,48000,96000)\n"
+		"  -d SECONDS    audio processed per measurement (default: 1)\n"
+		"  -p STRING     only plugins whose URI contains STRING\n"
+		"  -s SYM=VALUE  set control port SYM (repeatable)\n"
+		"  -a MODE       automation: static, block or both (default: both)\n"
+		"                block sets every continuous control to a new\n"
+		"                random value before each run()\n"
+		"  -l NS         exit with an error if a measurement exceeds\n"
+		"                NS ns/sample\n"
+		"  -t            after each measurement feed silence after a noise\n"
+		"                burst, exit with an error if the decaying tail\n"
+		"                costs more than twice as much as noise\n"
+		"  -c            instead of timing, check the tail bypass against\n"
+		"                the full processing on noise bursts separated by\n"
+		"                the measurement length of silence\n"
+		"  -k            instead of timing, compare the output at each block\n"
+		"                size with the first one on the same noise, exit\n"
+		"                with an error if it differs by more than -100 dBFS\n"
+		"  -L            answer worker requests after the next run(), like\n"
+		"                a threaded worker; with -k the first block size\n"
+		"                is also compared with itself answered at once\n"
+		"  -f FILE       set the path parameter of plugins that have one\n"
+		"                (an impulse response) to FILE\n"
+		"  -w FILE       write a 2 s stereo impulse response to FILE and exit\n");
+}
+
+int
+main(int argc, char** argv)
+{
+	static HostPlugin plugins[HOST_MAX_PLUGINS];
+	BenchOptions opts;
+	double list[MAX_LIST];
+	int n_plugins;
+	int failed = 0;
+	int opt;
+	int i;
+	uint32_t r, b, n;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.bindir = "bin";
+	opts.seconds = 1.0;
+	opts.automation = 2;
+	for (n = 16; n <= 4096; n *= 2) {
+		opts.blocks[opts.n_blocks++] = n;
+	}
+	opts.rates[0] = 44100.;
+	opts.rates[1] = 48000.;
+	opts.rates[2] = 96000.;
+	opts.n_rates = 3;
+
+	while ((opt = getopt(argc, argv, "b:r:d:p:s:a:l:tckLf:w:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			n = parse_list(optarg, list, MAX_LIST);
+			for (opts.n_blocks = 0; opts.n_blocks < n; opts.n_blocks++) {
+				opts.blocks[opts.n_blocks] = (uint32_t)list[opts.n_blocks];
+			}
+			break;
+		case 'r':
+			opts.n_rates = parse_list(optarg, opts.rates, MAX_LIST);
+			break;
+		case 'd':
+			opts.seconds = atof(optarg);
+			break;
+		case 'p':
+			opts.filter = optarg;
+			break;
+		case 's':
+			if (opts.n_sets < MAX_SETS
+			    && sscanf(optarg, "%63[^=]=%f",
+			              opts.set_symbol[opts.n_sets], &opts.set_value[opts.n_sets]) == 2) {
+				opts.n_sets++;
+			}
+			break;
+		case 'a':
+			if (!strcmp(optarg, "static")) {
+				opts.automation = 0;
+			} else if (!strcmp(optarg, "block")) {
+				opts.automation = 1;
+			} else {
+				opts.automation = 2;
+			}
+			break;
+		case 'l':
+			opts.budget = atof(optarg);
+			break;
+		case 't':
+			opts.tail = 1;
+			break;
+		case 'c':
+			opts.check = 1;
+			break;
+		case 'k':
+			opts.compare = 1;
+			break;
+		case 'L':
+			opts.late = 1;
+			break;
+		case 'f':
+			opts.path = optarg;
+			break;
+		case 'w':
+			return write_ir(optarg);
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (optind < argc) {
+		opts.bindir = argv[optind];
+	}
+	if (opts.seconds <= 0. || !opts.n_blocks || !opts.n_rates) {
+		usage();
+		return 1;
+	}
+
+	n_plugins = host_scan(opts.bindir, plugins, HOST_MAX_PLUGINS);
+	if (n_plugins <= 0) {
+		fprintf(stderr, "a-bench: no plugins found in %s\n", opts.bindir);
+		return 1;
+	}
+
+	for (i = 0; i < n_plugins; i++) {
+		if (opts.filter && !strstr(plugins[i].uri, opts.filter)) {
+			continue;
+		}
+		for (r = 0; r < opts.n_rates; r++) {
+			for (b = 0; b < opts.n_blocks; b++) {
+				int a, t;
+				if (opts.check) {
+					CheckResult res;
+					if (check_one(&opts, &plugins[i], opts.rates[r], opts.blocks[b], &res)) {
+						continue;
+					}
+					print_check(&plugins[i], opts.rates[r], opts.blocks[b], &res);
+					if (res.early || res.max_diff > CHECK_TOLERANCE) {
+						fprintf(stderr, "a-bench: %s bypass changes the output at block %u\n",
+						        plugins[i].uri, opts.blocks[b]);
+						failed = 1;
+					}
+					continue;
+				}
+				if (opts.compare) {
+					CompareResult res;
+					if (compare_one(&opts, &plugins[i], opts.rates[r], opts.blocks[b], &res)) {
+						continue;
+					}
+					print_compare(&plugins[i], opts.rates[r], opts.blocks[b], opts.blocks[0], &res);
+					if (res.max_diff > CHECK_TOLERANCE) {
+						fprintf(stderr, "a-bench: %s output at block %u differs from block %u\n",
+						        plugins[i].uri, opts.blocks[b], opts.blocks[0]);
+						failed = 1;
+					}
+					continue;
+				}
+				for (a = 0; a < 2; a++) {
+					double noise_ns = 0.;
+					if ((opts.automation == 0 && a) || (opts.automation == 1 && !a)) {
+						continue;
+					}
+					for (t = 0; t <= opts.tail; t++) {
+						BenchResult res;
+						double ns;
+						if (bench_one(&opts, &plugins[i], opts.rates[r], opts.blocks[b], a, t, &res)) {
+							break;
+						}
+						print_result(&plugins[i], opts.rates[r], opts.blocks[b], a, t, &res);
+						ns = res.ns_total / res.samples;
+						if (opts.budget > 0. && ns > opts.budget) {
+							fprintf(stderr, "a-bench: %s over budget at block %u: %.3f > %.3f ns/sample\n",
+							        plugins[i].uri, opts.blocks[b], ns, opts.budget);
+							failed = 1;
+						}
+						if (!t) {
+							noise_ns = ns;
+						} else if (ns > TAIL_SLOWDOWN * noise_ns) {
+							fprintf(stderr, "a-bench: %s slower on the silent tail at block %u: %.3f > %.3f ns/sample\n",
+							        plugins[i].uri, opts.blocks[b], ns, noise_ns);
+							failed = 1;
+						}
+					}
+				}
+			}
+		}
+	}
+	return failed;
+}
@@ -0,0 +1,598 @@
+/* a-plugins offline host
+ * Copyright (C) 2016 Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lv2/lv2plug.in/ns/ext/atom/forge.h"
+#include "lv2/lv2plug.in/ns/ext/atom/util.h"
+#include "lv2/lv2plug.in/ns/ext/buf-size/buf-size.h"
+#include "lv2/lv2plug.in/ns/ext/options/options.h"
+#include "lv2/lv2plug.in/ns/ext/patch/patch.h"
+#include "lv2/lv2plug.in/ns/ext/urid/urid.h"
+
+#include "host.h"
+#include "rtcheck.h"
+
+#define MAX_URIDS 256
+
+/* URID map shared by all instances */
+
+static char* urids[MAX_URIDS];
+static uint32_t n_urids = 0;
+static pthread_mutex_t urid_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static LV2_URID
+urid_map(LV2_URID_Map_Handle handle, const char* uri)
+{
+	uint32_t i;
+	LV2_URID id = 0;
+
+	pthread_mutex_lock(&urid_lock);
+	for (i = 0; i < n_urids; i++) {
+		if (!strcmp(urids[i], uri)) {
+			id = i + 1;
+			break;
+		}
+	}
+	if (!id && n_urids < MAX_URIDS) {
+		urids[n_urids] = strdup(uri);
+		id = ++n_urids;
+	}
+	pthread_mutex_unlock(&urid_lock);
+	return id;
+}
+
+static const char*
+urid_unmap(LV2_URID_Unmap_Handle handle, LV2_URID urid)
+{
+	const char* uri = NULL;
+
+	pthread_mutex_lock(&urid_lock);
+	if (urid > 0 && urid <= n_urids) {
+		uri = urids[urid - 1];
+	}
+	pthread_mutex_unlock(&urid_lock);
+	return uri;
+}
+
+static LV2_URID_Map map = { NULL, urid_map };
+static LV2_URID_Unmap unmap = { NULL, urid_unmap };
+
+/* TTL scanning
+ *
+ * This is not a turtle parser, it only understands the layout used by the
+ * plugin descriptions in this repository: one subject per "<urn:...>" line
+ * at column 0 and one "[ a lv2:InputPort, ... ]" block per port.
+ */
+
+static HostPlugin*
+find_plugin(HostPlugin* plugins, int n, const char* uri)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		if (!strcmp(plugins[i].uri, uri)) {
+			return &plugins[i];
+		}
+	}
+	return NULL;
+}
+
+static int
+parse_float(const char* line, const char* key, float* value)
+{
+	const char* p = strstr(line, key);
+	if (!p) {
+		return 0;
+	}
+	return sscanf(p + strlen(key), "%f", value) == 1;
+}
+
+static void
+scan_ttl(const char* path, HostPlugin* plugins, int* n_plugins, int max_plugins)
+{
+	FILE* f = fopen(path, "r");
+	char line[1024];
+	char subject[256] = "";
+	HostPlugin* plugin = NULL;
+	HostPort* port = NULL;
+	int depth = 0;
+	int port_depth = 0;
+
+	if (!f) {
+		return;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		const char* c;
+		int quoted = 0;
+
+		if (line[0] == '<') {
+			char* end = strchr(line, '>');
+			if (end && end - line - 1 < (int)sizeof(subject)) {
+				memcpy(subject, line + 1, end - line - 1);
+				subject[end - line - 1] = '\0';
+			}
+			plugin = NULL;
+			port = NULL;
+			depth = 0;
+			continue;
+		}
+
+		if (!plugin && subject[0] && strstr(line, "a lv2:Plugin")) {
+			plugin = find_plugin(plugins, *n_plugins, subject);
+			if (!plugin && *n_plugins < max_plugins) {
+				plugin = &plugins[(*n_plugins)++];
+				memset(plugin, 0, sizeof(HostPlugin));
+				snprintf(plugin->uri, sizeof(plugin->uri), "%s", subject);
+			}
+		}
+
+		if (plugin && !plugin->path_property[0] && (c = strstr(line, "patch:writable <"))) {
+			sscanf(c + 16, "%255[^>]", plugin->path_property);
+		}
+
+		if (plugin && (strstr(line, "a lv2:InputPort") || strstr(line, "a lv2:OutputPort"))
+		    && plugin->n_ports < HOST_MAX_PORTS) {
+			port = &plugin->ports[plugin->n_ports++];
+			memset(port, 0, sizeof(HostPort));
+			port->is_input = strstr(line, "InputPort") != NULL;
+			if (strstr(line, "AudioPort")) {
+				port->type = PORT_AUDIO;
+			} else if (strstr(line, "AtomPort")) {
+				port->type = PORT_ATOM;
+			} else {
+				port->type = PORT_CONTROL;
+			}
+			port_depth = depth;
+		}
+
+		if (port && depth == port_depth) {
+			float v;
+			if (parse_float(line, "lv2:index", &v)) {
+				port->index = (uint32_t)v;
+			}
+			if (parse_float(line, "lv2:default", &v)) {
+				port->dflt = v;
+			}
+			if (parse_float(line, "lv2:minimum", &v)) {
+				port->min = v;
+			}
+			if (parse_float(line, "lv2:maximum", &v)) {
+				port->max = v;
+			}
+			if ((c = strstr(line, "lv2:symbol \""))) {
+				sscanf(c + 12, "%63[^\"]", port->symbol);
+			}
+			if (strstr(line, "lv2:toggled")) {
+				port->toggled = 1;
+			}
+			if (strstr(line, "lv2:integer")) {
+				port->integer = 1;
+			}
+			if (strstr(line, "lv2:enumeration")) {
+				port->enumeration = 1;
+			}
+			if (strstr(line, "#logarithmic")) {
+				port->logarithmic = 1;
+			}
+			if (strstr(line, "lv2:reportsLatency")) {
+				port->latency = 1;
+			}
+		}
+
+		for (c = line; *c; c++) {
+			if (*c == '"') {
+				quoted = !quoted;
+			} else if (!quoted && *c == '[') {
+				depth++;
+			} else if (!quoted && *c == ']') {
+				depth--;
+				if (port && depth < port_depth) {
+					port = NULL;
+				}
+			}
+		}
+	}
+	fclose(f);
+}
+
+static int
+has_suffix(const char* name, const char* suffix)
+{
+	size_t n = strlen(name);
+	size_t s = strlen(suffix);
+	return n > s && !strcmp(name + n - s, suffix);
+}
+
+static void
+scan_bundle(const char* bundle, HostPlugin* plugins, int* n_plugins, int max_plugins)
+{
+	DIR* dir = opendir(bundle);
+	struct dirent* ent;
+	char path[2048];
+	int first = *n_plugins;
+	int i;
+	uint32_t index;
+
+	if (!dir) {
+		return;
+	}
+	while ((ent = readdir(dir))) {
+		if (has_suffix(ent->d_name, ".ttl")) {
+			snprintf(path, sizeof(path), "%s/%s", bundle, ent->d_name);
+			scan_ttl(path, plugins, n_plugins, max_plugins);
+		}
+	}
+
+	rewinddir(dir);
+	while ((ent = readdir(dir))) {
+		void* lib;
+		LV2_Descriptor_Function df;
+		const LV2_Descriptor* desc;
+
+		if (!has_suffix(ent->d_name, ".so") && !has_suffix(ent->d_name, ".dylib")) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", bundle, ent->d_name);
+		lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+		if (!lib) {
+			fprintf(stderr, "a-bench: %s\n", dlerror());
+			continue;
+		}
+		df = (LV2_Descriptor_Function)dlsym(lib, "lv2_descriptor");
+		if (!df) {
+			fprintf(stderr, "a-bench: %s has no lv2_descriptor\n", path);
+			dlclose(lib);
+			continue;
+		}
+		for (index = 0; (desc = df(index)); index++) {
+			HostPlugin* p = find_plugin(plugins + first, *n_plugins - first, desc->URI);
+			if (p) {
+				p->descriptor = desc;
+				snprintf(p->bundle, sizeof(p->bundle), "%.1000s/", bundle);
+			}
+		}
+	}
+	closedir(dir);
+
+	/* drop TTL subjects that have no binary */
+	for (i = first; i < *n_plugins; ) {
+		if (!plugins[i].descriptor) {
+			memmove(&plugins[i], &plugins[i + 1], (*n_plugins - i - 1) * sizeof(HostPlugin));
+			(*n_plugins)--;
+		} else {
+			i++;
+		}
+	}
+}
+
+static int
+cmp_plugin(const void* a, const void* b)
+{
+	return strcmp(((const HostPlugin*)a)->uri, ((const HostPlugin*)b)->uri);
+}
+
+int
+host_scan(const char* bindir, HostPlugin* plugins, int max_plugins)
+{
+	DIR* dir = opendir(bindir);
+	struct dirent* ent;
+	char path[1024];
+	int n = 0;
+
+	if (!dir) {
+		perror(bindir);
+		return -1;
+	}
+	while ((ent = readdir(dir))) {
+		if (has_suffix(ent->d_name, ".lv2")) {
+			snprintf(path, sizeof(path), "%s/%s", bindir, ent->d_name);
+			scan_bundle(path, plugins, &n, max_plugins);
+		}
+	}
+	closedir(dir);
+
+	qsort(plugins, n, sizeof(HostPlugin), cmp_plugin);
+	return n;
+}
+
+/* Worker
+ *
+ * Requests and responses are queued as a uint32_t size followed by the
+ * data, padded to 8 bytes.
+ */
+
+static LV2_Worker_Status
+queue_push(uint8_t* queue, uint32_t* used, uint32_t size, const void* data)
+{
+	const uint32_t total = (sizeof(uint32_t) + size + 7) & ~7u;
+
+	if (*used + total > HOST_WORK_CAPACITY) {
+		return LV2_WORKER_ERR_NO_SPACE;
+	}
+	memcpy(queue + *used, &size, sizeof(uint32_t));
+	memcpy(queue + *used + sizeof(uint32_t), data, size);
+	*used += total;
+	return LV2_WORKER_SUCCESS;
+}
+
+static LV2_Worker_Status
+schedule_work(LV2_Worker_Schedule_Handle handle, uint32_t size, const void* data)
+{
+	HostInstance* inst = (HostInstance*)handle;
+	return queue_push(inst->requests, &inst->requests_size, size, data);
+}
+
+static LV2_Worker_Status
+respond(LV2_Worker_Respond_Handle handle, uint32_t size, const void* data)
+{
+	HostInstance* inst = (HostInstance*)handle;
+	return queue_push(inst->responses, &inst->responses_size, size, data);
+}
+
+static void
+host_respond(HostInstance* inst)
+{
+	uint32_t pos, size;
+
+	// On the audio thread like run(), held to the same rules
+	rtcheck_enter(inst->plugin->uri);
+	for (pos = 0; pos < inst->responses_size; pos += (sizeof(uint32_t) + size + 7) & ~7u) {
+		memcpy(&size, inst->responses + pos, sizeof(uint32_t));
+		inst->worker->work_response(inst->handle, size, inst->responses + pos + sizeof(uint32_t));
+	}
+	rtcheck_leave();
+	inst->responses_size = 0;
+}
+
+static void
+host_work(HostInstance* inst)
+{
+	uint32_t pos, size;
+
+	// Answers to the requests of the previous run()
+	if (inst->late_worker) {
+		host_respond(inst);
+	}
+
+	for (pos = 0; pos < inst->requests_size; pos += (sizeof(uint32_t) + size + 7) & ~7u) {
+		memcpy(&size, inst->requests + pos, sizeof(uint32_t));
+		inst->worker->work(inst->handle, respond, inst, size, inst->requests + pos + sizeof(uint32_t));
+	}
+	inst->requests_size = 0;
+
+	if (!inst->late_worker) {
+		host_respond(inst);
+	}
+
+	if (inst->worker->end_run) {
+		rtcheck_enter(inst->plugin->uri);
+		inst->worker->end_run(inst->handle);
+		rtcheck_leave();
+	}
+}
+
+/* Instances */
+
+static void*
+alloc_buffer(size_t size)
+{
+	void* ptr = NULL;
+	if (posix_memalign(&ptr, 64, size)) {
+		return NULL;
+	}
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+int
+host_instantiate(HostInstance* inst, const HostPlugin* plugin,
+                 double rate, uint32_t max_block)
+{
+	const LV2_Descriptor* desc = plugin->descriptor;
+	uint32_t i;
+
+	int32_t block_length = (int32_t)max_block;
+	int32_t min_block = 1;
+	LV2_Options_Option options[] = {
+		{ LV2_OPTIONS_INSTANCE, 0, urid_map(NULL, LV2_BUF_SIZE__maxBlockLength),
+		  sizeof(int32_t), urid_map(NULL, LV2_ATOM__Int), &block_length },
+		{ LV2_OPTIONS_INSTANCE, 0, urid_map(NULL, LV2_BUF_SIZE__minBlockLength),
+		  sizeof(int32_t), urid_map(NULL, LV2_ATOM__Int), &min_block },
+		{ LV2_OPTIONS_INSTANCE, 0, 0, 0, 0, NULL }
+	};
+	const LV2_Feature map_feature = { LV2_URID__map, &map };
+	const LV2_Feature unmap_feature = { LV2_URID__unmap, &unmap };
+	const LV2_Feature options_feature = { LV2_OPTIONS__options, options };
+	const LV2_Feature bounded_feature = { LV2_BUF_SIZE__boundedBlockLength, NULL };
+	const LV2_Feature schedule_feature = { LV2_WORKER__schedule, &inst->schedule };
+	const LV2_Feature* features[] = {
+		&map_feature, &unmap_feature, &options_feature, &bounded_feature,
+		&schedule_feature, NULL
+	};
+
+	memset(inst, 0, sizeof(HostInstance));
+	inst->plugin = plugin;
+	inst->max_block = max_block;
+	inst->atom_sequence = urid_map(NULL, LV2_ATOM__Sequence);
+	inst->atom_chunk = urid_map(NULL, LV2_ATOM__Chunk);
+	inst->schedule.handle = inst;
+	inst->schedule.schedule_work = schedule_work;
+	inst->requests = (uint8_t*)alloc_buffer(HOST_WORK_CAPACITY);
+	inst->responses = (uint8_t*)alloc_buffer(HOST_WORK_CAPACITY);
+	if (!inst->requests || !inst->responses) {
+		host_cleanup(inst);
+		return -1;
+	}
+
+	inst->handle = desc->instantiate(desc, rate, plugin->bundle, features);
+	if (!inst->handle) {
+		host_cleanup(inst);
+		return -1;
+	}
+	if (desc->extension_data) {
+		inst->worker = (const LV2_Worker_Interface*)desc->extension_data(LV2_WORKER__interface);
+	}
+
+	for (i = 0; i < plugin->n_ports; i++) {
+		const HostPort* port = &plugin->ports[i];
+		void* data = NULL;
+
+		switch (port->type) {
+		case PORT_AUDIO:
+			inst->audio[i] = (float*)alloc_buffer(max_block * sizeof(float));
+			data = inst->audio[i];
+			if (port->is_input) {
+				inst->audio_in[inst->n_audio_in++] = i;
+			} else {
+				inst->audio_out[inst->n_audio_out++] = i;
+			}
+			break;
+		case PORT_CONTROL:
+			inst->controls[i] = port->dflt;
+			data = &inst->controls[i];
+			break;
+		case PORT_ATOM:
+			inst->atoms[i] = (LV2_Atom_Sequence*)alloc_buffer(HOST_ATOM_CAPACITY);
+			data = inst->atoms[i];
+			break;
+		}
+		desc->connect_port(inst->handle, port->index, data);
+	}
+
+	host_run(inst, 0);
+	return 0;
+}
+
+void
+host_cleanup(HostInstance* inst)
+{
+	uint32_t i;
+
+	if (inst->handle) {
+		inst->plugin->descriptor->cleanup(inst->handle);
+	}
+	for (i = 0; i < HOST_MAX_PORTS; i++) {
+		free(inst->audio[i]);
+		free(inst->atoms[i]);
+	}
+	free(inst->requests);
+	free(inst->responses);
+	memset(inst, 0, sizeof(HostInstance));
+}
+
+// patch:Set of the pending path into the first atom input
+static void
+send_path(HostInstance* inst)
+{
+	const HostPlugin* plugin = inst->plugin;
+	LV2_Atom_Forge forge;
+	LV2_Atom_Forge_Frame frame;
+	uint32_t i;
+
+	for (i = 0; i < plugin->n_ports; i++) {
+		LV2_Atom_Sequence* seq = inst->atoms[i];
+		if (!seq || !plugin->ports[i].is_input) {
+			continue;
+		}
+		lv2_atom_forge_init(&forge, &map);
+		lv2_atom_forge_set_buffer(&forge, (uint8_t*)LV2_ATOM_BODY(seq) + seq->atom.size,
+		                          HOST_ATOM_CAPACITY - sizeof(LV2_Atom) - seq->atom.size);
+		lv2_atom_forge_frame_time(&forge, 0);
+		lv2_atom_forge_object(&forge, &frame, 0, urid_map(NULL, LV2_PATCH__Set));
+		lv2_atom_forge_key(&forge, urid_map(NULL, LV2_PATCH__property));
+		lv2_atom_forge_urid(&forge, urid_map(NULL, plugin->path_property));
+		lv2_atom_forge_key(&forge, urid_map(NULL, LV2_PATCH__value));
+		lv2_atom_forge_path(&forge, inst->path, strlen(inst->path));
+		lv2_atom_forge_pop(&forge, &frame);
+		seq->atom.size += forge.offset;
+		return;
+	}
+}
+
+void
+host_run(HostInstance* inst, uint32_t n_samples)
+{
+	const HostPlugin* plugin = inst->plugin;
+	uint32_t i;
+
+	for (i = 0; i < plugin->n_ports; i++) {
+		LV2_Atom_Sequence* seq = inst->atoms[i];
+		if (!seq) {
+			continue;
+		}
+		if (plugin->ports[i].is_input) {
+			seq->atom.type = inst->atom_sequence;
+			seq->atom.size = sizeof(LV2_Atom_Sequence_Body);
+			seq->body.unit = 0;
+			seq->body.pad = 0;
+		} else {
+			seq->atom.type = inst->atom_chunk;
+			seq->atom.size = HOST_ATOM_CAPACITY - sizeof(LV2_Atom);
+		}
+	}
+
+	if (n_samples > 0) {
+		if (inst->path[0]) {
+			send_path(inst);
+			inst->path[0] = '\0';
+		}
+		rtcheck_enter(plugin->uri);
+		plugin->descriptor->run(inst->handle, n_samples);
+		rtcheck_leave();
+		if (inst->worker) {
+			host_work(inst);
+		}
+	}
+}
+
+void
+host_set_defaults(HostInstance* inst)
+{
+	uint32_t i;
+	for (i = 0; i < inst->plugin->n_ports; i++) {
+		inst->controls[i] = inst->plugin->ports[i].dflt;
+	}
+}
+
+int
+host_set_control(HostInstance* inst, const char* symbol, float value)
+{
+	uint32_t i;
+	for (i = 0; i < inst->plugin->n_ports; i++) {
+		const HostPort* port = &inst->plugin->ports[i];
+		if (port->type == PORT_CONTROL && port->is_input && !strcmp(port->symbol, symbol)) {
+			inst->controls[i] = value;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int
+host_set_path(HostInstance* inst, const char* path)
+{
+	if (!inst->plugin->path_property[0]) {
+		return -1;
+	}
+	snprintf(inst->path, sizeof(inst->path), "%s", path);
+	return 0;
+}
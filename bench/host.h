@@ -0,0 +1,114 @@
+/* a-plugins offline host
+ * Copyright (C) 2016 Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef A_BENCH_HOST_H
+#define A_BENCH_HOST_H
+
+#include <stdint.h>
+
+#include "lv2/lv2plug.in/ns/lv2core/lv2.h"
+#include "lv2/lv2plug.in/ns/ext/atom/atom.h"
+#include "lv2/lv2plug.in/ns/ext/urid/urid.h"
+#include "lv2/lv2plug.in/ns/ext/worker/worker.h"
+
+#define HOST_MAX_PORTS		64
+#define HOST_MAX_PLUGINS	32
+#define HOST_ATOM_CAPACITY	8192
+#define HOST_WORK_CAPACITY	65536
+
+typedef enum {
+	PORT_AUDIO = 0,
+	PORT_CONTROL,
+	PORT_ATOM,
+} HostPortType;
+
+typedef struct {
+	uint32_t index;
+	char symbol[64];
+	HostPortType type;
+	int is_input;
+	float dflt;
+	float min;
+	float max;
+	int toggled;
+	int integer;
+	int enumeration;
+	int logarithmic;
+	int latency;
+} HostPort;
+
+typedef struct {
+	char uri[256];
+	char bundle[1024];
+	const LV2_Descriptor* descriptor;
+	uint32_t n_ports;
+	HostPort ports[HOST_MAX_PORTS];
+	// First patch:writable parameter, for host_set_path()
+	char path_property[256];
+} HostPlugin;
+
+typedef struct {
+	const HostPlugin* plugin;
+	LV2_Handle handle;
+	uint32_t max_block;
+	float controls[HOST_MAX_PORTS];
+	float* audio[HOST_MAX_PORTS];
+	LV2_Atom_Sequence* atoms[HOST_MAX_PORTS];
+	uint32_t n_audio_in;
+	uint32_t n_audio_out;
+	uint32_t audio_in[HOST_MAX_PORTS];
+	uint32_t audio_out[HOST_MAX_PORTS];
+
+	/* Mapped once, so run() takes no lock shared with other instances
+	 * on other threads */
+	LV2_URID atom_sequence;
+	LV2_URID atom_chunk;
+
+	/* Worker requests scheduled in run() and their responses: all work
+	 * is done right after run() returns, like a freewheeling host.  With
+	 * late_worker the responses are held back until after the next
+	 * run(), like a worker thread that takes a period to answer. */
+	LV2_Worker_Schedule schedule;
+	const LV2_Worker_Interface* worker;
+	uint8_t* requests;
+	uint32_t requests_size;
+	uint8_t* responses;
+	uint32_t responses_size;
+	int late_worker;
+
+	char path[1024];
+} HostInstance;
+
+/* Load every *.lv2 bundle below bindir, match each lv2_descriptor() entry
+ * against the ports declared in the bundle's TTL files.
+ * Returns the number of plugins found, or -1 on error. */
+int host_scan(const char* bindir, HostPlugin* plugins, int max_plugins);
+
+int host_instantiate(HostInstance* inst, const HostPlugin* plugin,
+                     double rate, uint32_t max_block);
+void host_cleanup(HostInstance* inst);
+
+/* Reset atom ports for the next cycle, call run() and do the work it
+ * scheduled */
+void host_run(HostInstance* inst, uint32_t n_samples);
+
+/* Set every control input to its default, or to value for a given symbol */
+void host_set_defaults(HostInstance* inst);
+int host_set_control(HostInstance* inst, const char* symbol, float value);
+
+/* Send path as a patch:Set of the plugin's path_property with the next
+ * run(), returns -1 if it has none */
+int host_set_path(HostInstance* inst, const char* path);
+
+#endif
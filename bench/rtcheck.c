@@ -0,0 +1,230 @@
+/* a-plugins offline host: real-time audit of run()
+ * Copyright (C) 2016 Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rtcheck.h"
+
+#ifndef __GLIBC__
+# error "the audit interposes glibc's allocator"
+#endif
+
+/* Functions defined in the executable take precedence over libc's for
+ * every library loaded, the plugins included.  The allocator forwards
+ * to glibc's own entry points, everything else to the next definition,
+ * looked up before main(). */
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void* ptr);
+
+// URI of the plugin this audio thread is in, NULL outside
+static __thread const char* in_run;
+
+static int (*next_mutex_lock)(pthread_mutex_t*);
+static int (*next_cond_wait)(pthread_cond_t*, pthread_mutex_t*);
+static int (*next_cond_timedwait)(pthread_cond_t*, pthread_mutex_t*, const struct timespec*);
+static int (*next_rwlock_rdlock)(pthread_rwlock_t*);
+static int (*next_rwlock_wrlock)(pthread_rwlock_t*);
+static int (*next_sem_wait)(sem_t*);
+static int (*next_nanosleep)(const struct timespec*, struct timespec*);
+static int (*next_clock_nanosleep)(clockid_t, int, const struct timespec*, struct timespec*);
+static int (*next_usleep)(useconds_t);
+
+__attribute__((constructor)) static void
+rtcheck_init(void)
+{
+	next_mutex_lock = dlsym(RTLD_NEXT, "pthread_mutex_lock");
+	next_cond_wait = dlsym(RTLD_NEXT, "pthread_cond_wait");
+	next_cond_timedwait = dlsym(RTLD_NEXT, "pthread_cond_timedwait");
+	next_rwlock_rdlock = dlsym(RTLD_NEXT, "pthread_rwlock_rdlock");
+	next_rwlock_wrlock = dlsym(RTLD_NEXT, "pthread_rwlock_wrlock");
+	next_sem_wait = dlsym(RTLD_NEXT, "sem_wait");
+	next_nanosleep = dlsym(RTLD_NEXT, "nanosleep");
+	next_clock_nanosleep = dlsym(RTLD_NEXT, "clock_nanosleep");
+	next_usleep = dlsym(RTLD_NEXT, "usleep");
+}
+
+void
+rtcheck_enter(const char* uri)
+{
+	in_run = uri;
+}
+
+void
+rtcheck_leave(void)
+{
+	in_run = NULL;
+}
+
+// Straight to the fd, stdio may allocate itself
+static void
+put(const char* str)
+{
+	if (write(STDERR_FILENO, str, strlen(str)) < 0) {
+		return;
+	}
+}
+
+static void
+check(const char* function)
+{
+	const char* const uri = in_run;
+
+	if (!uri) {
+		return;
+	}
+	in_run = NULL;
+	put("a-bench: ");
+	put(function);
+	put("() on the audio thread of ");
+	put(uri);
+	put(", not real-time safe\n");
+	abort();
+}
+
+void*
+malloc(size_t size)
+{
+	check("malloc");
+	return __libc_malloc(size);
+}
+
+void*
+calloc(size_t n, size_t size)
+{
+	check("calloc");
+	return __libc_calloc(n, size);
+}
+
+void*
+realloc(void* ptr, size_t size)
+{
+	check("realloc");
+	return __libc_realloc(ptr, size);
+}
+
+void
+free(void* ptr)
+{
+	if (ptr) {
+		check("free");
+	}
+	__libc_free(ptr);
+}
+
+int
+posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+	void* mem;
+
+	check("posix_memalign");
+	mem = __libc_memalign(alignment, size);
+	if (!mem) {
+		return ENOMEM;
+	}
+	*ptr = mem;
+	return 0;
+}
+
+void*
+aligned_alloc(size_t alignment, size_t size)
+{
+	check("aligned_alloc");
+	return __libc_memalign(alignment, size);
+}
+
+void*
+memalign(size_t alignment, size_t size)
+{
+	check("memalign");
+	return __libc_memalign(alignment, size);
+}
+
+/* An uncontended lock costs little, but it is never known to be
+ * uncontended: trylock is the only one allowed */
+int
+pthread_mutex_lock(pthread_mutex_t* mutex)
+{
+	check("pthread_mutex_lock");
+	return next_mutex_lock(mutex);
+}
+
+int
+pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex)
+{
+	check("pthread_cond_wait");
+	return next_cond_wait(cond, mutex);
+}
+
+int
+pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex,
+                       const struct timespec* abstime)
+{
+	check("pthread_cond_timedwait");
+	return next_cond_timedwait(cond, mutex, abstime);
+}
+
+int
+pthread_rwlock_rdlock(pthread_rwlock_t* lock)
+{
+	check("pthread_rwlock_rdlock");
+	return next_rwlock_rdlock(lock);
+}
+
+int
+pthread_rwlock_wrlock(pthread_rwlock_t* lock)
+{
+	check("pthread_rwlock_wrlock");
+	return next_rwlock_wrlock(lock);
+}
+
+int
+sem_wait(sem_t* sem)
+{
+	check("sem_wait");
+	return next_sem_wait(sem);
+}
+
+int
+nanosleep(const struct timespec* req, struct timespec* rem)
+{
+	check("nanosleep");
+	return next_nanosleep(req, rem);
+}
+
+int
+clock_nanosleep(clockid_t clock, int flags, const struct timespec* req, struct timespec* rem)
+{
+	check("clock_nanosleep");
+	return next_clock_nanosleep(clock, flags, req, rem);
+}
+
+int
+usleep(useconds_t usec)
+{
+	check("usleep");
+	return next_usleep(usec);
+}
@@ -0,0 +1,36 @@
+/* a-plugins offline host: real-time audit of run()
+ * Copyright (C) 2016 Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef A_BENCH_RTCHECK_H
+#define A_BENCH_RTCHECK_H
+
+/*
+ * Built with HOST_RTCHECK and rtcheck.c, the host interposes the
+ * allocator, locks and sleeps for the plugins it loads.  Any of them
+ * called between rtcheck_enter() and rtcheck_leave() on the same thread
+ * aborts with the function and the plugin's URI: what lv2:hardRTCapable
+ * promises not to do.  The host enters around everything the audio
+ * thread calls: run(), and the worker's work_response() and end_run().
+ * Without HOST_RTCHECK both cost nothing.
+ */
+
+#ifdef HOST_RTCHECK
+void rtcheck_enter(const char* uri);
+void rtcheck_leave(void);
+#else
+static inline void rtcheck_enter(const char* uri) { (void)uri; }
+static inline void rtcheck_leave(void) {}
+#endif
+
+#endif
@@ -0,0 +1,676 @@
+/* a-stress: many a-plugins instances on a thread pool, like a DAW session
+ * Copyright (C) 2016 Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "host.h"
+
+#define MAX_MIX 16
+#define MAX_THREADS 64
+
+// Periods run before measuring, in seconds
+#define WARMUP 0.5
+
+/*
+ * One process cycle of a session: every instance is a job, dealt out to
+ * the workers' deques so that without stealing an instance stays on the
+ * same thread from period to period, as its state stays in that core's
+ * cache.  A worker runs its own jobs newest first and, when out of them,
+ * steals the oldest of another worker's.  The period ends when all jobs
+ * are done, the deadline is the period length.
+ */
+
+typedef struct {
+	char name[256];
+	uint32_t weight;
+	const HostPlugin* plugin;
+	uint32_t count;
+} MixEntry;
+
+typedef struct {
+	const char* bindir;
+	uint32_t n_instances;
+	uint32_t n_threads;
+	uint32_t block;
+	double rate;
+	double seconds;
+	int paced;      // sleep until each period starts, as a soundcard would
+	uint64_t raw;   // model specific perf event, such as L2 misses
+	uint32_t n_mix;
+	MixEntry mix[MAX_MIX];
+} StressOptions;
+
+/* Chase-Lev deque without growing, it holds every job of a period.
+ * bottom is only written by its owner, top is claimed with a CAS. */
+typedef struct {
+	int64_t top;
+	uint8_t pad0[64 - sizeof(int64_t)];
+	int64_t bottom;
+	uint8_t pad1[64 - sizeof(int64_t)];
+	uint32_t* jobs;
+} Deque;
+
+#define DEQUE_EMPTY -1
+#define DEQUE_ABORT -2
+
+// Owner side, newest job first
+static int64_t
+deque_pop(Deque* d)
+{
+	const int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+	int64_t t, job = DEQUE_EMPTY;
+
+	__atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+	if (t <= b) {
+		job = d->jobs[b];
+		if (t == b) {
+			// Last one, a thief may be after it too
+			if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+			                                 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+				job = DEQUE_EMPTY;
+			}
+			__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		}
+	} else {
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return job;
+}
+
+// Thief side, oldest job first
+static int64_t
+deque_steal(Deque* d)
+{
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	int64_t b;
+	int64_t job;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b) {
+		return DEQUE_EMPTY;
+	}
+	job = d->jobs[t];
+	if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+	                                 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		return DEQUE_ABORT;
+	}
+	return job;
+}
+
+/* Cache counters of one worker thread through perf_event, fd -1 where
+ * the kernel or the CPU does not have them */
+
+enum {
+	COUNTER_L1D = 0,  // L1 data cache read misses
+	COUNTER_LLC,      // last level cache read misses
+	COUNTER_MISSES,   // cache-misses, what the CPU reports for it
+	COUNTER_RAW,      // the event given with -e
+	COUNTERS
+};
+
+static const char* const counter_names[COUNTERS] = {
+	"l1d_read_misses", "llc_read_misses", "cache_misses", "raw"
+};
+
+typedef struct {
+	int fd[COUNTERS];
+} CacheCounters;
+
+static void
+counters_open(CacheCounters* cc, uint64_t raw)
+{
+	int i;
+
+	for (i = 0; i < COUNTERS; i++) {
+		cc->fd[i] = -1;
+	}
+#ifdef __linux__
+	for (i = 0; i < COUNTERS; i++) {
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		switch (i) {
+		case COUNTER_L1D:
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = PERF_COUNT_HW_CACHE_L1D
+				| (PERF_COUNT_HW_CACHE_OP_READ << 8)
+				| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			break;
+		case COUNTER_LLC:
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = PERF_COUNT_HW_CACHE_LL
+				| (PERF_COUNT_HW_CACHE_OP_READ << 8)
+				| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			break;
+		case COUNTER_MISSES:
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_CACHE_MISSES;
+			break;
+		case COUNTER_RAW:
+			if (!raw) {
+				continue;
+			}
+			attr.type = PERF_TYPE_RAW;
+			attr.config = raw;
+			break;
+		}
+		cc->fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+#endif
+}
+
+static void
+counters_start(CacheCounters* cc)
+{
+#ifdef __linux__
+	int i;
+	for (i = 0; i < COUNTERS; i++) {
+		if (cc->fd[i] >= 0) {
+			ioctl(cc->fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(cc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+#endif
+}
+
+// Adds the counts to total, marks counters that did not open with -1
+static void
+counters_close(CacheCounters* cc, int64_t* total)
+{
+	int i;
+
+	for (i = 0; i < COUNTERS; i++) {
+		uint64_t count = 0;
+		if (cc->fd[i] < 0) {
+			total[i] = -1;
+			continue;
+		}
+#ifdef __linux__
+		ioctl(cc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(cc->fd[i], &count, sizeof(count)) == sizeof(count) && total[i] >= 0) {
+			total[i] += (int64_t)count;
+		}
+		close(cc->fd[i]);
+#endif
+		cc->fd[i] = -1;
+	}
+}
+
+/* The pool */
+
+struct Stress;
+
+typedef struct {
+	struct Stress* stress;
+	uint32_t index;
+	pthread_t thread;
+	Deque deque;
+	uint64_t runs;
+	uint64_t steals;
+	CacheCounters counters;
+} Worker;
+
+typedef struct Stress {
+	const StressOptions* opts;
+	HostInstance* instances;
+	Worker workers[MAX_THREADS];
+	pthread_barrier_t start;
+	pthread_barrier_t done;
+	int measure;    // counters run from the first measured period on
+	int quit;
+	int64_t cache[COUNTERS];
+	pthread_mutex_t lock;
+} Stress;
+
+static void
+run_job(Worker* w, int64_t job)
+{
+	Stress* const s = w->stress;
+	host_run(&s->instances[job], s->opts->block);
+	w->runs++;
+}
+
+/* Until every deque is empty: own jobs first, then the others' in turn.
+ * No job is added during a period, so one pass over the others will do. */
+static void
+run_period(Worker* w)
+{
+	Stress* const s = w->stress;
+	const uint32_t n_threads = s->opts->n_threads;
+	int64_t job;
+	uint32_t i;
+
+	while ((job = deque_pop(&w->deque)) >= 0) {
+		run_job(w, job);
+	}
+	for (i = 1; i < n_threads; i++) {
+		Deque* const victim = &s->workers[(w->index + i) % n_threads].deque;
+		while ((job = deque_steal(victim)) != DEQUE_EMPTY) {
+			if (job >= 0) {
+				run_job(w, job);
+				w->steals++;
+			}
+		}
+	}
+}
+
+static void*
+worker_thread(void* arg)
+{
+	Worker* const w = (Worker*)arg;
+	Stress* const s = w->stress;
+	int counting = 0;
+
+	counters_open(&w->counters, s->opts->raw);
+	for (;;) {
+		pthread_barrier_wait(&s->start);
+		if (s->quit) {
+			break;
+		}
+		if (s->measure && !counting) {
+			counters_start(&w->counters);
+			counting = 1;
+		}
+		run_period(w);
+		pthread_barrier_wait(&s->done);
+	}
+	pthread_mutex_lock(&s->lock);
+	counters_close(&w->counters, s->cache);
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+// Jobs dealt round robin, the same way every period
+static void
+deal_jobs(Stress* s)
+{
+	const uint32_t n_threads = s->opts->n_threads;
+	uint32_t i;
+
+	for (i = 0; i < n_threads; i++) {
+		s->workers[i].deque.top = 0;
+		s->workers[i].deque.bottom = 0;
+	}
+	for (i = 0; i < s->opts->n_instances; i++) {
+		Deque* const d = &s->workers[i % n_threads].deque;
+		d->jobs[d->bottom++] = i;
+	}
+}
+
+/* Benchmark harness */
+
+static inline double
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+sleep_until(double ns)
+{
+	struct timespec ts;
+	ts.tv_sec = (time_t)(ns / 1e9);
+	ts.tv_nsec = (long)(ns - ts.tv_sec * 1e9);
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* Deterministic white noise at -12 dBFS */
+static inline float
+noise(uint32_t* seed)
+{
+	*seed = *seed * 1664525u + 1013904223u;
+	return 0.25f * ((float)(*seed >> 8) / 8388608.f - 1.f);
+}
+
+static int
+cmp_double(const void* a, const void* b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+// Of the plugins whose URI contains name, the one with the shortest URI
+static const HostPlugin*
+find_plugin(const HostPlugin* plugins, int n_plugins, const char* name)
+{
+	const HostPlugin* best = NULL;
+	int i;
+
+	for (i = 0; i < n_plugins; i++) {
+		if (strstr(plugins[i].uri, name)
+		    && (!best || strlen(plugins[i].uri) < strlen(best->uri))) {
+			best = &plugins[i];
+		}
+	}
+	return best;
+}
+
+static int
+parse_mix(const char* arg, StressOptions* opts)
+{
+	opts->n_mix = 0;
+	while (*arg && opts->n_mix < MAX_MIX) {
+		MixEntry* const e = &opts->mix[opts->n_mix];
+		int used = 0;
+
+		e->weight = 1;
+		if (sscanf(arg, "%255[^:,]%n", e->name, &used) != 1) {
+			return -1;
+		}
+		arg += used;
+		if (*arg == ':') {
+			e->weight = (uint32_t)strtoul(arg + 1, (char**)&arg, 10);
+		}
+		if (e->weight) {
+			opts->n_mix++;
+		}
+		if (*arg != ',') {
+			break;
+		}
+		arg++;
+	}
+	return opts->n_mix ? 0 : -1;
+}
+
+/* Instance i gets the entry furthest behind its share, so the plugins
+ * are interleaved in memory as on a mixer */
+static uint32_t
+next_entry(StressOptions* opts, uint32_t i)
+{
+	uint32_t total = 0, k, best = 0;
+	double lag = -1e300;
+
+	for (k = 0; k < opts->n_mix; k++) {
+		total += opts->mix[k].weight;
+	}
+	for (k = 0; k < opts->n_mix; k++) {
+		const double l = (double)(i + 1) * opts->mix[k].weight / total - opts->mix[k].count;
+		if (l > lag) {
+			lag = l;
+			best = k;
+		}
+	}
+	opts->mix[best].count++;
+	return best;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: a-stress [OPTION]... [BINDIR]\n"
+		"Run many instances of the LV2 bundles in BINDIR (default: bin) on a\n"
+		"work stealing thread pool, one job per instance and period.\n"
+		"The result is printed to stdout as one JSON object.\n\n"
+		"  -n COUNT      instances (default: 256)\n"
+		"  -m MIX        plugins by URI substring with a weight, default:\n"
+		"                a-comp:1,a-eq:1,a-filter:1,a-delay:1\n"
+		"  -j THREADS    worker threads (default: online CPUs)\n"
+		"  -b FRAMES     period size (default: 256)\n"
+		"  -r RATE       sample rate (default: 48000)\n"
+		"  -d SECONDS    audio processed (default: 10)\n"
+		"  -R            start each period on time rather than right after\n"
+		"                the last, so caches cool down in between\n"
+		"  -e CONFIG     also count the raw perf event CONFIG, in hex,\n"
+		"                such as 0x3f24 for L2 misses on recent Intel\n");
+}
+
+int
+main(int argc, char** argv)
+{
+	static HostPlugin plugins[HOST_MAX_PLUGINS];
+	static Stress stress;
+	Stress* const s = &stress;
+	StressOptions opts;
+	uint32_t* jobs;
+	double* periods;
+	double deadline, start, busy = 0.;
+	uint32_t n_periods, n_warmup, misses = 0;
+	uint64_t runs = 0, steals = 0;
+	uint32_t seed = 1;
+	uint32_t i, k, c, p;
+	int n_plugins;
+	int opt;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.bindir = "bin";
+	opts.n_instances = 256;
+	opts.n_threads = (uint32_t)sysconf(_SC_NPROCESSORS_ONLN);
+	opts.block = 256;
+	opts.rate = 48000.;
+	opts.seconds = 10.;
+	parse_mix("a-comp:1,a-eq:1,a-filter:1,a-delay:1", &opts);
+
+	while ((opt = getopt(argc, argv, "n:m:j:b:r:d:Re:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			opts.n_instances = (uint32_t)atoi(optarg);
+			break;
+		case 'm':
+			if (parse_mix(optarg, &opts)) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'j':
+			opts.n_threads = (uint32_t)atoi(optarg);
+			break;
+		case 'b':
+			opts.block = (uint32_t)atoi(optarg);
+			break;
+		case 'r':
+			opts.rate = atof(optarg);
+			break;
+		case 'd':
+			opts.seconds = atof(optarg);
+			break;
+		case 'R':
+			opts.paced = 1;
+			break;
+		case 'e':
+			opts.raw = strtoull(optarg, NULL, 16);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (optind < argc) {
+		opts.bindir = argv[optind];
+	}
+	if (!opts.n_instances || !opts.block || opts.rate <= 0. || opts.seconds <= 0.) {
+		usage();
+		return 1;
+	}
+	if (opts.n_threads < 1) {
+		opts.n_threads = 1;
+	} else if (opts.n_threads > MAX_THREADS) {
+		opts.n_threads = MAX_THREADS;
+	}
+
+	n_plugins = host_scan(opts.bindir, plugins, HOST_MAX_PLUGINS);
+	if (n_plugins <= 0) {
+		fprintf(stderr, "a-stress: no plugins found in %s\n", opts.bindir);
+		return 1;
+	}
+	for (k = 0; k < opts.n_mix; k++) {
+		opts.mix[k].plugin = find_plugin(plugins, n_plugins, opts.mix[k].name);
+		if (!opts.mix[k].plugin) {
+			fprintf(stderr, "a-stress: no plugin matches %s\n", opts.mix[k].name);
+			return 1;
+		}
+	}
+
+	s->opts = &opts;
+	s->instances = (HostInstance*)calloc(opts.n_instances, sizeof(HostInstance));
+	jobs = (uint32_t*)calloc(opts.n_instances * opts.n_threads, sizeof(uint32_t));
+	if (!s->instances || !jobs) {
+		fprintf(stderr, "a-stress: out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < opts.n_instances; i++) {
+		HostInstance* const inst = &s->instances[i];
+		const HostPlugin* const plugin = opts.mix[next_entry(&opts, i)].plugin;
+
+		if (host_instantiate(inst, plugin, opts.rate, opts.block)) {
+			fprintf(stderr, "a-stress: failed to instantiate %s\n", plugin->uri);
+			return 1;
+		}
+		// Noise that never changes, fresh buffers would only add writes
+		for (c = 0; c < inst->n_audio_in; c++) {
+			float* const buf = inst->audio[inst->audio_in[c]];
+			for (k = 0; k < opts.block; k++) {
+				buf[k] = noise(&seed);
+			}
+		}
+		plugin->descriptor->activate(inst->handle);
+	}
+
+	n_warmup = (uint32_t)(WARMUP * opts.rate / opts.block) + 1;
+	n_periods = (uint32_t)(opts.seconds * opts.rate / opts.block) + 1;
+	periods = (double*)malloc(n_periods * sizeof(double));
+	if (!periods) {
+		fprintf(stderr, "a-stress: out of memory\n");
+		return 1;
+	}
+	deadline = 1e9 * opts.block / opts.rate;
+
+	pthread_barrier_init(&s->start, NULL, opts.n_threads);
+	pthread_barrier_init(&s->done, NULL, opts.n_threads);
+	pthread_mutex_init(&s->lock, NULL);
+	for (i = 0; i < opts.n_threads; i++) {
+		Worker* const w = &s->workers[i];
+		w->stress = s;
+		w->index = i;
+		w->deque.jobs = jobs + i * opts.n_instances;
+	}
+	// Worker 0 is this thread
+	for (i = 1; i < opts.n_threads; i++) {
+		if (pthread_create(&s->workers[i].thread, NULL, worker_thread, &s->workers[i])) {
+			fprintf(stderr, "a-stress: failed to start worker %u\n", i);
+			return 1;
+		}
+	}
+	counters_open(&s->workers[0].counters, opts.raw);
+
+	start = now_ns();
+	for (p = 0; p < n_warmup + n_periods; p++) {
+		const double due = start + p * deadline;
+		double t0, t1;
+
+		if (p == n_warmup) {
+			for (i = 0; i < opts.n_threads; i++) {
+				s->workers[i].runs = 0;
+				s->workers[i].steals = 0;
+			}
+			s->measure = 1;
+			counters_start(&s->workers[0].counters);
+		}
+		deal_jobs(s);
+		if (opts.paced) {
+			sleep_until(due);
+		}
+
+		t0 = now_ns();
+		pthread_barrier_wait(&s->start);
+		run_period(&s->workers[0]);
+		pthread_barrier_wait(&s->done);
+		t1 = now_ns();
+
+		if (p >= n_warmup) {
+			// Paced, a late start eats into the period too
+			const double length = opts.paced ? t1 - due : t1 - t0;
+			periods[p - n_warmup] = length;
+			misses += length > deadline;
+			busy += t1 - t0;
+		}
+		// Like a soundcard after an xrun, start over from now
+		if (opts.paced && t1 > due + deadline) {
+			start = t1 - (p + 1) * deadline;
+		}
+	}
+
+	s->quit = 1;
+	pthread_barrier_wait(&s->start);
+	for (i = 1; i < opts.n_threads; i++) {
+		pthread_join(s->workers[i].thread, NULL);
+	}
+	counters_close(&s->workers[0].counters, s->cache);
+	for (i = 0; i < opts.n_threads; i++) {
+		runs += s->workers[i].runs;
+		steals += s->workers[i].steals;
+	}
+
+	qsort(periods, n_periods, sizeof(double), cmp_double);
+	printf("{\"instances\":%u,\"mix\":{", opts.n_instances);
+	for (k = 0; k < opts.n_mix; k++) {
+		printf("%s\"%s\":%u", k ? "," : "", opts.mix[k].plugin->uri, opts.mix[k].count);
+	}
+	printf("},\"threads\":%u,\"rate\":%.0f,\"block\":%u,\"paced\":%s,\"periods\":%u,"
+	       "\"deadline_us\":%.1f,\"period_us_p50\":%.1f,\"period_us_p99\":%.1f,"
+	       "\"period_us_max\":%.1f,\"deadline_misses\":%u,\"miss_ratio\":%.4f,",
+	       opts.n_threads, opts.rate, opts.block, opts.paced ? "true" : "false", n_periods,
+	       deadline / 1e3, periods[n_periods / 2] / 1e3,
+	       periods[(uint32_t)(0.99 * (n_periods - 1))] / 1e3, periods[n_periods - 1] / 1e3,
+	       misses, (double)misses / n_periods);
+	// Samples of all instances per second of processing, and against real time
+	printf("\"samples_per_second\":%.0f,\"dsp_load\":%.3f,\"runs\":%llu,\"steals\":%llu,",
+	       1e9 * runs * opts.block / busy, busy / (n_periods * deadline),
+	       (unsigned long long)runs, (unsigned long long)steals);
+	printf("\"cache\":{");
+	for (k = 0; k < COUNTERS; k++) {
+		printf("%s\"%s\":", k ? "," : "", counter_names[k]);
+		if (s->cache[k] >= 0) {
+			printf("%lld", (long long)s->cache[k]);
+		} else {
+			printf("null");
+		}
+	}
+	printf("}}\n");
+
+	for (i = 0; i < opts.n_instances; i++) {
+		const LV2_Descriptor* const desc = s->instances[i].plugin->descriptor;
+		if (desc->deactivate) {
+			desc->deactivate(s->instances[i].handle);
+		}
+		host_cleanup(&s->instances[i]);
+	}
+	free(s->instances);
+	free(jobs);
+	free(periods);
+	return 0;
+}